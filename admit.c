@@ -0,0 +1,172 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "admit.h"
+#include "alloc.h"
+#include "params.h"
+#include "runner.h"
+#include "stats.h"
+#include "util/trace.h"
+#include "vars.h"
+#include "wait.h"
+
+/* A bound on the load, and where its figure is read from */
+struct bound {
+  char const *name;
+  char const *path;
+  char const *format; /* reads the figure with sscanf() */
+};
+
+static struct bound const bounds[] = {
+    {"ADMIT_CPU", "/proc/pressure/cpu", "some avg10=%lf"},
+    {"ADMIT_MEMORY", "/proc/pressure/memory", "some avg10=%lf"},
+    {"ADMIT_IO", "/proc/pressure/io", "some avg10=%lf"},
+    {"ADMIT_LOADAVG", "/proc/loadavg", "%lf"},
+};
+
+static struct command_list **queue;
+static size_t queue_len = 0;
+static uint64_t next_check = 0; /* stats_now() time */
+static int admitted = 0;         /* the first in the queue may start */
+
+/* The value of bound name for the job started by cmd */
+static char const *
+setting(struct command const *cmd, char const *name)
+{
+  for (size_t i = 0; i < cmd->assignment_count; ++i) {
+    if (strcmp(cmd->assignments[i]->name, name) == 0) {
+      return cmd->assignments[i]->value;
+    }
+  }
+  return vars_get(name);
+}
+
+/* Reads the figure b bounds; returns -1 if it cannot be read */
+static int
+read_figure(struct bound const *b, double *figure)
+{
+  char buf[128];
+  int fd = open(b->path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return -1;
+  ssize_t const n = read(fd, buf, sizeof buf - 1);
+  close(fd);
+  if (n <= 0) return -1;
+  buf[n] = '\0';
+  return sscanf(buf, b->format, figure) == 1 ? 0 : -1;
+}
+
+/* Whether the host is too busy for the job started by cmd; bounds that are
+ * not numbers are complained about if loud, and ignored */
+static int
+busy(struct command const *cmd, int loud)
+{
+  for (size_t i = 0; i < sizeof bounds / sizeof *bounds; ++i) {
+    char const *s = setting(cmd, bounds[i].name);
+    if (!s || !*s) continue;
+    char *end;
+    errno = 0;
+    double const limit = strtod(s, &end);
+    if (errno || *end || limit < 0) {
+      if (loud) {
+        fprintf(stderr, "%s: `%s' is not a number\n", bounds[i].name, s);
+      }
+      continue;
+    }
+    double figure;
+    if (read_figure(&bounds[i], &figure) < 0) {
+      trace(TRACE_SPAWN, "%s cannot be read", bounds[i].path);
+      continue;
+    }
+    if (figure > limit) {
+      trace(TRACE_SPAWN, "%s is %.2f, over %s", bounds[i].path, figure, s);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+int
+admit_should_defer(struct command const *cmd)
+{
+  return queue_len > 0 || busy(cmd, 1);
+}
+
+void
+admit_defer(struct command_list *cl)
+{
+  void *tmp = realloc(queue, sizeof *queue * (queue_len + 1));
+  if (!tmp) {
+    /* Better to start it than to lose it */
+    run_expanded_command_list(cl);
+    command_list_free(cl);
+    alloc_free(cl);
+    return;
+  }
+  queue = tmp;
+  queue[queue_len++] = cl;
+  if (queue_len == 1) next_check = stats_now() + ADMIT_POLL_MS * 1000000ull;
+  fprintf(stderr, "[queued %zu]\n", queue_len);
+}
+
+int
+admit_ready(void)
+{
+  if (!queue_len) return -1;
+  if (admitted) return 0;
+  uint64_t const now = stats_now();
+  if (now < next_check) return (next_check - now + 999999) / 1000000;
+  next_check = now + ADMIT_POLL_MS * 1000000ull;
+  if (busy(queue[0]->commands[0], 0)) return ADMIT_POLL_MS;
+  admitted = 1;
+  return 0;
+}
+
+void
+admit_run(void)
+{
+  if (admit_ready() != 0) return;
+  admitted = 0;
+  struct command_list *cl = queue[0];
+  memmove(queue, queue + 1, sizeof *queue * --queue_len);
+  /* It starts between two commands, which must not see it in $? or $! */
+  struct params const saved = params;
+  run_expanded_command_list(cl);
+  params = saved;
+  command_list_free(cl);
+  alloc_free(cl);
+}
+
+void
+admit_drain(void)
+{
+  while (queue_len) {
+    int const ms = admit_ready();
+    if (ms > 0) {
+      /* Jobs that finish meanwhile make room for the rest */
+      wait_on_bg_jobs();
+      struct timespec const ts = {ms / 1000, ms % 1000 * 1000000L};
+      nanosleep(&ts, 0);
+    }
+    admit_run();
+  }
+}
+
+void
+admit_cleanup(void)
+{
+  for (size_t i = 0; i < queue_len; ++i) {
+    command_list_free(queue[i]);
+    alloc_free(queue[i]);
+  }
+  free(queue);
+  queue = 0;
+  queue_len = 0;
+  admitted = 0;
+}
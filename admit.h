@@ -0,0 +1,48 @@
+#pragma once
+/** @file Admission of background jobs by load
+ *
+ * A background pipeline is started right away only if the host is not too
+ * busy. The shell variables ADMIT_CPU, ADMIT_MEMORY and ADMIT_IO bound the
+ * share of the last 10 seconds that some task spent stalled on that
+ * resource, in percent, as /proc/pressure/<resource> reports it ("some
+ * avg10"), and ADMIT_LOADAVG bounds the 1-minute load average from
+ * /proc/loadavg. An assignment on the first command of a pipeline,
+ * `ADMIT_LOADAVG=8 make -C sub &`, applies to that pipeline. Nothing is
+ * read while none of them is set.
+ *
+ * A pipeline that would go over a bound is expanded and queued instead,
+ * and so is any background pipeline after it, so that jobs start in the
+ * order they were written. The queue is checked from the event loop, and
+ * while the shell waits for a key, every ADMIT_POLL_MS; a check starts at
+ * most one job, since the averages lag behind the load it adds. At the end
+ * of a script the shell waits for the queue to empty before it exits; an
+ * interactive shell drops what is still queued. Starting a queued job
+ * changes neither $? nor $!, so $! never refers to one.
+ */
+#include "parser.h"
+
+#define ADMIT_POLL_MS 500
+
+/** Whether the background pipeline that starts with cmd has to wait, as
+ * the host is too busy or an earlier pipeline is waiting */
+extern int admit_should_defer(struct command const *cmd);
+
+/** Queues cl, whose words have been expanded, to be run once the host is
+ * no longer busy; the queue owns cl from now on */
+extern void admit_defer(struct command_list *cl);
+
+/** Checks whether the next job in the queue may start, if a check is due
+ *
+ * @returns 0 if it may, the milliseconds until the next check, or -1 if the
+ *          queue is empty
+ */
+extern int admit_ready(void);
+
+/** Starts the next job in the queue if admit_ready() says it may */
+extern void admit_run(void);
+
+/** Starts every job in the queue, waiting as long as it takes */
+extern void admit_drain(void);
+
+/** Frees the jobs left in the queue (at exit) */
+extern void admit_cleanup(void);
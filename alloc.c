@@ -0,0 +1,287 @@
+#define _POSIX_C_SOURCE 200809L
+#include <ctype.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "alloc.h"
+
+static char const *const tag_names[ALLOC_TAG_COUNT] = {
+    [ALLOC_PARSER] = "parser",
+    [ALLOC_EXPAND] = "expand",
+    [ALLOC_VARS] = "vars",
+    [ALLOC_JOBS] = "jobs",
+    [ALLOC_RUNNER] = "runner",
+};
+
+char const *
+alloc_tag_name(enum alloc_tag tag)
+{
+  return tag_names[tag];
+}
+
+int
+alloc_tag_by_name(char const *name)
+{
+  for (int t = 0; t < ALLOC_TAG_COUNT; ++t) {
+    if (strcmp(name, tag_names[t]) == 0) return t;
+  }
+  return -1;
+}
+
+#ifdef BIGSHELL_ALLOC_ACCOUNTING
+
+int const alloc_accounting = 1;
+
+/* Precedes every block; the alignment keeps the caller's pointer suitably
+ * aligned for any type */
+struct header {
+  _Alignas(max_align_t) struct header *prev;
+  struct header *next;
+  size_t size;
+  enum alloc_tag tag;
+};
+
+struct counters {
+  size_t live_blocks;
+  size_t live_bytes;
+  size_t peak_bytes;
+  unsigned long long total_blocks;
+  unsigned long long total_bytes;
+};
+
+static struct counters counters[ALLOC_TAG_COUNT];
+static struct header live = {.prev = &live, .next = &live};
+
+/* Allocations are rare enough that a spinlock is plenty */
+static atomic_flag lock = ATOMIC_FLAG_INIT;
+
+static void
+acquire(void)
+{
+  while (atomic_flag_test_and_set_explicit(&lock, memory_order_acquire));
+}
+
+static void
+release(void)
+{
+  atomic_flag_clear_explicit(&lock, memory_order_release);
+}
+
+/* Must be called with the lock held */
+static void
+link_block(struct header *h, enum alloc_tag tag, size_t size)
+{
+  h->tag = tag;
+  h->size = size;
+  h->next = live.next;
+  h->prev = &live;
+  live.next->prev = h;
+  live.next = h;
+
+  struct counters *c = &counters[tag];
+  ++c->live_blocks;
+  c->live_bytes += size;
+  if (c->live_bytes > c->peak_bytes) c->peak_bytes = c->live_bytes;
+}
+
+/* Must be called with the lock held */
+static void
+unlink_block(struct header *h)
+{
+  h->prev->next = h->next;
+  h->next->prev = h->prev;
+
+  struct counters *c = &counters[h->tag];
+  --c->live_blocks;
+  c->live_bytes -= h->size;
+}
+
+void *
+alloc_malloc(enum alloc_tag tag, size_t size)
+{
+  if (size > SIZE_MAX - sizeof(struct header)) return 0;
+  struct header *h = malloc(sizeof *h + size);
+  if (!h) return 0;
+  acquire();
+  link_block(h, tag, size);
+  ++counters[tag].total_blocks;
+  counters[tag].total_bytes += size;
+  release();
+  return h + 1;
+}
+
+void *
+alloc_realloc(enum alloc_tag tag, void *p, size_t size)
+{
+  if (!p) return alloc_malloc(tag, size);
+  if (size > SIZE_MAX - sizeof(struct header)) return 0;
+  struct header *h = (struct header *)p - 1;
+  size_t const old_size = h->size;
+  enum alloc_tag const old_tag = h->tag;
+
+  /* The block may move, so it has to be off the list while it does */
+  acquire();
+  unlink_block(h);
+  release();
+  struct header *nh = realloc(h, sizeof *nh + size);
+  acquire();
+  if (!nh) {
+    link_block(h, old_tag, old_size);
+    release();
+    return 0;
+  }
+  link_block(nh, tag, size);
+  if (size > old_size) counters[tag].total_bytes += size - old_size;
+  release();
+  return nh + 1;
+}
+
+char *
+alloc_strdup(enum alloc_tag tag, char const *s)
+{
+  size_t len = strlen(s);
+  char *d = alloc_malloc(tag, len + 1);
+  if (d) memcpy(d, s, len + 1);
+  return d;
+}
+
+char *
+alloc_strndup(enum alloc_tag tag, char const *s, size_t n)
+{
+  size_t len = strnlen(s, n);
+  char *d = alloc_malloc(tag, len + 1);
+  if (!d) return 0;
+  memcpy(d, s, len);
+  d[len] = '\0';
+  return d;
+}
+
+void
+alloc_free(void *p)
+{
+  if (!p) return;
+  struct header *h = (struct header *)p - 1;
+  acquire();
+  unlink_block(h);
+  release();
+  free(h);
+}
+
+size_t
+alloc_outstanding(enum alloc_tag tag)
+{
+  return counters[tag].live_blocks;
+}
+
+size_t
+alloc_live_bytes(enum alloc_tag tag)
+{
+  return counters[tag].live_bytes;
+}
+
+void
+alloc_print(int fd)
+{
+  dprintf(fd,
+          "%-8s %10s %12s %12s %12s %14s\n",
+          "tag",
+          "live",
+          "live(B)",
+          "peak(B)",
+          "allocs",
+          "alloc(B)");
+  acquire();
+  struct counters snap[ALLOC_TAG_COUNT];
+  memcpy(snap, counters, sizeof snap);
+  release();
+  for (int t = 0; t < ALLOC_TAG_COUNT; ++t) {
+    dprintf(fd,
+            "%-8s %10zu %12zu %12zu %12llu %14llu\n",
+            tag_names[t],
+            snap[t].live_blocks,
+            snap[t].live_bytes,
+            snap[t].peak_bytes,
+            snap[t].total_blocks,
+            snap[t].total_bytes);
+  }
+}
+
+void
+alloc_reset(void)
+{
+  acquire();
+  for (int t = 0; t < ALLOC_TAG_COUNT; ++t) {
+    counters[t].peak_bytes = counters[t].live_bytes;
+    counters[t].total_blocks = 0;
+    counters[t].total_bytes = 0;
+  }
+  release();
+}
+
+size_t
+alloc_report_leaks(int fd)
+{
+  size_t count = 0;
+  for (int t = 0; t < ALLOC_TAG_COUNT; ++t) count += counters[t].live_blocks;
+  if (!count) return 0;
+
+  dprintf(fd, "bigshell: %zu allocations outstanding\n", count);
+  alloc_print(fd);
+  size_t shown = 0;
+  for (struct header *h = live.next; h != &live && shown < 16;
+       h = h->next, ++shown) {
+    /* Most blocks are strings, so show a printable prefix of each */
+    char preview[33];
+    unsigned char const *p = (unsigned char const *)(h + 1);
+    size_t n = h->size < sizeof preview - 1 ? h->size : sizeof preview - 1;
+    for (size_t i = 0; i < n; ++i) preview[i] = isprint(p[i]) ? p[i] : '.';
+    preview[n] = '\0';
+    dprintf(fd,
+            "  %-8s %8zu bytes at %p \"%s\"\n",
+            tag_names[h->tag],
+            h->size,
+            (void *)(h + 1),
+            preview);
+  }
+  if (shown < count) dprintf(fd, "  ...\n");
+  return count;
+}
+
+#else
+
+int const alloc_accounting = 0;
+
+size_t
+alloc_outstanding(enum alloc_tag tag)
+{
+  return 0;
+}
+
+size_t
+alloc_live_bytes(enum alloc_tag tag)
+{
+  return 0;
+}
+
+void
+alloc_print(int fd)
+{
+  dprintf(fd, "allocation accounting is not compiled in\n");
+}
+
+void
+alloc_reset(void)
+{
+}
+
+size_t
+alloc_report_leaks(int fd)
+{
+  return 0;
+}
+
+#endif
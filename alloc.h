@@ -0,0 +1,69 @@
+#pragma once
+/** @file Allocation accounting
+ *
+ * The parser, expander, variable table, job table and runner allocate
+ * through these wrappers, each under its own tag. Building with
+ * -DBIGSHELL_ALLOC_ACCOUNTING makes every block carry a small header that
+ * records its tag and size and links it into a list of live blocks, so
+ * counts, bytes and peaks can be reported per tag and leaks listed at exit.
+ * Without it the wrappers are the plain libc calls.
+ *
+ * Memory obtained through a wrapper must be released with alloc_free() or
+ * alloc_realloc(), and memory from anywhere else (getline(), asprintf(),
+ * open_memstream(), ...) with plain free().
+ */
+#include <stdlib.h>
+#include <string.h>
+
+enum alloc_tag {
+  ALLOC_PARSER,
+  ALLOC_EXPAND,
+  ALLOC_VARS,
+  ALLOC_JOBS,
+  ALLOC_RUNNER,
+  ALLOC_TAG_COUNT
+};
+
+#ifdef BIGSHELL_ALLOC_ACCOUNTING
+extern void *alloc_malloc(enum alloc_tag tag, size_t size);
+extern void *alloc_realloc(enum alloc_tag tag, void *p, size_t size);
+extern char *alloc_strdup(enum alloc_tag tag, char const *s);
+extern char *alloc_strndup(enum alloc_tag tag, char const *s, size_t n);
+extern void alloc_free(void *p);
+#else
+#define alloc_malloc(tag, size) malloc(size)
+#define alloc_realloc(tag, p, size) realloc(p, size)
+#define alloc_strdup(tag, s) strdup(s)
+#define alloc_strndup(tag, s, n) strndup(s, n)
+#define alloc_free(p) free(p)
+#endif
+
+/** nonzero if accounting was compiled in */
+extern int const alloc_accounting;
+
+/** number of live blocks allocated under tag */
+extern size_t alloc_outstanding(enum alloc_tag tag);
+
+/** total size of the live blocks allocated under tag */
+extern size_t alloc_live_bytes(enum alloc_tag tag);
+
+/** name of tag, as printed by alloc_print() */
+extern char const *alloc_tag_name(enum alloc_tag tag);
+
+/** looks up a tag by the name alloc_print() uses for it
+ *
+ * @returns the tag, or -1 if there is no such tag
+ */
+extern int alloc_tag_by_name(char const *name);
+
+/** prints a table of live, peak and total allocations per tag to fd */
+extern void alloc_print(int fd);
+
+/** resets the peaks to the current live sizes, and the totals to zero */
+extern void alloc_reset(void);
+
+/** if any blocks are live, prints the table and up to 16 of the blocks to fd
+ *
+ * @returns the number of live blocks
+ */
+extern size_t alloc_report_leaks(int fd);
@@ -0,0 +1,329 @@
+/** Fork latency benchmark
+ *
+ * Runs bigshell on a pseudo-terminal with its caches grown to several
+ * sizes, and reports how long it takes to fork a command at each size. The
+ * caches are the history index, grown with a history file of many entries,
+ * and the command trie, grown with a PATH directory of many files. Once the
+ * index is built (a ^R search waits for it), `/bin/true` is run repeatedly,
+ * and the spawn stage of `shellstats` gives the time from just before
+ * fork() to the child being in its process group.
+ *
+ * Build:  cc -O2 -o forkbench bench/forkbench.c -lutil
+ * Usage:  forkbench [-n iterations] path/to/bigshell
+ *
+ * With the caches kept in MADV_WIPEONFORK regions, spawn times should stay
+ * flat while the shell's RSS grows.
+ */
+#define _GNU_SOURCE
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pty.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/* The PS1, so a prompt can be recognized in the output */
+#define SENTINEL "%%BENCH%% "
+
+#define TIMEOUT_MS 20000
+
+struct size {
+  char const *name;
+  size_t history; /* entries */
+  size_t commands; /* files in the extra PATH directory */
+};
+
+static struct size const sizes[] = {
+    {"empty", 0, 0},
+    {"10k history, 1k commands", 10000, 1000},
+    {"100k history, 10k commands", 100000, 10000},
+    {"1M history, 100k commands", 1000000, 100000},
+};
+
+struct session {
+  int master;
+  pid_t pid;
+  char buf[1 << 16];
+  size_t len;
+};
+
+static double
+now_us(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/* Reads whatever pty output arrives before deadline
+ *
+ * @returns 0 on success, -1 on timeout or error
+ */
+static int
+session_read(struct session *s, double deadline)
+{
+  for (;;) {
+    int left = (deadline - now_us()) / 1e3;
+    if (left <= 0) return -1;
+    struct pollfd pfd = {.fd = s->master, .events = POLLIN};
+    int r = poll(&pfd, 1, left);
+    if (r < 0) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    if (r == 0) return -1;
+    ssize_t n = read(s->master, s->buf + s->len, sizeof s->buf - s->len);
+    if (n <= 0) return -1;
+    s->len += n;
+    return 0;
+  }
+}
+
+static void
+session_consume(struct session *s, size_t used)
+{
+  memmove(s->buf, s->buf + used, s->len - used);
+  s->len -= used;
+}
+
+/** Reads pty output until needle shows up, consuming everything up to and
+ * including it
+ *
+ * @returns 0 if found, -1 on timeout or error
+ */
+static int
+session_expect(struct session *s, char const *needle)
+{
+  size_t nlen = strlen(needle);
+  double deadline = now_us() + TIMEOUT_MS * 1e3;
+  for (;;) {
+    char *hit = memmem(s->buf, s->len, needle, nlen);
+    if (hit) {
+      session_consume(s, hit - s->buf + nlen);
+      return 0;
+    }
+    /* Keep a needle-sized tail so a match split across reads is found */
+    if (s->len == sizeof s->buf) session_consume(s, s->len - nlen);
+    if (session_read(s, deadline) < 0) return -1;
+  }
+}
+
+/** Reads the rest of the current line of pty output into line
+ *
+ * @returns 0 on success, -1 on timeout or error
+ */
+static int
+session_line(struct session *s, char *line, size_t size)
+{
+  double deadline = now_us() + TIMEOUT_MS * 1e3;
+  for (;;) {
+    char *nl = memchr(s->buf, '\n', s->len);
+    if (nl) {
+      size_t len = nl - s->buf;
+      if (len >= size) len = size - 1;
+      memcpy(line, s->buf, len);
+      line[len] = '\0';
+      session_consume(s, nl - s->buf + 1);
+      return 0;
+    }
+    if (s->len == sizeof s->buf) session_consume(s, s->len);
+    if (session_read(s, deadline) < 0) return -1;
+  }
+}
+
+static void
+session_send(struct session *s, char const *data)
+{
+  size_t len = strlen(data);
+  while (len) {
+    ssize_t n = write(s->master, data, len);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      err(1, "write to pty");
+    }
+    data += n;
+    len -= n;
+  }
+}
+
+static int
+session_start(struct session *s,
+              char const *shell,
+              char const *histfile,
+              char const *path)
+{
+  struct winsize ws = {.ws_row = 24, .ws_col = 200};
+  s->len = 0;
+  s->pid = forkpty(&s->master, 0, 0, &ws);
+  if (s->pid < 0) return -1;
+  if (s->pid == 0) {
+    setenv("PS1", SENTINEL, 1);
+    setenv("BIGSHELL_HISTFILE", histfile, 1);
+    setenv("PATH", path, 1);
+    execl(shell, shell, (char *)0);
+    _exit(127);
+  }
+  return session_expect(s, SENTINEL);
+}
+
+static void
+session_stop(struct session *s)
+{
+  session_send(s, "exit\r");
+  for (int i = 0; i < 100; ++i) {
+    if (waitpid(s->pid, 0, WNOHANG) == s->pid) goto out;
+    usleep(10000);
+  }
+  kill(s->pid, SIGKILL);
+  waitpid(s->pid, 0, 0);
+out:
+  close(s->master);
+}
+
+static long
+rss_kb(pid_t pid)
+{
+  char path[64], line[256];
+  snprintf(path, sizeof path, "/proc/%d/status", (int)pid);
+  FILE *f = fopen(path, "re");
+  if (!f) return -1;
+  long kb = -1;
+  while (fgets(line, sizeof line, f)) {
+    if (sscanf(line, "VmRSS: %ld", &kb) == 1) break;
+  }
+  fclose(f);
+  return kb;
+}
+
+static void
+make_history(char const *file, size_t entries)
+{
+  FILE *f = fopen(file, "we");
+  if (!f) err(1, "%s", file);
+  for (size_t i = 0; i < entries; ++i) {
+    fprintf(f, "grep -n pattern%zu src/file%zu.c | sort -u\n", i, i % 977);
+  }
+  if (fclose(f)) err(1, "%s", file);
+}
+
+static void
+make_commands(char const *dir, size_t count)
+{
+  char path[4096];
+  for (size_t i = 0; i < count; ++i) {
+    snprintf(path, sizeof path, "%s/cmd-%zu", dir, i);
+    int fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0755);
+    if (fd < 0) err(1, "%s", path);
+    close(fd);
+  }
+}
+
+static void
+remove_commands(char const *dir, size_t count)
+{
+  char path[4096];
+  for (size_t i = 0; i < count; ++i) {
+    snprintf(path, sizeof path, "%s/cmd-%zu", dir, i);
+    unlink(path);
+  }
+}
+
+static void
+run(char const *shell, struct size const *size, int iterations)
+{
+  char dir[] = "/tmp/bigshell-forkbench-XXXXXX";
+  if (!mkdtemp(dir)) err(1, "mkdtemp");
+  char histfile[sizeof dir + 16], path[sizeof dir + 64];
+  snprintf(histfile, sizeof histfile, "%s/history", dir);
+  snprintf(path, sizeof path, "%s:/bin:/usr/bin", dir);
+  make_history(histfile, size->history);
+  make_commands(dir, size->commands);
+
+  struct session s;
+  if (session_start(&s, shell, histfile, path) < 0) {
+    warnx("%s: shell never printed a prompt", size->name);
+    goto out;
+  }
+  /* The history index and the command trie are built by threads, and
+   * nothing waits for them: searches scan linearly until the index is
+   * done. Give both time (a million entries take over 2 s on a slow VM),
+   * then search, so that the shell takes the index over before timing */
+  usleep(500000 + size->history * 4);
+  session_send(&s, "\x12zzz\x07");
+  session_send(&s, "shellstats -r\r");
+  if (session_expect(&s, SENTINEL) < 0) goto timeout;
+  for (int i = 0; i < iterations; ++i) {
+    session_send(&s, "/bin/true\r");
+    if (session_expect(&s, SENTINEL) < 0) goto timeout;
+  }
+  long const rss = rss_kb(s.pid);
+  session_send(&s, "shellstats\r");
+  char line[256];
+  if (session_expect(&s, "\nspawn") < 0) goto timeout;
+  if (session_line(&s, line, sizeof line) < 0) goto timeout;
+  unsigned long count;
+  double mean, p50, p90, p99;
+  if (sscanf(line, "%lu %lf %lf %lf %lf", &count, &mean, &p50, &p90, &p99) !=
+      5) {
+    warnx("%s: could not read shellstats", size->name);
+  } else {
+    printf("%-28s %9ld %9.1f %9.1f %9.1f %9.1f\n",
+           size->name,
+           rss,
+           mean,
+           p50,
+           p90,
+           p99);
+  }
+  if (0) {
+  timeout:
+    warnx("%s: timed out", size->name);
+  }
+  session_stop(&s);
+out:
+  unlink(histfile);
+  remove_commands(dir, size->commands);
+  rmdir(dir);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int iterations = 500;
+  int opt;
+  while ((opt = getopt(argc, argv, "n:")) != -1) {
+    switch (opt) {
+      case 'n':
+        iterations = atoi(optarg);
+        break;
+      default:
+        goto usage;
+    }
+  }
+  if (optind != argc - 1 || iterations <= 0) goto usage;
+  char const *shell = argv[optind];
+
+  signal(SIGPIPE, SIG_IGN);
+  printf("%-28s %9s %9s %9s %9s %9s\n",
+         "caches",
+         "rss(kB)",
+         "mean(us)",
+         "p50(us)",
+         "p90(us)",
+         "p99(us)");
+  for (size_t i = 0; i < sizeof sizes / sizeof *sizes; ++i) {
+    run(shell, &sizes[i], iterations);
+  }
+  return 0;
+
+usage:
+  fprintf(stderr, "usage: %s [-n iterations] path/to/bigshell\n", argv[0]);
+  return 2;
+}
@@ -0,0 +1,388 @@
+/** Pipeline throughput benchmark
+ *
+ * Pushes a fixed volume of data through pipelines that bigshell builds with
+ * run_command_list(), and reports throughput, CPU time per GiB and context
+ * switches per GiB for each configuration.
+ *
+ * Build:  cc -O2 -o pipebench bench/pipebench.c
+ * Usage:  pipebench [-b bytes] [-r runs] [-S stages] [-w sizes]
+ *                   [-p pipesizes] [-s settings] [-P placements] [-k kinds]
+ *                   path/to/bigshell
+ *
+ * Each configuration is run by a fresh shell, -r times (3), with the volume
+ * split between the runs.
+ *
+ * List options take comma-separated values:
+ *   -S  pipeline lengths in processes, including source and sink (2,4,16)
+ *   -w  write sizes in bytes (512 and the page size)
+ *   -p  pipe buffer sizes applied with F_SETPIPE_SZ; 0 keeps the default
+ *       (0,1048576)
+ *   -s  the shell's PIPESIZE: 0 leaves it unset, or a size, or auto, which
+ *       only grows pipes after a run has taught it to (0,auto)
+ *   -P  CPU placement: any (no pinning), one (all stages on one CPU), two
+ *       (all stages on two CPUs) (any,one,two)
+ *   -k  middle stage kinds: external (cat), bench (pipebench relay, which
+ *       honours the write size), mixed (alternating) (external,bench,mixed)
+ *
+ * The source and sink are always pipebench itself. Pipe sizes are applied by
+ * the pipebench stages on both of their ends, so a pipe between two cat
+ * stages keeps the default size unless PIPESIZE is set. bigshell has no
+ * builtin that moves data through a pipe, so there is no builtin stage kind.
+ *
+ * CPU figures come from wait4() on the shell, which covers the shell and
+ * every stage it reaped.
+ */
+#define _GNU_SOURCE
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_LIST 16
+#define SETTING_AUTO (-1)
+
+struct list {
+  size_t count;
+  long v[MAX_LIST];
+};
+
+static char const *const kind_names[] = {"external", "bench", "mixed"};
+static char const *const place_names[] = {"any", "one", "two"};
+
+static double
+now_s(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double
+tv_s(struct timeval tv)
+{
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void
+apply_pipesz(int fd)
+{
+  char const *s = getenv("PIPEBENCH_PIPESZ");
+  if (!s) return;
+  long sz = strtol(s, 0, 10);
+  if (sz > 0) fcntl(fd, F_SETPIPE_SZ, (int)sz);
+}
+
+static ssize_t
+write_all(int fd, char const *buf, size_t len)
+{
+  size_t done = 0;
+  while (done < len) {
+    ssize_t n = write(fd, buf + done, len - done);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    done += n;
+  }
+  return done;
+}
+
+/* Stage: pipebench gen BYTES WSIZE */
+static int
+stage_gen(long long bytes, size_t wsize)
+{
+  apply_pipesz(STDOUT_FILENO);
+  char *buf = malloc(wsize);
+  if (!buf) err(1, 0);
+  memset(buf, 'x', wsize);
+  while (bytes > 0) {
+    size_t n = bytes < (long long)wsize ? (size_t)bytes : wsize;
+    if (write_all(STDOUT_FILENO, buf, n) < 0) err(1, "gen");
+    bytes -= n;
+  }
+  return 0;
+}
+
+/* Stage: pipebench relay WSIZE, and pipebench sink WSIZE */
+static int
+stage_copy(size_t wsize, int forward)
+{
+  apply_pipesz(STDIN_FILENO);
+  if (forward) apply_pipesz(STDOUT_FILENO);
+  char *buf = malloc(wsize);
+  if (!buf) err(1, 0);
+  for (;;) {
+    ssize_t n = read(STDIN_FILENO, buf, wsize);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      err(1, "read");
+    }
+    if (n == 0) break;
+    if (forward && write_all(STDOUT_FILENO, buf, n) < 0) err(1, "relay");
+  }
+  return 0;
+}
+
+/* Parses a list of names, or of numbers of at least min if names is null */
+static void
+parse_list(struct list *l,
+           char *arg,
+           char const *const *names,
+           size_t nnames,
+           long min)
+{
+  l->count = 0;
+  for (char *tok = strtok(arg, ","); tok; tok = strtok(0, ",")) {
+    if (l->count == MAX_LIST) errx(2, "too many values");
+    long v = -1;
+    for (size_t i = 0; i < nnames; ++i) {
+      if (strcmp(tok, names[i]) == 0) v = i;
+    }
+    if (!names) {
+      char *end;
+      v = strtol(tok, &end, 10);
+      if (*end || v < 0) v = -1;
+      else if (v < min) errx(2, "`%s' is below %ld", tok, min);
+    }
+    if (v < 0) errx(2, "bad value `%s'", tok);
+    l->v[l->count++] = v;
+  }
+}
+
+/* Parses -s, where auto is SETTING_AUTO */
+static void
+parse_settings(struct list *l, char *arg)
+{
+  l->count = 0;
+  for (char *tok = strtok(arg, ","); tok; tok = strtok(0, ",")) {
+    if (l->count == MAX_LIST) errx(2, "too many values");
+    long v = SETTING_AUTO;
+    if (strcmp(tok, "auto") != 0) {
+      char *end;
+      v = strtol(tok, &end, 10);
+      if (*end || v < 0) errx(2, "bad value `%s'", tok);
+    }
+    l->v[l->count++] = v;
+  }
+}
+
+static void
+set_placement(long place)
+{
+  long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  switch (place) {
+    case 0:
+      for (long i = 0; i < ncpu; ++i) CPU_SET(i, &set);
+      break;
+    case 1:
+      CPU_SET(0, &set);
+      break;
+    case 2:
+      CPU_SET(0, &set);
+      CPU_SET(ncpu > 1 ? 1 : 0, &set);
+      break;
+  }
+  if (sched_setaffinity(0, sizeof set, &set) < 0) warn("sched_setaffinity");
+}
+
+/** Runs one pipeline through the shell and prints a result row */
+static void
+run_one(char const *shell,
+        char const *self,
+        long long bytes,
+        long runs,
+        long stages,
+        long wsize,
+        long pipesz,
+        long setting,
+        long place,
+        long kind)
+{
+  /* Build the script the shell will read */
+  size_t cap = 64 + runs * (256 + stages * (strlen(self) + 64));
+  char *line = malloc(cap);
+  if (!line) err(1, 0);
+  int len = 0;
+  if (setting == SETTING_AUTO) {
+    len += snprintf(line + len, cap - len, "PIPESIZE=auto\n");
+  } else if (setting) {
+    len += snprintf(line + len, cap - len, "PIPESIZE=%ld\n", setting);
+  }
+  for (long r = 0; r < runs; ++r) {
+    long long const share = bytes / runs + (r < bytes % runs);
+    len +=
+        snprintf(line + len, cap - len, "%s gen %lld %ld", self, share, wsize);
+    for (long i = 1; i < stages - 1; ++i) {
+      int ext = kind == 0 || (kind == 2 && i % 2);
+      if (ext) len += snprintf(line + len, cap - len, " | cat");
+      else
+        len +=
+            snprintf(line + len, cap - len, " | %s relay %ld", self, wsize);
+    }
+    len += snprintf(line + len, cap - len, " | %s sink %ld\n", self, wsize);
+  }
+
+  int in[2];
+  if (pipe(in) < 0) err(1, "pipe");
+  char szbuf[32];
+  snprintf(szbuf, sizeof szbuf, "%ld", pipesz);
+
+  double t0 = now_s();
+  pid_t pid = fork();
+  if (pid < 0) err(1, "fork");
+  if (pid == 0) {
+    dup2(in[0], STDIN_FILENO);
+    close(in[0]);
+    close(in[1]);
+    if (pipesz) setenv("PIPEBENCH_PIPESZ", szbuf, 1);
+    else unsetenv("PIPEBENCH_PIPESZ");
+    set_placement(place);
+    execl(shell, shell, (char *)0);
+    _exit(127);
+  }
+  close(in[0]);
+  write_all(in[1], line, len);
+  close(in[1]);
+
+  int status;
+  struct rusage ru;
+  if (wait4(pid, &status, 0, &ru) < 0) err(1, "wait4");
+  double wall = now_s() - t0;
+  free(line);
+
+  double gib = bytes / (double)(1 << 30);
+  double cpu = tv_s(ru.ru_utime) + tv_s(ru.ru_stime);
+  char setting_str[32] = "-";
+  if (setting == SETTING_AUTO) {
+    snprintf(setting_str, sizeof setting_str, "auto");
+  } else if (setting) {
+    snprintf(setting_str, sizeof setting_str, "%ld", setting);
+  }
+  printf("%6ld %6ld %8ld %8s %-5s %-8s %9.2f %9.2f %11.0f%s\n",
+         stages,
+         wsize,
+         pipesz,
+         setting_str,
+         place_names[place],
+         stages > 2 ? kind_names[kind] : "-",
+         gib / wall,
+         cpu / gib,
+         (ru.ru_nvcsw + ru.ru_nivcsw) / gib,
+         WIFEXITED(status) && WEXITSTATUS(status) == 0 ? "" : "  (failed)");
+  fflush(stdout);
+}
+
+int
+main(int argc, char *argv[])
+{
+  if (argc == 4 && strcmp(argv[1], "gen") == 0) {
+    return stage_gen(atoll(argv[2]), atol(argv[3]));
+  } else if (argc == 3 && strcmp(argv[1], "relay") == 0) {
+    return stage_copy(atol(argv[2]), 1);
+  } else if (argc == 3 && strcmp(argv[1], "sink") == 0) {
+    return stage_copy(atol(argv[2]), 0);
+  }
+
+  long long bytes = 1LL << 30;
+  long runs = 3;
+  struct list stages = {3, {2, 4, 16}};
+  struct list wsizes = {2, {512, sysconf(_SC_PAGESIZE)}};
+  struct list pipeszs = {2, {0, 1 << 20}};
+  struct list settings = {2, {0, SETTING_AUTO}};
+  struct list places = {3, {0, 1, 2}};
+  struct list kinds = {3, {0, 1, 2}};
+
+  int opt;
+  while ((opt = getopt(argc, argv, "b:r:S:w:p:s:P:k:")) != -1) {
+    switch (opt) {
+      case 'b':
+        bytes = atoll(optarg);
+        break;
+      case 'r':
+        runs = atol(optarg);
+        break;
+      case 'S':
+        parse_list(&stages, optarg, 0, 0, 2); /* a pipeline */
+        break;
+      case 'w':
+        parse_list(&wsizes, optarg, 0, 0, 1);
+        break;
+      case 'p':
+        parse_list(&pipeszs, optarg, 0, 0, 0);
+        break;
+      case 's':
+        parse_settings(&settings, optarg);
+        break;
+      case 'P':
+        parse_list(&places, optarg, place_names, 3, 0);
+        break;
+      case 'k':
+        parse_list(&kinds, optarg, kind_names, 3, 0);
+        break;
+      default:
+        goto usage;
+    }
+  }
+  if (optind != argc - 1 || bytes <= 0 || runs <= 0) goto usage;
+
+  /* Stages are re-executed through the shell, so we need our own path */
+  char self[4096];
+  ssize_t n = readlink("/proc/self/exe", self, sizeof self - 1);
+  if (n < 0) err(1, "readlink");
+  self[n] = '\0';
+
+  printf("%6s %6s %8s %8s %-5s %-8s %9s %9s %11s\n",
+         "stages",
+         "wsize",
+         "pipesz",
+         "PIPESIZE",
+         "cpus",
+         "kind",
+         "GiB/s",
+         "cpu-s/GiB",
+         "ctxsw/GiB");
+  for (size_t s = 0; s < stages.count; ++s) {
+    for (size_t w = 0; w < wsizes.count; ++w) {
+      for (size_t p = 0; p < pipeszs.count; ++p) {
+        for (size_t z = 0; z < settings.count; ++z) {
+          for (size_t c = 0; c < places.count; ++c) {
+            for (size_t k = 0; k < kinds.count; ++k) {
+              run_one(argv[optind],
+                      self,
+                      bytes,
+                      runs,
+                      stages.v[s],
+                      wsizes.v[w],
+                      pipeszs.v[p],
+                      settings.v[z],
+                      places.v[c],
+                      kinds.v[k]);
+              /* Two-stage pipelines have no middle stage to vary */
+              if (stages.v[s] == 2) break;
+            }
+          }
+        }
+      }
+    }
+  }
+  return 0;
+
+usage:
+  fprintf(stderr,
+          "usage: %s [-b bytes] [-r runs] [-S stages] [-w sizes]\n"
+          "       [-p pipesizes] [-s settings] [-P any,one,two]\n"
+          "       [-k external,bench,mixed] bigshell\n",
+          argv[0]);
+  return 2;
+}
@@ -0,0 +1,330 @@
+/** Interactive latency benchmark
+ *
+ * Runs bigshell on a pseudo-terminal and plays the part of a user typing at
+ * it. Every keystroke is timestamped when it is written to the pty master and
+ * again when its echo comes back; every Enter is timestamped against the
+ * next prompt redraw. Results are reported as latency percentiles per
+ * scenario.
+ *
+ * Build:  cc -O2 -o ptylat bench/ptylat.c -lutil
+ * Usage:  ptylat [-n iterations] path/to/bigshell
+ *
+ * Scenarios:
+ *   builtin   `cd .` with a plain PS1
+ *   external  `/bin/true` with a plain PS1
+ *   ps1       `cd .` with PS1='\u@\h \w'
+ *   jobctl    start `cat -n`, ^Z it, `fg` it, ^D it; every transition goes
+ *             through tcsetpgrp() in wait_on_fg_pgid()
+ *
+ * Keystroke-to-echo is whatever produces the echo: the tty line discipline
+ * in cooked mode, or the shell itself once it edits lines in raw mode.
+ */
+#define _GNU_SOURCE
+#include <err.h>
+#include <errno.h>
+#include <poll.h>
+#include <pty.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Every PS1 ends with this, so a redraw can be recognized in the output */
+#define SENTINEL "%%BENCH%% "
+
+#define TIMEOUT_MS 5000
+
+struct samples {
+  char const *name;
+  size_t count;
+  size_t cap;
+  double *us;
+};
+
+struct session {
+  int master;
+  pid_t pid;
+  char buf[1 << 16];
+  size_t len;
+};
+
+static double
+now_us(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static void
+samples_add(struct samples *s, double us)
+{
+  if (s->count == s->cap) {
+    s->cap = s->cap ? s->cap * 2 : 64;
+    s->us = realloc(s->us, sizeof *s->us * s->cap);
+    if (!s->us) err(1, 0);
+  }
+  s->us[s->count++] = us;
+}
+
+static int
+cmp_double(void const *a, void const *b)
+{
+  double x = *(double const *)a, y = *(double const *)b;
+  return (x > y) - (x < y);
+}
+
+static void
+samples_report(struct samples *s)
+{
+  if (s->count == 0) {
+    printf("%-28s %8s\n", s->name, "n/a");
+    return;
+  }
+  qsort(s->us, s->count, sizeof *s->us, cmp_double);
+  double sum = 0;
+  for (size_t i = 0; i < s->count; ++i) sum += s->us[i];
+  printf("%-28s %6zu %9.1f %9.1f %9.1f %9.1f %9.1f\n",
+         s->name,
+         s->count,
+         s->us[0],
+         sum / s->count,
+         s->us[s->count / 2],
+         s->us[(s->count * 99) / 100],
+         s->us[s->count - 1]);
+  free(s->us);
+  s->us = 0;
+  s->count = s->cap = 0;
+}
+
+/** Reads pty output until needle shows up past the current mark
+ *
+ * @returns 0 if found, -1 on timeout or error
+ *
+ * Consumes everything up to and including the needle.
+ */
+static int
+session_expect(struct session *s, char const *needle)
+{
+  size_t nlen = strlen(needle);
+  double deadline = now_us() + TIMEOUT_MS * 1e3;
+  for (;;) {
+    char *hit = memmem(s->buf, s->len, needle, nlen);
+    if (hit) {
+      size_t used = hit - s->buf + nlen;
+      memmove(s->buf, s->buf + used, s->len - used);
+      s->len -= used;
+      return 0;
+    }
+    /* Keep a needle-sized tail so a match split across reads is found */
+    if (s->len == sizeof s->buf) {
+      memmove(s->buf, s->buf + s->len - nlen, nlen);
+      s->len = nlen;
+    }
+    int left = (deadline - now_us()) / 1e3;
+    if (left <= 0) return -1;
+    struct pollfd pfd = {.fd = s->master, .events = POLLIN};
+    int r = poll(&pfd, 1, left);
+    if (r < 0) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    if (r == 0) return -1;
+    ssize_t n = read(s->master, s->buf + s->len, sizeof s->buf - s->len);
+    if (n <= 0) return -1;
+    s->len += n;
+  }
+}
+
+static void
+session_send(struct session *s, char const *data, size_t len)
+{
+  while (len) {
+    ssize_t n = write(s->master, data, len);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      err(1, "write to pty");
+    }
+    data += n;
+    len -= n;
+  }
+}
+
+/* The history file the sessions add their lines to, not the user's */
+static char histfile[] = "/tmp/bigshell-ptylat-XXXXXX";
+
+static int
+session_start(struct session *s, char const *shell, char const *ps1)
+{
+  struct winsize ws = {.ws_row = 24, .ws_col = 200};
+  s->len = 0;
+  s->pid = forkpty(&s->master, 0, 0, &ws);
+  if (s->pid < 0) return -1;
+  if (s->pid == 0) {
+    setenv("PS1", ps1, 1);
+    setenv("BIGSHELL_HISTFILE", histfile, 1);
+    execl(shell, shell, (char *)0);
+    _exit(127);
+  }
+  return session_expect(s, SENTINEL);
+}
+
+static void
+session_stop(struct session *s)
+{
+  session_send(s, "exit\r", 5);
+  for (int i = 0; i < 100; ++i) {
+    if (waitpid(s->pid, 0, WNOHANG) == s->pid) goto out;
+    usleep(10000);
+  }
+  kill(s->pid, SIGKILL);
+  waitpid(s->pid, 0, 0);
+out:
+  close(s->master);
+}
+
+/** Types a command one key at a time, then presses Enter
+ *
+ * @returns 0 on success, -1 if an echo or the next prompt never arrived
+ */
+static int
+type_command(struct session *s,
+             char const *cmd,
+             struct samples *echo,
+             struct samples *enter)
+{
+  for (char const *c = cmd; *c; ++c) {
+    char needle[2] = {*c, 0};
+    double t0 = now_us();
+    session_send(s, c, 1);
+    if (session_expect(s, needle) < 0) return -1;
+    samples_add(echo, now_us() - t0);
+  }
+  double t0 = now_us();
+  session_send(s, "\r", 1);
+  if (session_expect(s, SENTINEL) < 0) return -1;
+  samples_add(enter, now_us() - t0);
+  return 0;
+}
+
+static void
+run_simple(char const *shell,
+           char const *title,
+           char const *ps1,
+           char const *cmd,
+           int iterations)
+{
+  char ename[64], nname[64];
+  snprintf(ename, sizeof ename, "%s: key->echo", title);
+  snprintf(nname, sizeof nname, "%s: enter->prompt", title);
+  struct samples echo = {.name = ename}, enter = {.name = nname};
+
+  struct session s;
+  if (session_start(&s, shell, ps1) < 0) {
+    warnx("%s: shell never printed a prompt", title);
+    return;
+  }
+  for (int i = 0; i < iterations; ++i) {
+    if (type_command(&s, cmd, &echo, &enter) < 0) {
+      warnx("%s: timed out on iteration %d", title, i);
+      break;
+    }
+  }
+  session_stop(&s);
+  samples_report(&echo);
+  samples_report(&enter);
+}
+
+static void
+run_jobctl(char const *shell, int iterations)
+{
+  struct samples start = {.name = "jobctl: cat enter->run"},
+                 stop = {.name = "jobctl: ^Z->prompt"},
+                 resume = {.name = "jobctl: fg enter->run"},
+                 finish = {.name = "jobctl: ^D->prompt"};
+  struct session s;
+  if (session_start(&s, shell, SENTINEL) < 0) {
+    warnx("jobctl: shell never printed a prompt");
+    return;
+  }
+  for (int i = 0; i < iterations; ++i) {
+    /* cat echoes a marker line back once it owns the terminal. The line
+     * number tells its output from the echo of the input, which a line
+     * editor does not produce for typeahead it leaves in raw mode */
+    double t0 = now_us();
+    session_send(&s, "cat -n\r", 7);
+    session_send(&s, "ping\r", 5);
+    if (session_expect(&s, "\tping") < 0) goto timeout;
+    samples_add(&start, now_us() - t0);
+
+    t0 = now_us();
+    session_send(&s, "\x1a", 1);
+    if (session_expect(&s, SENTINEL) < 0) goto timeout;
+    samples_add(&stop, now_us() - t0);
+
+    t0 = now_us();
+    session_send(&s, "fg\r", 3);
+    session_send(&s, "pong\r", 5);
+    if (session_expect(&s, "\tpong") < 0) goto timeout;
+    samples_add(&resume, now_us() - t0);
+
+    t0 = now_us();
+    session_send(&s, "\x04", 1);
+    if (session_expect(&s, SENTINEL) < 0) goto timeout;
+    samples_add(&finish, now_us() - t0);
+  }
+  if (0) {
+  timeout:
+    warnx("jobctl: timed out");
+  }
+  session_stop(&s);
+  samples_report(&start);
+  samples_report(&stop);
+  samples_report(&resume);
+  samples_report(&finish);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int iterations = 200;
+  int opt;
+  while ((opt = getopt(argc, argv, "n:")) != -1) {
+    switch (opt) {
+      case 'n':
+        iterations = atoi(optarg);
+        break;
+      default:
+        goto usage;
+    }
+  }
+  if (optind != argc - 1 || iterations <= 0) goto usage;
+  char const *shell = argv[optind];
+
+  signal(SIGPIPE, SIG_IGN);
+  int fd = mkstemp(histfile);
+  if (fd < 0) err(1, "mkstemp");
+  close(fd);
+  printf("%-28s %6s %9s %9s %9s %9s %9s\n",
+         "latency (us)",
+         "n",
+         "min",
+         "mean",
+         "p50",
+         "p99",
+         "max");
+  run_simple(shell, "builtin", SENTINEL, "cd .", iterations);
+  run_simple(shell, "external", SENTINEL, "/bin/true", iterations);
+  run_simple(shell, "ps1", "\\u@\\h \\w" SENTINEL, "cd .", iterations);
+  run_jobctl(shell, iterations / 10 ? iterations / 10 : 1);
+  unlink(histfile);
+  return 0;
+
+usage:
+  fprintf(stderr, "usage: %s [-n iterations] path/to/bigshell\n", argv[0]);
+  return 2;
+}
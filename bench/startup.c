@@ -0,0 +1,198 @@
+/** Startup-time benchmark
+ *
+ * Measures how long bigshell takes from exec() to starting its first
+ * command. The first command is this program in "mark" mode, which reports
+ * the CLOCK_MONOTONIC time at which it reached main(). The same marker is
+ * also exec'd directly, without a shell, and that baseline is subtracted, so
+ * what remains is the shell's own startup plus the cost of parsing and
+ * spawning one command.
+ *
+ * Build:  cc -O2 -o startup bench/startup.c
+ * Usage:  startup [-n iterations] path/to/bigshell
+ *
+ * Modes:
+ *   -c      bigshell -c 'startup mark'
+ *   script  bigshell file, where file holds the same line
+ *   stdin   the line is written to bigshell's stdin through a pipe
+ *
+ * The target for the -c mode is a median under 200 us.
+ */
+#define _GNU_SOURCE
+#include <err.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define TARGET_US 200.0
+
+enum mode { MODE_DIRECT, MODE_C, MODE_SCRIPT, MODE_STDIN };
+
+static int64_t
+now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * INT64_C(1000000000) + ts.tv_nsec;
+}
+
+static int
+cmp_double(void const *a, void const *b)
+{
+  double x = *(double const *)a, y = *(double const *)b;
+  return (x > y) - (x < y);
+}
+
+/** Runs the marker once, through the shell or directly
+ *
+ * @returns microseconds from just before fork() until the marker's main()
+ */
+static double
+run_once(enum mode mode,
+         char const *shell,
+         char const *self,
+         char const *line,
+         char const *script)
+{
+  int out[2], in[2] = {-1, -1};
+  if (pipe(out) < 0) err(1, "pipe");
+  if (mode == MODE_STDIN && pipe(in) < 0) err(1, "pipe");
+
+  int64_t t0 = now_ns();
+  pid_t pid = fork();
+  if (pid < 0) err(1, "fork");
+  if (pid == 0) {
+    dup2(out[1], STDOUT_FILENO);
+    close(out[0]);
+    close(out[1]);
+    if (in[0] >= 0) {
+      dup2(in[0], STDIN_FILENO);
+      close(in[0]);
+      close(in[1]);
+    }
+    switch (mode) {
+      case MODE_DIRECT:
+        execl(self, self, "mark", (char *)0);
+        break;
+      case MODE_C:
+        execl(shell, shell, "-c", line, (char *)0);
+        break;
+      case MODE_SCRIPT:
+        execl(shell, shell, script, (char *)0);
+        break;
+      case MODE_STDIN:
+        execl(shell, shell, (char *)0);
+        break;
+    }
+    _exit(127);
+  }
+  close(out[1]);
+  if (in[1] >= 0) {
+    close(in[0]);
+    if (write(in[1], line, strlen(line)) < 0 || write(in[1], "\n", 1) < 0) {
+      err(1, "write");
+    }
+    close(in[1]);
+  }
+
+  int64_t mark = 0;
+  ssize_t n = read(out[0], &mark, sizeof mark);
+  close(out[0]);
+  waitpid(pid, 0, 0);
+  if (n != sizeof mark) errx(1, "marker did not run");
+  return (mark - t0) / 1e3;
+}
+
+static void
+report(char const *name, double *us, int n, double baseline)
+{
+  qsort(us, n, sizeof *us, cmp_double);
+  double p50 = us[n / 2];
+  printf("%-8s %9.1f %9.1f %9.1f %9.1f %12.1f\n",
+         name,
+         us[0],
+         p50,
+         us[(n * 99) / 100],
+         us[n - 1],
+         p50 - baseline);
+}
+
+int
+main(int argc, char *argv[])
+{
+  if (argc == 2 && strcmp(argv[1], "mark") == 0) {
+    int64_t t = now_ns();
+    return write(STDOUT_FILENO, &t, sizeof t) == sizeof t ? 0 : 1;
+  }
+
+  int iterations = 500;
+  int opt;
+  while ((opt = getopt(argc, argv, "n:")) != -1) {
+    switch (opt) {
+      case 'n':
+        iterations = atoi(optarg);
+        break;
+      default:
+        goto usage;
+    }
+  }
+  if (optind != argc - 1 || iterations <= 0) goto usage;
+  char const *shell = argv[optind];
+
+  char self[4096];
+  ssize_t len = readlink("/proc/self/exe", self, sizeof self - 1);
+  if (len < 0) err(1, "readlink");
+  self[len] = '\0';
+
+  char line[4200];
+  snprintf(line, sizeof line, "%s mark", self);
+
+  char script[] = "/tmp/bigshell-startup-XXXXXX";
+  int fd = mkstemp(script);
+  if (fd < 0) err(1, "mkstemp");
+  dprintf(fd, "%s\n", line);
+  close(fd);
+
+  double *us = malloc(sizeof *us * iterations);
+  if (!us) err(1, 0);
+
+  static char const *const names[] = {"direct", "-c", "script", "stdin"};
+  double baseline = 0;
+  printf("%-8s %9s %9s %9s %9s %12s\n",
+         "us",
+         "min",
+         "p50",
+         "p99",
+         "max",
+         "p50-direct");
+  for (enum mode m = MODE_DIRECT; m <= MODE_STDIN; ++m) {
+    for (int i = 0; i < iterations; ++i) {
+      us[i] = run_once(m, shell, self, line, script);
+    }
+    if (m == MODE_DIRECT) {
+      qsort(us, iterations, sizeof *us, cmp_double);
+      baseline = us[iterations / 2];
+    }
+    report(names[m], us, iterations, baseline);
+    if (m == MODE_C) {
+      qsort(us, iterations, sizeof *us, cmp_double);
+      double over = us[iterations / 2] - baseline;
+      fprintf(stderr,
+              "-c shell overhead %.1f us (target %.0f us): %s\n",
+              over,
+              TARGET_US,
+              over < TARGET_US ? "ok" : "over budget");
+    }
+  }
+  unlink(script);
+  free(us);
+  return 0;
+
+usage:
+  fprintf(stderr, "usage: %s [-n iterations] path/to/bigshell\n", argv[0]);
+  return 2;
+}
@@ -0,0 +1,305 @@
+/** Syscall budget check for the REPL hot path
+ *
+ * Runs bigshell on a pseudo-terminal under ptrace(2) and counts the system
+ * calls the shell process itself makes (not its children) in each REPL
+ * iteration: from the read that picks up a command line to the read that
+ * waits for the next one, including the command's execution, the
+ * background job scan and the prompt. Each scenario is repeated and its
+ * cheapest iteration is compared against a budget recorded below. The exit
+ * status is 1 if any scenario is over budget, so CI can run it after a
+ * build.
+ *
+ * Build:  cc -O2 -o syscount bench/syscount.c -lutil
+ * Usage:  syscount [-v] [-n iterations] path/to/bigshell
+ *
+ *   -v  list the calls in each scenario's cheapest iteration
+ *
+ * When a change removes system calls, lower the budget here so they stay
+ * removed; when one adds them on purpose, raise it in the same commit.
+ */
+#define _GNU_SOURCE
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pty.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/ptrace.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_NR 512
+#define WARMUP 3
+
+static struct scenario {
+  char const *name;
+  char const *line;
+  unsigned budget;    /* system calls per REPL iteration */
+  unsigned settle_us; /* pause before each line */
+} scenarios[] = {
+    /* The line editor reads a line a byte at a time, so each budget has
+     * one read() per byte after the first, plus one FIONREAD ioctl, and one
+     * write() that appends the line to the history file */
+    {"builtin", "cd .\r", 13, 0},
+    /* Foreground jobs get the terminal back in cooked mode, and raw mode is
+     * set again at the next prompt: two tcsetattr() calls, three ioctls each
+     * in current glibc */
+    {"external", "/bin/true\r", 32, 0},
+    {"pipeline", "/bin/true | /bin/true\r", 51, 0},
+    /* The pause lets the previous job exit, so that every iteration both
+     * starts a job and reaps one */
+    {"background", "/bin/true &\r", 26, 20000},
+};
+#define SCENARIO_COUNT (sizeof scenarios / sizeof *scenarios)
+
+static struct {
+  int nr;
+  char const *name;
+} const names[] = {
+#define N(x) {SYS_##x, #x}
+    N(read), N(write), N(open), N(openat), N(close), N(fstat), N(newfstatat),
+    N(lseek), N(mmap), N(munmap), N(brk), N(rt_sigaction), N(rt_sigprocmask),
+    N(ioctl), N(pipe), N(pipe2), N(dup), N(dup2), N(dup3), N(fcntl), N(clone),
+    N(clone3), N(fork), N(vfork), N(execve), N(wait4), N(waitid), N(kill),
+    N(getpid), N(getppid), N(getuid), N(geteuid), N(setpgid), N(getpgid),
+    N(getpgrp), N(setsid), N(getcwd), N(chdir), N(fchdir), N(poll), N(ppoll),
+    N(select), N(pselect6), N(getrusage), N(clock_gettime), N(gettid),
+    N(tgkill), N(rt_sigreturn), N(readlink), N(access), N(faccessat), N(statx),
+    N(getdents64), N(madvise), N(mprotect), N(prlimit64), N(timer_settime),
+    N(perf_event_open), N(writev), N(fsync), N(fdatasync), N(sched_yield),
+    N(futex), N(uname),
+#undef N
+};
+
+static char const *
+syscall_name(int nr)
+{
+  for (size_t i = 0; i < sizeof names / sizeof *names; ++i) {
+    if (names[i].nr == nr) return names[i].name;
+  }
+  static char buf[16];
+  snprintf(buf, sizeof buf, "syscall_%d", nr);
+  return buf;
+}
+
+struct window {
+  unsigned total;
+  unsigned per_nr[MAX_NR];
+};
+
+struct result {
+  unsigned count;
+  unsigned *totals; /* one per measured iteration */
+  struct window best;
+};
+
+/* Bytes waiting in the terminal's input queue, as the shell would see them */
+static int
+input_queued(int slave)
+{
+  int n = 0;
+  if (ioctl(slave, FIONREAD, &n) < 0) return -1;
+  return n;
+}
+
+static void
+send_line(int master, int slave, char const *line)
+{
+  size_t len = strlen(line);
+  if (write(master, line, len) != (ssize_t)len) err(1, "write to pty");
+  /* The line discipline queues input asynchronously; wait for it */
+  for (int i = 0; i < 5000 && input_queued(slave) <= 0; ++i) usleep(100);
+}
+
+/* Discards the shell's output so it never blocks on a full pty */
+static void
+drain(int master)
+{
+  char buf[4096];
+  while (read(master, buf, sizeof buf) > 0);
+}
+
+/* Whether a system call is the shell waiting for its next command */
+static int
+is_input_wait(struct __ptrace_syscall_info const *si)
+{
+  switch (si->entry.nr) {
+    case SYS_read:
+      return si->entry.args[0] == STDIN_FILENO;
+    case SYS_poll:
+    case SYS_ppoll:
+    case SYS_select:
+    case SYS_pselect6:
+      return 1;
+    default:
+      return 0;
+  }
+}
+
+static int
+cmp_unsigned(void const *a, void const *b)
+{
+  unsigned x = *(unsigned const *)a, y = *(unsigned const *)b;
+  return (x > y) - (x < y);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int iterations = 20;
+  int verbose = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "vn:")) != -1) {
+    switch (opt) {
+      case 'v':
+        verbose = 1;
+        break;
+      case 'n':
+        iterations = atoi(optarg);
+        break;
+      default:
+        goto usage;
+    }
+  }
+  if (optind != argc - 1 || iterations <= 0) goto usage;
+  char const *shell = argv[optind];
+
+  /* The plan: for each scenario, WARMUP unmeasured lines, then the
+   * measured ones, then exit */
+  size_t const per_scenario = WARMUP + iterations;
+  size_t const plan_len = SCENARIO_COUNT * per_scenario;
+
+  /* The lines go to a history file of our own rather than the user's; it
+   * has to be a real file, as its write() is part of each budget */
+  char histfile[] = "/tmp/bigshell-syscount-XXXXXX";
+  int fd = mkstemp(histfile);
+  if (fd < 0) err(1, "mkstemp");
+  close(fd);
+
+  struct winsize ws = {.ws_row = 24, .ws_col = 200};
+  int master;
+  pid_t pid = forkpty(&master, 0, 0, &ws);
+  if (pid < 0) err(1, "forkpty");
+  if (pid == 0) {
+    setenv("PS1", "$ ", 1);
+    setenv("BIGSHELL_HISTFILE", histfile, 1);
+    if (ptrace(PTRACE_TRACEME, 0, 0, 0) < 0) _exit(126);
+    raise(SIGSTOP);
+    execl(shell, shell, (char *)0);
+    _exit(127);
+  }
+  int slave = open(ptsname(master), O_RDWR | O_NOCTTY);
+  if (slave < 0) err(1, "open %s", ptsname(master));
+  fcntl(master, F_SETFL, fcntl(master, F_GETFL) | O_NONBLOCK);
+
+  int status;
+  if (waitpid(pid, &status, 0) < 0 || !WIFSTOPPED(status)) {
+    errx(1, "child did not stop");
+  }
+  if (ptrace(PTRACE_SETOPTIONS,
+             pid,
+             0,
+             PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACEEXEC |
+                 PTRACE_O_EXITKILL) < 0) {
+    err(1, "PTRACE_SETOPTIONS");
+  }
+
+  struct result results[SCENARIO_COUNT] = {0};
+  for (size_t s = 0; s < SCENARIO_COUNT; ++s) {
+    results[s].totals = calloc(iterations, sizeof *results[s].totals);
+    if (!results[s].totals) err(1, 0);
+    results[s].best.total = -1;
+  }
+
+  /* The first window is startup; it and the warmups are not measured */
+  static struct window cur;
+  long step = -1; /* index into the plan of the line being run */
+  int sig = 0;
+  for (;;) {
+    if (ptrace(PTRACE_SYSCALL, pid, 0, sig) < 0) err(1, "PTRACE_SYSCALL");
+    sig = 0;
+    if (waitpid(pid, &status, 0) < 0) err(1, "waitpid");
+    if (WIFEXITED(status) || WIFSIGNALED(status)) break;
+    if (!WIFSTOPPED(status)) continue;
+    if (status >> 8 == (SIGTRAP | PTRACE_EVENT_EXEC << 8)) continue;
+    if (WSTOPSIG(status) != (SIGTRAP | 0x80)) {
+      sig = WSTOPSIG(status); /* deliver it */
+      continue;
+    }
+
+    struct __ptrace_syscall_info si;
+    if (ptrace(PTRACE_GET_SYSCALL_INFO, pid, sizeof si, &si) < 0) {
+      err(1, "PTRACE_GET_SYSCALL_INFO");
+    }
+    if (si.op != PTRACE_SYSCALL_INFO_ENTRY) continue;
+
+    drain(master);
+    if (is_input_wait(&si) && input_queued(slave) == 0) {
+      /* One REPL iteration is over */
+      if (step >= 0 && (size_t)step < plan_len) {
+        size_t const sc = step / per_scenario;
+        long const it = (long)(step % per_scenario) - WARMUP;
+        if (it >= 0) {
+          struct result *r = &results[sc];
+          r->totals[r->count++] = cur.total;
+          if (cur.total < r->best.total) r->best = cur;
+        }
+      }
+      memset(&cur, 0, sizeof cur);
+      ++step;
+      if ((size_t)step < plan_len) {
+        struct scenario const *sc = &scenarios[step / per_scenario];
+        usleep(sc->settle_us);
+        send_line(master, slave, sc->line);
+      } else if ((size_t)step == plan_len) {
+        send_line(master, slave, "exit\r");
+      }
+    }
+    ++cur.total;
+    if (si.entry.nr < MAX_NR) ++cur.per_nr[si.entry.nr];
+  }
+  unlink(histfile);
+
+  int over = 0;
+  printf("%-12s %6s %6s %6s %6s\n", "syscalls", "n", "min", "p50", "budget");
+  for (size_t s = 0; s < SCENARIO_COUNT; ++s) {
+    struct result *r = &results[s];
+    if (r->count == 0) {
+      printf("%-12s %6s\n", scenarios[s].name, "n/a");
+      over = 1;
+      continue;
+    }
+    qsort(r->totals, r->count, sizeof *r->totals, cmp_unsigned);
+    int const bad = r->totals[0] > scenarios[s].budget;
+    over |= bad;
+    printf("%-12s %6u %6u %6u %6u  %s\n",
+           scenarios[s].name,
+           r->count,
+           r->totals[0],
+           r->totals[r->count / 2],
+           scenarios[s].budget,
+           bad ? "OVER BUDGET"
+           : r->totals[0] < scenarios[s].budget ? "(budget can be lowered)"
+                                                 : "ok");
+    if (verbose) {
+      for (int nr = 0; nr < MAX_NR; ++nr) {
+        if (r->best.per_nr[nr]) {
+          printf("    %-20s %u\n", syscall_name(nr), r->best.per_nr[nr]);
+        }
+      }
+    }
+  }
+  return over;
+
+usage:
+  fprintf(stderr,
+          "usage: %s [-v] [-n iterations] path/to/bigshell\n",
+          argv[0]);
+  return 2;
+}
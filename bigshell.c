@@ -6,28 +6,131 @@
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
+#include "admit.h"
+#include "alloc.h"
+#include "cgroup.h"
+#include "execlog.h"
 #include "exit.h"
+#include "fdcache.h"
+#include "lineedit.h"
 #include "params.h"
 #include "parser.h"
+#include "perfctr.h"
+#include "profile.h"
+#include "record.h"
+#include "region.h"
 #include "runner.h"
+#include "sampler.h"
 #include "signal.h"
-#include "util/gprintf.h"
+#include "statsock.h"
+#include "util/trace.h"
 #include "wait.h"
 
+static void
+usage(char const *argv0)
+{
+  fprintf(stderr,
+          "usage: %s [--profile out.folded] [--record log]\n"
+          "       [-c command_string | file | --replay log [--fast]]\n",
+          argv0);
+  exit(2);
+}
+
 /** Main bigshell loop
+ *
+ * bigshell                   read commands from stdin
+ * bigshell -c command_string read commands from command_string
+ * bigshell file              read commands from file
+ *
+ * bigshell --replay log       read the commands recorded in log
+ *
+ * --profile out.folded        profile each input line (see profile.h)
+ * --record log                record the session to log (see record.h)
+ * --fast                      replay without the recorded pauses
+ *
+ * Only a shell reading stdin can be interactive. Everything else a
+ * non-interactive shell can do without (the tty check, signal dispositions)
+ * is skipped, so that it reaches its first command as early as possible.
  */
 int
 main(int argc, char *argv[])
 {
   struct command_list *cl = 0;
+  FILE *input = stdin;
+  char const *command_string = 0;
+  char const *profile_path = 0;
+  char const *record_path = 0;
+  char const *replay_path = 0;
+  int replay_fast = 0;
+
+  int i = 1;
+  for (; i < argc && argv[i][0] == '-'; ++i) {
+    if (strcmp(argv[i], "--") == 0) {
+      ++i;
+      break;
+    } else if (strcmp(argv[i], "-c") == 0) {
+      if (++i == argc) usage(argv[0]);
+      command_string = argv[i];
+    } else if (strcmp(argv[i], "--profile") == 0) {
+      if (++i == argc) usage(argv[0]);
+      profile_path = argv[i];
+    } else if (strcmp(argv[i], "--record") == 0) {
+      if (++i == argc) usage(argv[0]);
+      record_path = argv[i];
+    } else if (strcmp(argv[i], "--replay") == 0) {
+      if (++i == argc) usage(argv[0]);
+      replay_path = argv[i];
+    } else if (strcmp(argv[i], "--fast") == 0) {
+      replay_fast = 1;
+    } else {
+      usage(argv[0]);
+    }
+  }
 
   /* Program initialization routines */
-  if (parser_init() < 0) goto err;
-  /* TODO Enable this line once you've implemented the function */
-  if (signal_init() < 0) goto err;
+  if (trace_init() < 0) warn("BIGSHELL_TRACE");
+  if (execlog_init() < 0) warn("BIGSHELL_EXECLOG");
+  if (fdcache_init() < 0) warn("BIGSHELL_FDCACHE");
+  if (perfctr_init() < 0) warnx("BIGSHELL_PERF: no performance counters");
+  cgroup_init();
+  if (sampler_init() < 0) warn("BIGSHELL_SAMPLE");
+  if (statsock_init() < 0) warn("BIGSHELL_STATSOCK");
+  if (replay_path) {
+    if (i != argc || command_string || record_path) usage(argv[0]);
+    input = record_replay(replay_path, replay_fast);
+    if (!input) goto err;
+  } else if (command_string) {
+    if (i != argc) usage(argv[0]);
+    if (!*command_string) bigshell_exit();
+    input = fmemopen((void *)command_string, strlen(command_string), "r");
+    if (!input) goto err;
+  } else if (i < argc) {
+    if (i != argc - 1) usage(argv[0]);
+    input = fopen(argv[i], "r");
+    if (!input) goto err;
+  } else {
+    if (parser_init() < 0) goto err;
+    if (is_interactive) {
+      input = lineedit_open(input);
+      lineedit_idle_source(admit_ready, admit_run);
+    }
+  }
+  if (record_path) {
+    input = record_open(record_path, input);
+    if (!input) goto err;
+  }
+  if (is_interactive && signal_init() < 0) goto err;
+  if (profile_path) {
+    char const *script = replay_path    ? replay_path
+                         : command_string ? "-c"
+                         : i < argc       ? argv[i]
+                                          : "stdin";
+    if (profile_start(profile_path, script) < 0) goto err;
+  }
 
   /* Main Event Loop: REPL -- Read Evaluate Print Loop */
   for (;;) {
@@ -35,20 +138,23 @@ prompt:
     /* Check on backround jobs */
     if (wait_on_bg_jobs() < 0) goto err;
 
+    /* and on the ones waiting for the host to be less busy */
+    admit_run();
+
+    /* Nobody is waiting on the shell while it waits on the user */
+    if (is_interactive) execlog_flush();
+
     /* Read input and parse it into a list of commands */
-    
-    /* TODO Enable this line once you've implemented the function */
-    if (signal_enable_interrupt(SIGINT) < 0) goto err;
-    
-    int res = command_list_parse(&cl, stdin);
-    
-    /* TODO Enable this line once you've implemented the function */
-     if (signal_ignore(SIGINT) < 0) goto err;
+    if (is_interactive && signal_enable_interrupt(SIGINT) < 0) goto err;
+
+    int res = command_list_parse(&cl, input);
+
+    if (is_interactive && signal_ignore(SIGINT) < 0) goto err;
 
     if (res == -1) { /* System library errors */
       switch (errno) { /* Handle specific errors */
         case EINTR:
-          clearerr(stdin);
+          clearerr(input);
           errno = 0;
           fputc('\n', stderr);
           goto prompt;
@@ -60,29 +166,50 @@ prompt:
       errno = 0;
       goto prompt;
     } else if (res == 0) { /* No commands parsed */
-      if (feof(stdin)) bigshell_exit(); /* Exit on eof */
+      if (feof(input)) { /* Exit on eof */
+        /* A script's queued jobs are started; a user has left */
+        if (!is_interactive) admit_drain();
+        bigshell_exit();
+      }
       goto prompt; /* Blank line */
     } else {
-      gprintf("Parsed command list to execute:");
-#ifndef NDEBUG
-      command_list_print(cl, stderr);
-      fputc('\n', stderr);
-#endif
-      gprintf("executing command list with %zu commands", cl->command_count);
+      if (trace_enabled(TRACE_PARSE)) {
+        char *text = 0;
+        size_t len = 0;
+        FILE *f = open_memstream(&text, &len);
+        if (f) {
+          command_list_print(cl, f);
+          fclose(f);
+          trace(TRACE_PARSE, "parsed: %s", text);
+        }
+        free(text);
+      }
+      trace(TRACE_PARSE,
+            "executing command list with %zu commands",
+            cl->command_count);
 
       /* Execute commands */
+      bigshell_command_list = cl;
+      statsock_begin(cl);
+      profile_begin(cl);
+      record_begin(cl);
       run_command_list(cl);
+      record_end(cl);
+      profile_end(cl);
+      statsock_end();
+      bigshell_command_list = 0;
 
       /* Cleanup */
       command_list_free(cl);
-      free(cl);
+      alloc_free(cl);
       cl = 0;
+      region_trim();
     }
   }
 
 err:
   if (cl) command_list_free(cl);
-  free(cl);
+  alloc_free(cl);
   params.status = 127;
   warn(0);
   bigshell_exit();
@@ -7,10 +7,18 @@
 #include <string.h>
 #include <unistd.h>
 
+#include "alloc.h"
 #include "builtins.h"
+#include "cgroup.h"
 #include "exit.h"
+#include "fgboost.h"
 #include "jobs.h"
 #include "params.h"
+#include "perfctr.h"
+#include "sampler.h"
+#include "segment.h"
+#include "stats.h"
+#include "util/trace.h"
 #include "vars.h"
 #include "wait.h"
 
@@ -306,22 +314,253 @@ err:
 
 /** prints a list of background jobs
  *
- * @returns 0 (always succeeds)
+ * @returns 0 on success, -1 on failure
  *
- * XXX DO NOT MODIFY XXX
+ * jobs     print the job id and process group of each job
+ * jobs -l  also print each job's performance counters, if BIGSHELL_PERF is
+ *          set (see perfctr.h), and its cgroup's usage, if BIGSHELL_CGROUP
+ *          is (see cgroup.h)
  */
 static int
 builtin_jobs(struct command *cmd, struct builtin_redir const *redir_list)
 {
+  int const fd = get_pseudo_fd(redir_list, STDERR_FILENO);
+  int long_format = 0;
+  if (cmd->word_count == 2 && strcmp(cmd->words[1], "-l") == 0) {
+    long_format = 1;
+  } else if (cmd->word_count != 1) {
+    dprintf(fd, "usage: jobs [-l]\n");
+    return -1;
+  }
   size_t job_count = jobs_get_joblist_size();
   struct job const *jobs = jobs_get_joblist();
   for (size_t i = 0; i < job_count; ++i) {
-    dprintf(get_pseudo_fd(redir_list, STDERR_FILENO),
-            "[%jd] %jd\n",
-            (intmax_t)jobs[i].jid,
-            (intmax_t)jobs[i].pgid);
+    dprintf(fd, "[%jd] %jd\n", (intmax_t)jobs[i].jid, (intmax_t)jobs[i].pgid);
+    struct perfctr_counts counts;
+    if (long_format && perfctr_read(jobs[i].pgid, &counts) == 0) {
+      perfctr_print(fd, &counts, "    ");
+    }
+    struct cgroup_usage usage;
+    if (long_format && cgroup_read(jobs[i].pgid, &usage) == 0) {
+      cgroup_print(fd, &usage, "    ");
+    }
+  }
+  return 0;
+}
+
+/** sets shell options
+ *
+ * @returns 0 on success, -1 on failure
+ *
+ * set -o                       print option settings
+ * set -o trace=category[,...]  enable trace categories (see util/trace.h)
+ * set +o trace                 disable tracing
+ * set -o fgboost               lower background jobs' priority while a job
+ *                              runs in the foreground (see fgboost.h)
+ * set +o fgboost               leave it alone
+ */
+static int
+builtin_set(struct command *cmd, struct builtin_redir const *redir_list)
+{
+  int const out = get_pseudo_fd(redir_list, STDOUT_FILENO);
+  int const errfd = get_pseudo_fd(redir_list, STDERR_FILENO);
+  if (cmd->word_count == 2 && strcmp(cmd->words[1], "-o") == 0) {
+    char buf[128];
+    dprintf(out, "trace=%s\n", trace_get(buf, sizeof buf));
+    dprintf(out, "%cfgboost\n", fgboost_enabled ? '-' : '+');
+    return 0;
+  }
+  if (cmd->word_count != 3) goto usage;
+
+  char const *flag = cmd->words[1], *opt = cmd->words[2];
+  if (strcmp(flag, "-o") == 0 && strncmp(opt, "trace=", 6) == 0) {
+    if (trace_set(opt + 6) < 0) {
+      dprintf(errfd, "set: %s: %s\n", opt, strerror(errno));
+      return -1;
+    }
+    return 0;
+  } else if (strcmp(flag, "+o") == 0 && strcmp(opt, "trace") == 0) {
+    return trace_set("none");
+  } else if (strcmp(opt, "fgboost") == 0 &&
+             (strcmp(flag, "-o") == 0 || strcmp(flag, "+o") == 0)) {
+    fgboost_enabled = flag[0] == '-';
+    return 0;
+  }
+usage:
+  dprintf(errfd,
+          "usage: set [-o trace=category,...] [+o trace] [-o|+o fgboost]\n");
+  return -1;
+}
+
+/** writes out the trace ring buffer
+ *
+ * @returns 0 on success, -1 on failure
+ *
+ * trace     write the buffered trace records, oldest first, to stdout
+ * trace -c  discard the buffered trace records
+ */
+static int
+builtin_trace(struct command *cmd, struct builtin_redir const *redir_list)
+{
+  if (cmd->word_count == 1) {
+    trace_dump(get_pseudo_fd(redir_list, STDOUT_FILENO));
+    return 0;
+  }
+  if (cmd->word_count == 2 && strcmp(cmd->words[1], "-c") == 0) {
+    trace_clear();
+    return 0;
+  }
+  dprintf(get_pseudo_fd(redir_list, STDERR_FILENO), "usage: trace [-c]\n");
+  return -1;
+}
+
+/** prints or resets the shell's own latency histograms
+ *
+ * @returns 0 on success, -1 on failure
+ *
+ * shellstats     print counts, means and percentiles for each REPL stage
+ * shellstats -r  discard all samples
+ */
+static int
+builtin_shellstats(struct command *cmd, struct builtin_redir const *redir_list)
+{
+  if (cmd->word_count == 1) {
+    stats_print(get_pseudo_fd(redir_list, STDOUT_FILENO));
+    return 0;
+  }
+  if (cmd->word_count == 2 && strcmp(cmd->words[1], "-r") == 0) {
+    stats_reset();
+    return 0;
+  }
+  dprintf(get_pseudo_fd(redir_list, STDERR_FILENO), "usage: shellstats [-r]\n");
+  return -1;
+}
+
+/** prints allocation counters, or asserts that tags have nothing live
+ *
+ * @returns 0 on success, -1 on failure
+ *
+ * allocstats              print live, peak and total allocations per tag
+ * allocstats -r           reset the peaks and totals
+ * allocstats -z tag...    fail, listing them, if any of the tags have live
+ *                         allocations
+ *
+ * Requires a build with -DBIGSHELL_ALLOC_ACCOUNTING.
+ */
+static int
+builtin_allocstats(struct command *cmd, struct builtin_redir const *redir_list)
+{
+  int const out = get_pseudo_fd(redir_list, STDOUT_FILENO);
+  int const errfd = get_pseudo_fd(redir_list, STDERR_FILENO);
+  if (!alloc_accounting) {
+    dprintf(errfd, "allocstats: allocation accounting is not compiled in\n");
+    return -1;
+  }
+  if (cmd->word_count == 1) {
+    alloc_print(out);
+    return 0;
+  }
+  if (cmd->word_count == 2 && strcmp(cmd->words[1], "-r") == 0) {
+    alloc_reset();
+    return 0;
+  }
+  if (cmd->word_count >= 3 && strcmp(cmd->words[1], "-z") == 0) {
+    int status = 0;
+    for (size_t i = 2; i < cmd->word_count; ++i) {
+      int tag = alloc_tag_by_name(cmd->words[i]);
+      if (tag < 0) {
+        dprintf(errfd, "allocstats: %s: no such tag\n", cmd->words[i]);
+        return -1;
+      }
+      size_t n = alloc_outstanding(tag);
+      if (n) {
+        dprintf(errfd,
+                "allocstats: %s: %zu live allocations\n",
+                cmd->words[i],
+                n);
+        status = -1;
+      }
+    }
+    return status;
+  }
+  dprintf(errfd, "usage: allocstats [-r | -z tag...]\n");
+  return -1;
+}
+
+/** controls the sampling profiler for the shell itself (see sampler.h)
+ *
+ * @returns 0 on success, -1 on failure
+ *
+ * sampler             print whether it is running and what it has recorded
+ * sampler start [hz]  start sampling, at 997 Hz by default
+ * sampler stop        stop sampling, keeping the samples
+ * sampler write file  write the samples as folded stacks to file
+ */
+static int
+builtin_sampler(struct command *cmd, struct builtin_redir const *redir_list)
+{
+  int const errfd = get_pseudo_fd(redir_list, STDERR_FILENO);
+  if (cmd->word_count == 1) {
+    sampler_print(get_pseudo_fd(redir_list, STDOUT_FILENO));
+    return 0;
+  }
+  char const *op = cmd->words[1];
+  if (strcmp(op, "start") == 0 && cmd->word_count <= 3) {
+    unsigned long hz = 997;
+    if (cmd->word_count == 3) {
+      char *end;
+      hz = strtoul(cmd->words[2], &end, 10);
+      if (!*cmd->words[2] || *end || hz > UINT_MAX) goto usage;
+    }
+    if (sampler_start(hz) < 0) goto err;
+    return 0;
+  }
+  if (strcmp(op, "stop") == 0 && cmd->word_count == 2) {
+    sampler_stop();
+    return 0;
+  }
+  if (strcmp(op, "write") == 0 && cmd->word_count == 3) {
+    if (sampler_write(cmd->words[2]) < 0) goto err;
+    return 0;
+  }
+usage:
+  dprintf(errfd, "usage: sampler [start [hz] | stop | write file]\n");
+  return -1;
+err:
+  dprintf(errfd, "sampler: %s\n", strerror(errno));
+  return -1;
+}
+
+/** defines, removes or lists asynchronous prompt segments (see segment.h)
+ *
+ * @returns 0 on success, -1 on failure
+ *
+ * segment               list the segments, with their values for $PWD
+ * segment name command  show the output of command in the prompt as \{name}
+ * segment -d name       remove segment name
+ */
+static int
+builtin_segment(struct command *cmd, struct builtin_redir const *redir_list)
+{
+  int const errfd = get_pseudo_fd(redir_list, STDERR_FILENO);
+  if (cmd->word_count == 1) {
+    segment_print(get_pseudo_fd(redir_list, STDOUT_FILENO));
+    return 0;
+  }
+  if (cmd->word_count != 3) goto usage;
+  char const *name = cmd->words[1], *command = cmd->words[2];
+  if (strcmp(name, "-d") == 0) {
+    name = command;
+    command = 0;
+  }
+  if (segment_define(name, command) < 0) {
+    dprintf(errfd, "segment: %s: %s\n", name, strerror(errno));
+    return -1;
   }
   return 0;
+usage:
+  dprintf(errfd, "usage: segment [name command | -d name]\n");
+  return -1;
 }
 
 /** built-in function selector method
@@ -342,5 +581,11 @@ get_builtin(struct command *cmd)
   else if (strcmp(cmd->words[0], "jobs") == 0) return builtin_jobs;
   else if (strcmp(cmd->words[0], "unset") == 0) return builtin_unset;
   else if (strcmp(cmd->words[0], "export") == 0) return builtin_export;
+  else if (strcmp(cmd->words[0], "set") == 0) return builtin_set;
+  else if (strcmp(cmd->words[0], "trace") == 0) return builtin_trace;
+  else if (strcmp(cmd->words[0], "shellstats") == 0) return builtin_shellstats;
+  else if (strcmp(cmd->words[0], "allocstats") == 0) return builtin_allocstats;
+  else if (strcmp(cmd->words[0], "sampler") == 0) return builtin_sampler;
+  else if (strcmp(cmd->words[0], "segment") == 0) return builtin_segment;
   else return 0;
 }
@@ -0,0 +1,399 @@
+#define _GNU_SOURCE /* syscall(), getline() */
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <linux/sched.h> /* struct clone_args */
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "cgroup.h"
+#include "util/trace.h"
+#include "vars.h"
+
+/* A job's cgroup */
+struct group {
+  pid_t pgid; /* 0 until the job has one; -1 once released, if not empty */
+  int fd;     /* the cgroup's directory */
+  unsigned id;
+};
+
+static char const *const stat_names[CGROUP_STAT_COUNT] = {
+    [CGROUP_CPU_USEC] = "cpu(us)",
+    [CGROUP_MEMORY] = "memory(bytes)",
+    [CGROUP_MEMORY_PEAK] = "memory-peak(bytes)",
+    [CGROUP_IO_READ] = "io-read(bytes)",
+    [CGROUP_IO_WRITTEN] = "io-written(bytes)",
+    [CGROUP_PROCESSES] = "processes",
+};
+
+/* Controllers to enable for the jobs, where the shell's cgroup has them */
+static char const *const controllers[] = {"cpu", "memory", "io", "pids"};
+
+int cgroup_enabled = 0;
+
+static int base_fd = -1; /* the shell's own cgroup */
+static int root_fd = -1; /* bigshell.<pid>, in base_fd */
+static char root_name[32];
+static struct group *groups;
+static size_t group_count = 0;
+static unsigned next_id = 0;
+
+/* Reads the file name in directory dir into buf as a string
+ *
+ * @returns the length read, or -1 on failure
+ */
+static ssize_t
+read_file(int dir, char const *name, char *buf, size_t size)
+{
+  int const fd = openat(dir, name, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return -1;
+  ssize_t n;
+  while ((n = read(fd, buf, size - 1)) < 0 && errno == EINTR);
+  close(fd);
+  if (n < 0) return -1;
+  buf[n] = '\0';
+  return n;
+}
+
+/* Writes s to the file name in directory dir
+ *
+ * @returns 0 on success, -1 on failure
+ */
+static int
+write_file(int dir, char const *name, char const *s)
+{
+  int const fd = openat(dir, name, O_WRONLY | O_CLOEXEC);
+  if (fd < 0) return -1;
+  ssize_t const n = write(fd, s, strlen(s));
+  int const saved_errno = errno;
+  close(fd);
+  errno = saved_errno;
+  return n < 0 ? -1 : 0;
+}
+
+/* Finds where the cgroup v2 hierarchy is mounted */
+static int
+find_mount(char *mount, size_t size)
+{
+  FILE *f = fopen("/proc/self/mountinfo", "re");
+  if (!f) return -1;
+  char *line = 0;
+  size_t cap = 0;
+  int found = -1;
+  while (found < 0 && getline(&line, &cap, f) > 0) {
+    /* id parent major:minor root mountpoint options... - fstype source */
+    char const *sep = strstr(line, " - ");
+    if (!sep || strncmp(sep + 3, "cgroup2 ", 8) != 0) continue;
+    char point[PATH_MAX];
+    if (sscanf(line, "%*s %*s %*s %*s %4095s", point) != 1) continue;
+    if (strlen(point) < size) {
+      strcpy(mount, point);
+      found = 0;
+    }
+  }
+  free(line);
+  fclose(f);
+  return found;
+}
+
+/* Finds the shell's own cgroup, relative to the mount */
+static int
+find_own(char *path, size_t size)
+{
+  FILE *f = fopen("/proc/self/cgroup", "re");
+  if (!f) return -1;
+  char *line = 0;
+  size_t cap = 0;
+  int found = -1;
+  ssize_t len;
+  while (found < 0 && (len = getline(&line, &cap, f)) > 0) {
+    if (strncmp(line, "0::", 3) != 0) continue;
+    if (line[len - 1] == '\n') line[--len] = '\0';
+    if ((size_t)len - 3 < size) {
+      strcpy(path, line + 3);
+      found = 0;
+    }
+  }
+  free(line);
+  fclose(f);
+  return found;
+}
+
+void
+cgroup_init(void)
+{
+  char const *s = getenv("BIGSHELL_CGROUP");
+  if (!s || !*s) return;
+  char mount[PATH_MAX], own[PATH_MAX], base[2 * PATH_MAX + 1];
+  if (find_mount(mount, sizeof mount) < 0 || find_own(own, sizeof own) < 0) {
+    return;
+  }
+  snprintf(base, sizeof base, "%s%s", mount, own);
+  base_fd = open(base, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (base_fd < 0) goto err;
+  snprintf(root_name, sizeof root_name, "bigshell.%jd", (intmax_t)getpid());
+  if (mkdirat(base_fd, root_name, 0755) < 0 && errno != EEXIST) goto err;
+  root_fd = openat(base_fd, root_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (root_fd < 0) goto err;
+
+  char available[256];
+  if (read_file(root_fd, "cgroup.controllers", available, sizeof available) >
+      0) {
+    for (size_t i = 0; i < sizeof controllers / sizeof *controllers; ++i) {
+      char const *c = controllers[i];
+      size_t const len = strlen(c);
+      for (char *p = available; (p = strstr(p, c)); p += len) {
+        if ((p == available || p[-1] == ' ') &&
+            (p[len] == ' ' || p[len] == '\n' || !p[len])) {
+          char enable[16];
+          snprintf(enable, sizeof enable, "+%s", c);
+          if (write_file(root_fd, "cgroup.subtree_control", enable) < 0) {
+            trace(TRACE_SPAWN, "cgroup: %s: %s", enable, strerror(errno));
+          }
+          break;
+        }
+      }
+    }
+  }
+  cgroup_enabled = 1;
+  return;
+err:
+  trace(TRACE_SPAWN, "cgroup: %s: %s", base, strerror(errno));
+  if (root_fd >= 0) close(root_fd);
+  if (base_fd >= 0) close(base_fd);
+  root_fd = base_fd = -1;
+}
+
+static struct group *
+find(pid_t pgid)
+{
+  for (size_t i = 0; i < group_count; ++i) {
+    if (groups[i].pgid == pgid) return &groups[i];
+  }
+  return 0;
+}
+
+/* The value of setting name for the job started by cmd */
+static char const *
+setting(struct command const *cmd, char const *name)
+{
+  for (size_t i = 0; i < cmd->assignment_count; ++i) {
+    if (strcmp(cmd->assignments[i]->name, name) == 0) {
+      return cmd->assignments[i]->value;
+    }
+  }
+  return vars_get(name);
+}
+
+/* Creates the cgroup for a new job, started by cmd */
+static struct group *
+create(struct command const *cmd)
+{
+  void *tmp = realloc(groups, sizeof *groups * (group_count + 1));
+  if (!tmp) return 0;
+  groups = tmp;
+  unsigned const id = next_id++;
+  char name[32];
+  snprintf(name, sizeof name, "job.%u", id);
+  if (mkdirat(root_fd, name, 0755) < 0) goto err;
+  int const fd = openat(root_fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) {
+    unlinkat(root_fd, name, AT_REMOVEDIR);
+    goto err;
+  }
+
+  static struct {
+    char const *var, *file;
+  } const limits[] = {
+      {"CGROUP_CPU_WEIGHT", "cpu.weight"},
+      {"CGROUP_MEMORY_MAX", "memory.max"},
+  };
+  for (size_t i = 0; i < sizeof limits / sizeof *limits; ++i) {
+    char const *value = setting(cmd, limits[i].var);
+    if (value && *value && write_file(fd, limits[i].file, value) < 0) {
+      trace(TRACE_SPAWN,
+            "cgroup: %s=%s: %s",
+            limits[i].file,
+            value,
+            strerror(errno));
+    }
+  }
+  groups[group_count] = (struct group){.pgid = 0, .fd = fd, .id = id};
+  return &groups[group_count++];
+err:
+  trace(TRACE_SPAWN, "cgroup: %s: %s", name, strerror(errno));
+  return 0;
+}
+
+/* Whether the shell has no threads besides this one */
+static int
+single_threaded(void)
+{
+  struct stat st;
+  return stat("/proc/self/task", &st) == 0 && st.st_nlink == 3;
+}
+
+pid_t
+cgroup_fork(pid_t pgid, struct command const *cmd)
+{
+  if (!cgroup_enabled) return fork();
+  /* A job that failed to start leaves its cgroup for the next one */
+  struct group *g = find(pgid);
+  if (!g && pgid == 0) g = create(cmd);
+  if (!g) return fork();
+
+  /* A raw clone3() skips glibc's fork handling, which only matters to
+   * other threads' locks */
+  if (single_threaded()) {
+    struct clone_args args = {
+        .flags = CLONE_INTO_CGROUP,
+        .exit_signal = SIGCHLD,
+        .cgroup = g->fd,
+    };
+    long const pid = syscall(SYS_clone3, &args, sizeof args);
+    if (pid >= 0) return pid;
+    trace(TRACE_SPAWN, "clone3: %s", strerror(errno));
+  }
+  pid_t const pid = fork();
+  if (pid == 0) write_file(g->fd, "cgroup.procs", "0");
+  return pid;
+}
+
+void
+cgroup_attach(pid_t pgid)
+{
+  struct group *g = cgroup_enabled ? find(0) : 0;
+  if (g) g->pgid = pgid;
+}
+
+static uint64_t
+field(char const *text, char const *key)
+{
+  char const *p = strstr(text, key);
+  return p ? strtoull(p + strlen(key), 0, 10) : 0;
+}
+
+int
+cgroup_read(pid_t pgid, struct cgroup_usage *usage)
+{
+  struct group const *g = pgid > 0 ? find(pgid) : 0;
+  if (!g) return -1;
+  *usage = (struct cgroup_usage){0};
+  char buf[4096];
+  if (read_file(g->fd, "cpu.stat", buf, sizeof buf) > 0) {
+    usage->value[CGROUP_CPU_USEC] = field(buf, "usage_usec ");
+    usage->valid |= 1u << CGROUP_CPU_USEC;
+  }
+  if (read_file(g->fd, "memory.current", buf, sizeof buf) > 0) {
+    usage->value[CGROUP_MEMORY] = strtoull(buf, 0, 10);
+    usage->valid |= 1u << CGROUP_MEMORY;
+  }
+  if (read_file(g->fd, "memory.peak", buf, sizeof buf) > 0) {
+    usage->value[CGROUP_MEMORY_PEAK] = strtoull(buf, 0, 10);
+    usage->valid |= 1u << CGROUP_MEMORY_PEAK;
+  }
+  if (read_file(g->fd, "io.stat", buf, sizeof buf) >= 0) {
+    /* One line per device */
+    for (char *line = buf; *line;) {
+      usage->value[CGROUP_IO_READ] += field(line, "rbytes=");
+      usage->value[CGROUP_IO_WRITTEN] += field(line, "wbytes=");
+      char *nl = strchr(line, '\n');
+      if (!nl) break;
+      *nl = '\0';
+      line = nl + 1;
+    }
+    usage->valid |= 1u << CGROUP_IO_READ | 1u << CGROUP_IO_WRITTEN;
+  }
+  if (read_file(g->fd, "cgroup.procs", buf, sizeof buf) >= 0) {
+    for (char const *p = buf; (p = strchr(p, '\n')); ++p) {
+      ++usage->value[CGROUP_PROCESSES];
+    }
+    usage->valid |= 1u << CGROUP_PROCESSES;
+  }
+  return 0;
+}
+
+int
+cgroup_set_weight(pid_t pgid, unsigned weight, unsigned *old)
+{
+  struct group const *g = pgid > 0 ? find(pgid) : 0;
+  if (!g) return -1;
+  char buf[32];
+  if (read_file(g->fd, "cpu.weight", buf, sizeof buf) <= 0) return -1;
+  *old = strtoul(buf, 0, 10);
+  snprintf(buf, sizeof buf, "%u", weight);
+  return write_file(g->fd, "cpu.weight", buf);
+}
+
+/* Removes g's cgroup if it is empty
+ *
+ * @returns 0 on success, -1 if it is not
+ */
+static int
+remove_group(struct group *g)
+{
+  char name[32];
+  snprintf(name, sizeof name, "job.%u", g->id);
+  if (unlinkat(root_fd, name, AT_REMOVEDIR) < 0) return -1;
+  close(g->fd);
+  *g = groups[--group_count];
+  return 0;
+}
+
+void
+cgroup_release(pid_t pgid)
+{
+  struct group *g = pgid > 0 ? find(pgid) : 0;
+  if (!g) return;
+  g->pgid = -1;
+  /* Along with those released before that still had processes */
+  for (size_t i = 0; i < group_count;) {
+    if (groups[i].pgid != -1 || remove_group(&groups[i]) < 0) ++i;
+  }
+}
+
+void
+cgroup_print(int fd, struct cgroup_usage const *usage, char const *indent)
+{
+  for (int s = 0; s < CGROUP_STAT_COUNT; ++s) {
+    if (!(usage->valid & (1u << s))) continue;
+    dprintf(fd, "%s%16" PRIu64 "  %s\n", indent, usage->value[s], stat_names[s]);
+  }
+}
+
+/* Moves the processes left in g to the shell's own cgroup, so that they
+ * keep running and g can be removed */
+static void
+evict(struct group const *g)
+{
+  char buf[4096];
+  /* A process may fork while its siblings are moved */
+  for (int round = 0; round < 8; ++round) {
+    if (read_file(g->fd, "cgroup.procs", buf, sizeof buf) <= 0) return;
+    /* Only whole lines: a read that filled buf may end in part of a pid */
+    for (char *p = buf, *nl; (nl = strchr(p, '\n')); p = nl + 1) {
+      *nl = '\0';
+      if (write_file(base_fd, "cgroup.procs", p) < 0) {
+        trace(TRACE_SPAWN, "cgroup: moving %s: %s", p, strerror(errno));
+      }
+    }
+  }
+}
+
+void
+cgroup_cleanup(void)
+{
+  if (!cgroup_enabled) return;
+  for (size_t i = 0; i < group_count;) {
+    if (remove_group(&groups[i]) == 0) continue;
+    evict(&groups[i]);
+    if (remove_group(&groups[i]) < 0) ++i;
+  }
+  unlinkat(base_fd, root_name, AT_REMOVEDIR);
+}
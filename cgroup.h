@@ -0,0 +1,83 @@
+#pragma once
+/** @file Control groups per job
+ *
+ * When BIGSHELL_CGROUP is set and the shell may create cgroups below its
+ * own in the cgroup v2 hierarchy (it has been delegated them), every job
+ * runs in a cgroup of its own, job.<n> in bigshell.<pid> next to the
+ * shell. The kernel then accounts for the CPU time, memory and I/O of all
+ * of the job's processes, including daemons that have left the process
+ * group and that wait4() never reports; `jobs -l` shows the totals.
+ *
+ * The first process of a job is started straight in the job's cgroup with
+ * clone3(CLONE_INTO_CGROUP) when the shell has no other threads, which
+ * glibc's fork() would otherwise have to account for; otherwise the child
+ * of fork() writes itself to cgroup.procs before it does anything else.
+ *
+ * CGROUP_CPU_WEIGHT and CGROUP_MEMORY_MAX, set in the shell or on the first
+ * command of a pipeline, are written to a new job's cpu.weight and
+ * memory.max, where those controllers are available. Anything that cannot be
+ * done is skipped silently: the job then runs where the shell does, and
+ * only its rusage is known.
+ */
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "parser.h"
+
+enum cgroup_stat {
+  CGROUP_CPU_USEC,
+  CGROUP_MEMORY,
+  CGROUP_MEMORY_PEAK,
+  CGROUP_IO_READ,
+  CGROUP_IO_WRITTEN,
+  CGROUP_PROCESSES,
+  CGROUP_STAT_COUNT
+};
+
+struct cgroup_usage {
+  unsigned valid; /* bit i is set if value[i] was read */
+  uint64_t value[CGROUP_STAT_COUNT];
+};
+
+/** nonzero if new jobs get cgroups */
+extern int cgroup_enabled;
+
+/** Creates the shell's cgroup for jobs if BIGSHELL_CGROUP is set and
+ * cgroups can be created; leaves cgroups disabled otherwise */
+extern void cgroup_init(void);
+
+/** Forks a process of job pgid, or the first process of a new job (started
+ * by cmd) if pgid is 0, into the job's cgroup
+ *
+ * @returns as fork(2)
+ */
+extern pid_t cgroup_fork(pid_t pgid, struct command const *cmd);
+
+/** Gives the cgroup of the new job forked last to job pgid */
+extern void cgroup_attach(pid_t pgid);
+
+/** Reads the usage of job pgid
+ *
+ * @returns 0 on success, -1 if job pgid has no cgroup
+ */
+extern int cgroup_read(pid_t pgid, struct cgroup_usage *usage);
+
+/** Sets the cpu.weight of job pgid's cgroup to weight
+ *
+ * @param [out]old the weight it had
+ * @returns 0 on success, -1 if job pgid has no cgroup with a cpu.weight
+ */
+extern int cgroup_set_weight(pid_t pgid, unsigned weight, unsigned *old);
+
+/** Removes the cgroup of job pgid, which has finished, once the processes
+ * that outlived it have also gone */
+extern void cgroup_release(pid_t pgid);
+
+/** Prints usage, one figure per line, each line starting with indent */
+extern void cgroup_print(int fd,
+                         struct cgroup_usage const *usage,
+                         char const *indent);
+
+/** Removes the cgroups at exit, after moving the processes that outlived
+ * their jobs to the shell's own cgroup */
+extern void cgroup_cleanup(void);
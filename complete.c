@@ -0,0 +1,490 @@
+#define _GNU_SOURCE /* syscall(), memrchr() */
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "complete.h"
+#include "region.h"
+#include "vars.h"
+
+#define DEFAULT_PATH "/bin:/usr/bin" /* what execvp() uses */
+#define DIRCACHE_SIZE 8
+
+/* The kernel's directory record */
+struct linux_dirent64 {
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+/* A directory's entries: a type byte, the name and a NUL for each */
+struct listing {
+  char *path;
+  dev_t dev;
+  ino_t ino;
+  struct timespec mtime;
+  char *entries; /* a region (see region.h) */
+  size_t len;
+  size_t cap;
+};
+
+/* A trie node; node 0 is the root, so 0 also means "none" */
+struct node {
+  uint32_t child;   /* the first, in byte order */
+  uint32_t sibling; /* the next, in byte order */
+  unsigned char c;
+  unsigned char terminal;
+};
+
+struct trie {
+  struct node *nodes; /* a region */
+  size_t count;
+  size_t cap;
+};
+
+/* Requests from the shell to the builder thread */
+static struct {
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  int pending;
+  char *path; /* a new value of PATH, if it changed */
+} req = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0};
+static int started = 0;
+static char *last_path; /* the PATH last sent to the builder */
+
+/* The newest trie, handed over from the builder; the shell takes it */
+static struct trie *_Atomic fresh = 0;
+static struct trie *commands;
+
+/* The builder's listings of the PATH directories, in PATH order */
+static struct listing *path_dirs;
+static size_t path_dir_count = 0;
+
+/* The shell's listings of directories it has completed file names in */
+static struct listing dircache[DIRCACHE_SIZE];
+static size_t dircache_next = 0;
+
+static int
+reserve(char **buf, size_t *cap, size_t len)
+{
+  if (len <= *cap) return 0;
+  size_t n = *cap ? *cap : 1024;
+  while (n < len) n *= 2;
+  void *tmp = realloc(*buf, n);
+  if (!tmp) return -1;
+  *buf = tmp;
+  *cap = n;
+  return 0;
+}
+
+/* Reads the entries of the directory open on fd, except . and .., into a
+ * region */
+static int
+read_entries(int fd, char **out, size_t *out_len, size_t *out_cap)
+{
+  char buf[16 * 1024];
+  char *entries = 0;
+  size_t len = 0, cap = 0;
+  for (;;) {
+    long const n = syscall(SYS_getdents64, fd, buf, sizeof buf);
+    if (n < 0) goto err;
+    if (n == 0) break;
+    for (long off = 0; off < n;) {
+      struct linux_dirent64 const *d = (void const *)(buf + off);
+      off += d->d_reclen;
+      char const *name = d->d_name;
+      if (name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2]))) {
+        continue;
+      }
+      size_t const name_len = strlen(name);
+      if (len + name_len + 2 > cap) {
+        size_t const new_cap = cap ? cap * 2 : 16 * 1024;
+        void *tmp = region_resize(entries, cap, new_cap);
+        if (!tmp) goto err;
+        entries = tmp;
+        cap = new_cap;
+      }
+      entries[len++] = d->d_type;
+      memcpy(entries + len, name, name_len + 1);
+      len += name_len + 1;
+    }
+  }
+  *out = entries;
+  *out_len = len;
+  *out_cap = cap;
+  return 0;
+err:
+  region_free(entries, cap);
+  return -1;
+}
+
+/* Brings l up to date with its directory, rereading it only if its mtime
+ * changed; returns 1 if it was reread, 0 if not, -1 on failure */
+static int
+listing_refresh(struct listing *l)
+{
+  struct stat st;
+  if (stat(l->path, &st) < 0) goto gone;
+  if (l->entries && st.st_dev == l->dev && st.st_ino == l->ino &&
+      st.st_mtim.tv_sec == l->mtime.tv_sec &&
+      st.st_mtim.tv_nsec == l->mtime.tv_nsec) {
+    return 0;
+  }
+  int const fd = open(l->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) goto gone;
+  char *entries;
+  size_t len, cap;
+  int const res = read_entries(fd, &entries, &len, &cap);
+  close(fd);
+  if (res < 0) goto gone;
+  region_free(l->entries, l->cap);
+  l->entries = entries;
+  l->len = len;
+  l->cap = cap;
+  l->dev = st.st_dev;
+  l->ino = st.st_ino;
+  l->mtime = st.st_mtim;
+  return 1;
+gone:
+  if (!l->entries) return -1;
+  region_free(l->entries, l->cap);
+  l->entries = 0;
+  l->len = l->cap = 0;
+  return 1;
+}
+
+static void
+trie_free(struct trie *t)
+{
+  if (!t) return;
+  region_free(t->nodes, sizeof *t->nodes * t->cap);
+  free(t);
+}
+
+static int
+trie_insert(struct trie *t, char const *name)
+{
+  uint32_t n = 0;
+  for (; *name; ++name) {
+    unsigned char const c = *name;
+    uint32_t prev = 0, cur = t->nodes[n].child;
+    while (cur && t->nodes[cur].c < c) {
+      prev = cur;
+      cur = t->nodes[cur].sibling;
+    }
+    if (!cur || t->nodes[cur].c != c) {
+      if (t->count == t->cap) {
+        size_t const cap = t->cap * 2;
+        void *tmp = region_resize(
+            t->nodes, sizeof *t->nodes * t->cap, sizeof *t->nodes * cap);
+        if (!tmp) return -1;
+        t->nodes = tmp;
+        t->cap = cap;
+      }
+      uint32_t const m = t->count++;
+      t->nodes[m] = (struct node){.c = c, .sibling = cur};
+      if (prev) t->nodes[prev].sibling = m;
+      else t->nodes[n].child = m;
+      cur = m;
+    }
+    n = cur;
+  }
+  t->nodes[n].terminal = 1;
+  return 0;
+}
+
+/* Builds a trie of the non-directories in path_dirs */
+static struct trie *
+trie_build(void)
+{
+  struct trie *t = malloc(sizeof *t);
+  if (!t) return 0;
+  t->cap = 4096;
+  t->count = 1;
+  t->nodes = region_alloc(sizeof *t->nodes * t->cap);
+  if (!t->nodes) goto err;
+  for (size_t i = 0; i < path_dir_count; ++i) {
+    struct listing const *l = &path_dirs[i];
+    for (size_t off = 0; off < l->len;) {
+      unsigned char const type = l->entries[off];
+      char const *name = l->entries + off + 1;
+      off += strlen(name) + 2;
+      if (type == DT_DIR) continue;
+      if (trie_insert(t, name) < 0) goto err;
+    }
+  }
+  return t;
+err:
+  trie_free(t);
+  return 0;
+}
+
+/* Brings path_dirs up to date with path; returns nonzero if anything
+ * changed */
+static int
+rescan(char const *path)
+{
+  struct listing *dirs = 0;
+  size_t count = 0;
+  int changed = 0;
+  for (char const *p = path;; ++p) {
+    char const *end = strchrnul(p, ':');
+    char *dir = end == p ? strdup(".") : strndup(p, end - p);
+    if (!dir) break;
+    void *tmp = realloc(dirs, sizeof *dirs * (count + 1));
+    if (!tmp) {
+      free(dir);
+      break;
+    }
+    dirs = tmp;
+    /* Keep the listing we had, if any */
+    struct listing *l = &dirs[count++];
+    *l = (struct listing){.path = dir};
+    for (size_t i = 0; i < path_dir_count; ++i) {
+      if (path_dirs[i].path && strcmp(path_dirs[i].path, dir) == 0) {
+        free(dir);
+        *l = path_dirs[i];
+        path_dirs[i].path = 0;
+        break;
+      }
+    }
+    if (listing_refresh(l) > 0) changed = 1;
+    if (!*end) break;
+    p = end;
+  }
+  for (size_t i = 0; i < path_dir_count; ++i) {
+    if (!path_dirs[i].path) continue;
+    changed = 1; /* left PATH */
+    free(path_dirs[i].path);
+    region_free(path_dirs[i].entries, path_dirs[i].cap);
+  }
+  free(path_dirs);
+  path_dirs = dirs;
+  path_dir_count = count;
+  return changed;
+}
+
+static void *
+builder(void *arg)
+{
+  char *path = 0;
+  for (;;) {
+    pthread_mutex_lock(&req.lock);
+    while (!req.pending) pthread_cond_wait(&req.wake, &req.lock);
+    req.pending = 0;
+    char *new_path = req.path;
+    req.path = 0;
+    pthread_mutex_unlock(&req.lock);
+
+    if (new_path) {
+      free(path);
+      path = new_path;
+    }
+    if (!path) continue;
+    if (!rescan(path) && !new_path) continue;
+    struct trie *t = trie_build();
+    if (t) trie_free(atomic_exchange(&fresh, t));
+  }
+  return 0;
+}
+
+/* Asks the builder to check the PATH directories again */
+static void
+request_rescan(void)
+{
+  char const *path = vars_get("PATH");
+  if (!path) path = DEFAULT_PATH;
+  char *copy = 0;
+  if (!last_path || strcmp(last_path, path) != 0) {
+    copy = strdup(path);
+    char *mine = strdup(path);
+    if (!copy || !mine) {
+      free(copy);
+      free(mine);
+      return;
+    }
+    free(last_path);
+    last_path = mine;
+  }
+  pthread_mutex_lock(&req.lock);
+  if (copy) {
+    free(req.path);
+    req.path = copy;
+  }
+  req.pending = 1;
+  pthread_cond_signal(&req.wake);
+  pthread_mutex_unlock(&req.lock);
+}
+
+int
+complete_init(void)
+{
+  pthread_t thread;
+  /* The thread must not take the shell's signals */
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  int const err = pthread_create(&thread, 0, builder, 0);
+  pthread_sigmask(SIG_SETMASK, &old, 0);
+  if (err) return -1;
+  pthread_detach(thread);
+  started = 1;
+  request_rescan();
+  return 0;
+}
+
+/* Appends a + b as a candidate */
+static int
+add(struct completion *c, char const *a, size_t a_len, char const *b)
+{
+  size_t const b_len = strlen(b);
+  if (reserve(&c->buf, &c->cap, c->len + a_len + b_len + 1) < 0) return -1;
+  memcpy(c->buf + c->len, a, a_len);
+  memcpy(c->buf + c->len + a_len, b, b_len + 1);
+  c->len += a_len + b_len + 1;
+  ++c->count;
+  return 0;
+}
+
+/* Adds every name in the subtrie at node n, which spells name[0..depth) */
+static void
+add_subtrie(struct completion *c, uint32_t n, char *name, size_t depth)
+{
+  if (commands->nodes[n].terminal) {
+    name[depth] = '\0';
+    add(c, name, depth, "");
+  }
+  if (depth == NAME_MAX) return;
+  for (uint32_t m = commands->nodes[n].child; m; m = commands->nodes[m].sibling) {
+    name[depth] = commands->nodes[m].c;
+    add_subtrie(c, m, name, depth + 1);
+  }
+}
+
+static void
+complete_command(char const *word, size_t len, struct completion *c)
+{
+  if (started) {
+    struct trie *t = atomic_exchange(&fresh, 0);
+    if (t) {
+      trie_free(commands);
+      commands = t;
+    }
+    request_rescan(); /* for the next time */
+  }
+  if (!commands || len > NAME_MAX) return;
+  uint32_t n = 0;
+  for (size_t i = 0; i < len; ++i) {
+    uint32_t m = commands->nodes[n].child;
+    while (m && commands->nodes[m].c != (unsigned char)word[i]) {
+      m = commands->nodes[m].sibling;
+    }
+    if (!m) return;
+    n = m;
+  }
+  char name[NAME_MAX + 1];
+  memcpy(name, word, len);
+  add_subtrie(c, n, name, len);
+}
+
+/* The cached listing of dir, brought up to date */
+static struct listing *
+dircache_get(char const *dir)
+{
+  struct listing *l = 0;
+  for (size_t i = 0; i < DIRCACHE_SIZE; ++i) {
+    if (dircache[i].path && strcmp(dircache[i].path, dir) == 0) {
+      l = &dircache[i];
+      break;
+    }
+  }
+  if (!l) {
+    char *path = strdup(dir);
+    if (!path) return 0;
+    l = &dircache[dircache_next];
+    dircache_next = (dircache_next + 1) % DIRCACHE_SIZE;
+    free(l->path);
+    region_free(l->entries, l->cap);
+    *l = (struct listing){.path = path};
+  }
+  if (listing_refresh(l) < 0 || !l->entries) return 0;
+  return l;
+}
+
+static void
+complete_file(char const *word, size_t len, struct completion *c)
+{
+  char dir[PATH_MAX];
+  char const *slash = memrchr(word, '/', len);
+  size_t const dir_len = slash ? (size_t)(slash - word) + 1 : 0;
+  if (dir_len >= sizeof dir) return;
+  if (dir_len) memcpy(dir, word, dir_len);
+  else dir[0] = '.';
+  dir[dir_len ? dir_len : 1] = '\0';
+  char const *prefix = word + dir_len;
+  size_t const prefix_len = len - dir_len;
+
+  struct listing const *l = dircache_get(dir);
+  if (!l) return;
+  for (size_t off = 0; off < l->len;) {
+    unsigned char type = l->entries[off];
+    char const *name = l->entries + off + 1;
+    off += strlen(name) + 2;
+    if (strncmp(name, prefix, prefix_len) != 0) continue;
+    if (name[0] == '.' && prefix[0] != '.') continue;
+    if (type == DT_LNK || type == DT_UNKNOWN) {
+      char path[PATH_MAX + NAME_MAX + 2];
+      struct stat st;
+      snprintf(path, sizeof path, "%s/%s", dir, name);
+      if (stat(path, &st) == 0 && S_ISDIR(st.st_mode)) type = DT_DIR;
+    }
+    char const *suffix = type == DT_DIR ? "/" : "";
+    char entry[NAME_MAX + 2];
+    snprintf(entry, sizeof entry, "%s%s", name, suffix);
+    add(c, word, dir_len, entry);
+  }
+}
+
+static int
+by_name(void const *a, void const *b)
+{
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+int
+complete(char const *word, size_t len, int command, struct completion *c)
+{
+  *c = (struct completion){0};
+  if (command && !memchr(word, '/', len)) complete_command(word, len, c);
+  else complete_file(word, len, c);
+  if (!c->count) return 0;
+
+  c->names = malloc(sizeof *c->names * c->count);
+  if (!c->names) {
+    completion_free(c);
+    return -1;
+  }
+  char *p = c->buf;
+  for (size_t i = 0; i < c->count; ++i, p += strlen(p) + 1) c->names[i] = p;
+  if (!command) qsort(c->names, c->count, sizeof *c->names, by_name);
+  return 0;
+}
+
+void
+completion_free(struct completion *c)
+{
+  free(c->names);
+  free(c->buf);
+  *c = (struct completion){0};
+}
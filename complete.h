@@ -0,0 +1,45 @@
+#pragma once
+/** @file Tab completion
+ *
+ * Command names are completed from a prefix trie of the files in the PATH
+ * directories. The trie is built by a background thread, which reads each
+ * directory with getdents64(2) and keeps its listing until the directory's
+ * mtime changes, so a slow (NFS) directory stalls only the thread, and only
+ * when it has changed. Each completion asks the thread to check the
+ * directories again; the shell itself never waits for it, and completes
+ * from the newest trie the thread has finished.
+ *
+ * File names are completed from directory listings that are cached, one per
+ * directory, until the directory's mtime changes.
+ */
+#include <stddef.h>
+
+/** Candidates for a word, sorted */
+struct completion {
+  char **names; /* each a full replacement for the word */
+  size_t count;
+  char *buf; /* storage for names */
+  size_t len;
+  size_t cap;
+};
+
+/** Starts the thread that builds the command trie
+ *
+ * @returns 0 on success, -1 on failure
+ */
+extern int complete_init(void);
+
+/** Finds the completions of word[0..len)
+ *
+ * @param [in]command nonzero if the word is in command position
+ * @param [out]c the candidates; directories end with '/'. Release with
+ *              completion_free().
+ * @returns 0 on success, -1 on failure
+ */
+extern int complete(char const *word,
+                    size_t len,
+                    int command,
+                    struct completion *c);
+
+/** Releases the candidates in c */
+extern void completion_free(struct completion *c);
@@ -0,0 +1,230 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "execlog.h"
+#include "stats.h"
+
+#define BUF_SIZE (64 * 1024)
+
+/* A started process whose record is completed when it is reaped */
+struct pending {
+  pid_t pid;
+  uint64_t start_ns;
+  char *head; /* JSON members known at spawn time */
+};
+
+int execlog_enabled = 0;
+
+static int log_fd = -1;
+static pid_t owner; /* forked children must not write the shell's buffer */
+static char buf[BUF_SIZE];
+static size_t buf_len = 0;
+static struct pending *pending;
+static size_t pending_count = 0;
+
+/* Offset between CLOCK_MONOTONIC and wall-clock microseconds */
+static int64_t realtime_offset_us;
+
+int
+execlog_init(void)
+{
+  char const *path = getenv("BIGSHELL_EXECLOG");
+  if (!path || !*path) return 0;
+  log_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+  if (log_fd < 0) return -1;
+  owner = getpid();
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  realtime_offset_us = (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000 -
+                       (int64_t)(stats_now() / 1000);
+  execlog_enabled = 1;
+  return 0;
+}
+
+void
+execlog_flush(void)
+{
+  if (!buf_len || getpid() != owner) return;
+  for (size_t off = 0; off < buf_len;) {
+    ssize_t n = write(log_fd, buf + off, buf_len - off);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      break; /* drop the records rather than stall the shell */
+    }
+    off += n;
+  }
+  buf_len = 0;
+}
+
+/* Appends one complete line to the buffer */
+static void
+put_line(char const *line, size_t len)
+{
+  if (buf_len + len > BUF_SIZE) execlog_flush();
+  if (len > BUF_SIZE) {
+    write(log_fd, line, len);
+    return;
+  }
+  memcpy(buf + buf_len, line, len);
+  buf_len += len;
+}
+
+/* Appends a JSON string literal to a memstream */
+static void
+put_json_string(FILE *f, char const *s)
+{
+  putc('"', f);
+  for (unsigned char const *c = (unsigned char const *)s; *c; ++c) {
+    switch (*c) {
+      case '"':
+        fputs("\\\"", f);
+        break;
+      case '\\':
+        fputs("\\\\", f);
+        break;
+      case '\n':
+        fputs("\\n", f);
+        break;
+      case '\t':
+        fputs("\\t", f);
+        break;
+      default:
+        if (*c < 0x20) fprintf(f, "\\u%04x", *c);
+        else putc(*c, f);
+    }
+  }
+  putc('"', f);
+}
+
+/* Renders the members of a record that are known before the command runs */
+static char *
+render_head(struct command const *cmd, pid_t pid, jid_t jid, pid_t pgid)
+{
+  char *text = 0;
+  size_t len = 0;
+  FILE *f = open_memstream(&text, &len);
+  if (!f) return 0;
+  fputs("{\"argv\":[", f);
+  for (size_t i = 0; i < cmd->word_count; ++i) {
+    if (i) putc(',', f);
+    put_json_string(f, cmd->words[i]);
+  }
+  fprintf(f,
+          "],\"jid\":%jd,\"pgid\":%jd,\"pid\":%jd,\"redirs\":[",
+          (intmax_t)jid,
+          (intmax_t)pgid,
+          (intmax_t)pid);
+  for (size_t i = 0; i < cmd->io_redir_count; ++i) {
+    struct io_redir const *r = cmd->io_redirs[i];
+    fprintf(f,
+            "%s{\"fd\":%d,\"op\":\"%s\",\"target\":",
+            i ? "," : "",
+            r->io_number,
+            io_operator_str(r->io_op));
+    put_json_string(f, r->filename);
+    putc('}', f);
+  }
+  putc(']', f);
+  if (fclose(f) != 0) {
+    free(text);
+    return 0;
+  }
+  return text;
+}
+
+static void
+put_record(char const *head,
+           uint64_t start_ns,
+           int status,
+           struct rusage const *ru)
+{
+  char line[512];
+  int code = WIFEXITED(status)     ? WEXITSTATUS(status)
+             : WIFSIGNALED(status) ? 128 + WTERMSIG(status)
+                                   : status;
+  int n = snprintf(line,
+                   sizeof line,
+                   ",\"start_us\":%lld,\"duration_us\":%llu,\"status\":%d",
+                   (long long)(start_ns / 1000 + realtime_offset_us),
+                   (unsigned long long)((stats_now() - start_ns) / 1000),
+                   code);
+  if (ru) {
+    n += snprintf(line + n,
+                  sizeof line - n,
+                  ",\"rusage\":{\"utime_us\":%lld,\"stime_us\":%lld,"
+                  "\"maxrss_kb\":%ld,\"minflt\":%ld,\"majflt\":%ld,"
+                  "\"nvcsw\":%ld,\"nivcsw\":%ld}",
+                  (long long)ru->ru_utime.tv_sec * 1000000 +
+                      ru->ru_utime.tv_usec,
+                  (long long)ru->ru_stime.tv_sec * 1000000 +
+                      ru->ru_stime.tv_usec,
+                  ru->ru_maxrss,
+                  ru->ru_minflt,
+                  ru->ru_majflt,
+                  ru->ru_nvcsw,
+                  ru->ru_nivcsw);
+  }
+  n += snprintf(line + n, sizeof line - n, "}\n");
+
+  size_t hlen = strlen(head);
+  if (buf_len + hlen + n > BUF_SIZE) execlog_flush();
+  if (hlen + n > BUF_SIZE) {
+    write(log_fd, head, hlen);
+    write(log_fd, line, n);
+    return;
+  }
+  put_line(head, hlen);
+  put_line(line, n);
+}
+
+void
+execlog_spawn(struct command const *cmd,
+              pid_t pid,
+              jid_t jid,
+              pid_t pgid,
+              unsigned long long start_ns)
+{
+  if (!execlog_enabled) return;
+  void *tmp = realloc(pending, sizeof *pending * (pending_count + 1));
+  if (!tmp) return;
+  pending = tmp;
+  char *head = render_head(cmd, pid, jid, pgid);
+  if (!head) return;
+  pending[pending_count++] =
+      (struct pending){.pid = pid, .start_ns = start_ns, .head = head};
+}
+
+void
+execlog_reap(pid_t pid, int status, struct rusage const *ru)
+{
+  if (!execlog_enabled) return;
+  if (!WIFEXITED(status) && !WIFSIGNALED(status)) return;
+  for (size_t i = 0; i < pending_count; ++i) {
+    if (pending[i].pid != pid) continue;
+    put_record(pending[i].head, pending[i].start_ns, status, ru);
+    free(pending[i].head);
+    pending[i] = pending[--pending_count];
+    return;
+  }
+}
+
+void
+execlog_builtin(struct command const *cmd,
+                int status,
+                unsigned long long start_ns)
+{
+  if (!execlog_enabled) return;
+  char *head = render_head(cmd, 0, -1, 0);
+  if (!head) return;
+  /* Encoded as a wait status, like the ones reaped processes report */
+  put_record(head, start_ns, (status & 0xff) << 8, 0);
+  free(head);
+}
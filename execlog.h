@@ -0,0 +1,50 @@
+#pragma once
+/** @file Structured execution log
+ *
+ * When BIGSHELL_EXECLOG names a file, one JSON object per executed command
+ * is appended to it:
+ *
+ *   {"argv":["ls","-l"],"jid":0,"pgid":123,"pid":123,"start_us":...,
+ *    "duration_us":...,"status":0,"redirs":[{"fd":1,"op":">","target":"f"}],
+ *    "rusage":{"utime_us":...,"stime_us":...,"maxrss_kb":...,
+ *              "minflt":...,"majflt":...,"nvcsw":...,"nivcsw":...}}
+ *
+ * Records are built in an in-process buffer and written with a single
+ * write(2) when it fills, at every interactive prompt, and at exit. Builtins
+ * run in the shell itself have a pid and pgid of 0 and no rusage. Background
+ * commands are timed until they are reaped, at the next prompt.
+ */
+#include <sys/resource.h>
+#include <sys/types.h>
+
+#include "jobs.h"
+#include "parser.h"
+
+/** Opens the log named by BIGSHELL_EXECLOG, if any
+ *
+ * @returns 0 on success, -1 on failure
+ */
+extern int execlog_init(void);
+
+/** nonzero if logging is enabled */
+extern int execlog_enabled;
+
+/** Records that cmd was started as process pid at start_ns (see
+ * stats_now()) */
+extern void execlog_spawn(struct command const *cmd,
+                          pid_t pid,
+                          jid_t jid,
+                          pid_t pgid,
+                          unsigned long long start_ns);
+
+/** Completes the record of process pid, once it has terminated */
+extern void execlog_reap(pid_t pid, int status, struct rusage const *ru);
+
+/** Records a builtin run in the shell itself, which started at start_ns
+ * (see stats_now()) */
+extern void execlog_builtin(struct command const *cmd,
+                            int status,
+                            unsigned long long start_ns);
+
+/** Writes out buffered records */
+extern void execlog_flush(void);
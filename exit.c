@@ -2,12 +2,28 @@
 #define _POSIX_C_SOURCE 200809L
 #include <signal.h>
 #include <stdlib.h>
+#include <unistd.h>
 
+#include "admit.h"
+#include "alloc.h"
+#include "cgroup.h"
+#include "execlog.h"
 #include "exit.h"
+#include "expand.h"
+#include "history.h"
 #include "jobs.h"
+#include "lineedit.h"
 #include "params.h"
+#include "parser.h"
+#include "profile.h"
+#include "record.h"
+#include "sampler.h"
+#include "segment.h"
+#include "statsock.h"
 #include "vars.h"
 
+struct command_list *bigshell_command_list = 0;
+
 /** cleans up and exits the shell
  */
 void
@@ -22,7 +38,24 @@ bigshell_exit(void)
   }
 
   /* Call associated cleanup routines */
+  lineedit_release();
+  history_close();
+  segment_cleanup();
+  sampler_finish();
+  statsock_cleanup();
+  profile_finish();
+  record_finish();
+  execlog_flush();
+  admit_cleanup();
   jobs_cleanup();
+  cgroup_cleanup();
   vars_cleanup();
+  expand_cleanup();
+  if (bigshell_command_list) {
+    command_list_free(bigshell_command_list);
+    alloc_free(bigshell_command_list);
+    bigshell_command_list = 0;
+  }
+  alloc_report_leaks(STDERR_FILENO);
   exit(params.status);
 }
@@ -1,4 +1,9 @@
 #pragma once
 
+struct command_list;
+
+/** the command list being run, if any; bigshell_exit() frees it */
+extern struct command_list *bigshell_command_list;
+
 /** exits bigshell (cleanly) */
 extern void bigshell_exit(void);
@@ -16,8 +16,12 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "alloc.h"
 #include "params.h"
+#include "segment.h"
+#include "stats.h"
 #include "util/asprintf.h"
+#include "util/trace.h"
 #include "vars.h"
 
 #include "expand.h"
@@ -29,6 +33,64 @@ strchrnul(char const *s, int c)
   return (char *)s;
 }
 
+/* Lookups that cost a system call or an NSS query, done on first use and
+ * cached for the life of the shell. A shell that never expands `~` or
+ * `\u`/`\h` never pays for them. */
+static struct {
+  int have_user, have_host;
+  char *name, *dir;
+  char host[HOST_NAME_MAX + 1];
+} cache;
+
+/** Login name and home directory of the invoking user
+ *
+ * @returns 0 on success, -1 if there is no passwd entry
+ */
+static int
+cached_user(char const **name, char const **dir)
+{
+  stats_cache_access(STATS_CACHE_USER, cache.have_user);
+  if (!cache.have_user) {
+    struct passwd *pw = getpwuid(getuid());
+    if (!pw) return -1;
+    cache.name = alloc_strdup(ALLOC_EXPAND, pw->pw_name);
+    cache.dir = alloc_strdup(ALLOC_EXPAND, pw->pw_dir);
+    if (!cache.name || !cache.dir) {
+      alloc_free(cache.name);
+      alloc_free(cache.dir);
+      return -1;
+    }
+    cache.have_user = 1;
+  }
+  if (name) *name = cache.name;
+  if (dir) *dir = cache.dir;
+  return 0;
+}
+
+void
+expand_cleanup(void)
+{
+  alloc_free(cache.name);
+  alloc_free(cache.dir);
+  cache.name = cache.dir = 0;
+  cache.have_user = 0;
+}
+
+/** Fully qualified host name
+ *
+ * @returns the host name, or a null pointer on failure
+ */
+static char const *
+cached_host(void)
+{
+  stats_cache_access(STATS_CACHE_HOST, cache.have_host);
+  if (!cache.have_host) {
+    if (gethostname(cache.host, sizeof cache.host - 1) < 0) return 0;
+    cache.have_host = 1;
+  }
+  return cache.host;
+}
+
 static char *
 expand_substr(char **word, char **start, char **stop, char const *expansion)
 {
@@ -38,7 +100,7 @@ expand_substr(char **word, char **start, char **stop, char const *expansion)
   size_t wlen = *start - *word + end - *stop;
   size_t elen = strlen(expansion);
 
-  char *w = malloc(wlen + elen + 1);
+  char *w = alloc_malloc(ALLOC_EXPAND, wlen + elen + 1);
   if (!w) goto out;
 
   memcpy(w, *word, *start - *word);
@@ -46,7 +108,7 @@ expand_substr(char **word, char **start, char **stop, char const *expansion)
   memcpy(w + (*start - *word) + elen, *stop, end - *stop + 1);
   *stop = w + (*start - *word) + elen;
   *start = w + (*start - *word);
-  free(*word);
+  alloc_free(*word);
   *word = w;
 out:
   return w;
@@ -72,17 +134,13 @@ expand_tilde(char **word)
   if (end == w + 1) {
     /* Special case use HOME env variable */
     path = vars_get("HOME");
-    if (!path) {
-      struct passwd *pw = getpwuid(getuid());
-      if (!pw) goto out; /* we tried */
-      path = pw->pw_dir;
-    }
+    if (!path && cached_user(0, &path) < 0) goto out; /* we tried */
   } else {
     /* General case, ~<username>/... */
-    char *nam = strndup(w + 1, end - w - 1);
+    char *nam = alloc_strndup(ALLOC_EXPAND, w + 1, end - w - 1);
     if (!nam) err(1, 0);
     struct passwd *pw = getpwnam(nam);
-    free(nam);
+    alloc_free(nam);
     if (!pw) goto out; /* we tried */
     path = pw->pw_dir;
   }
@@ -152,7 +210,6 @@ expand_parameters(char **word)
         w = expand_substr(word, &expand_start, &scan, val);
         free(val);
       }
-      ++scan;
     } else if (*scan == '?') {
       ++scan;
       char *val = 0;
@@ -161,13 +218,12 @@ expand_parameters(char **word)
         w = expand_substr(word, &expand_start, &scan, val);
         free(val);
       }
-      ++scan;
     } else {
       if (*scan == '{') {
         param = scan + 1;
         for (; *scan && *scan != '}'; ++scan);
         if (*scan != '}') return *word;
-        param = strndup(param, scan - param);
+        param = alloc_strndup(ALLOC_EXPAND, param, scan - param);
         ++scan;
         if (!param) err(1, 0);
       } else {
@@ -175,7 +231,7 @@ expand_parameters(char **word)
         for (; *scan && (isalpha(*scan) || isdigit(*scan) || *scan == '_');
              ++scan);
         if (scan == param) continue; 
-        param = strndup(param, scan - param);
+        param = alloc_strndup(ALLOC_EXPAND, param, scan - param);
         if (!param) err(1, 0);
       }
 
@@ -184,7 +240,7 @@ expand_parameters(char **word)
       if (!val) val = "";
       w = expand_substr(word, &expand_start, &expand_end, val);
       scan = expand_end;
-      free(param);
+      alloc_free(param);
     }
     if (!w) break;
   }
@@ -235,6 +291,7 @@ expand(char **word)
 {
   if (!expand_tilde(word) || !expand_parameters(word) || !remove_quotes(word))
     return 0;
+  trace(TRACE_EXPAND, "expanded to %s", *word);
   return *word;
 }
 
@@ -268,17 +325,19 @@ expand_prompt(char **prompt)
         p = expand_substr(prompt, &start, &stop, "\033");
         break;
       case 'h': {
-        char hn[HOST_NAME_MAX + 1] = {0};
-        if (gethostname(hn, HOST_NAME_MAX + 1) == 0) {
+        char const *host = cached_host();
+        if (host) {
+          char hn[HOST_NAME_MAX + 1];
+          strcpy(hn, host);
           *strchrnul(hn, '.') = '\0';
           p = expand_substr(prompt, &start, &stop, hn);
         }
         break;
       }
       case 'H': {
-        char hn[HOST_NAME_MAX + 1] = {0};
-        if (gethostname(hn, HOST_NAME_MAX + 1) == 0) {
-          p = expand_substr(prompt, &start, &stop, hn);
+        char const *host = cached_host();
+        if (host) {
+          p = expand_substr(prompt, &start, &stop, host);
         }
         break;
       }
@@ -286,9 +345,9 @@ expand_prompt(char **prompt)
         p = expand_substr(prompt, &start, &stop, "\n");
         break;
       case 'u': {
-        struct passwd *pw = getpwuid(getuid());
-        if (pw) {
-          p = expand_substr(prompt, &start, &stop, pw->pw_name);
+        char const *name;
+        if (cached_user(&name, 0) == 0) {
+          p = expand_substr(prompt, &start, &stop, name);
         }
         break;
       }
@@ -309,6 +368,17 @@ expand_prompt(char **prompt)
         }
         break;
       }
+      case '{': {
+        /* \{name}: the last output of an asynchronous segment */
+        char *close = strchr(start + 2, '}');
+        char const *value =
+            close ? segment_value(start + 2, close - (start + 2)) : 0;
+        if (value) {
+          stop = close + 1;
+          p = expand_substr(prompt, &start, &stop, value);
+        }
+        break;
+      }
       case '$':
         if (geteuid() == 0) {
           p = expand_substr(prompt, &start, &stop, "#");
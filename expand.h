@@ -21,3 +21,6 @@
 extern char *expand(char **word);
 extern char *expand_prompt(char **word);
 
+/** frees the cached user and host lookups (prior to exiting) */
+extern void expand_cleanup(void);
+
@@ -0,0 +1,153 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "fdcache.h"
+#include "util/trace.h"
+
+#define LOG_FLAGS (O_WRONLY | O_CREAT | O_APPEND)
+
+/* A file that commands append to */
+struct log {
+  char *path; /* as written in the redirection; null if the slot is free */
+  int fd;
+  dev_t dev;
+  ino_t ino;
+  unsigned long used; /* when it was last prepared, for eviction */
+};
+
+static int null_fd = -1;
+static struct log logs[FDCACHE_LOGS_MAX];
+static size_t log_max = 0;
+static unsigned long tick = 0;
+
+/* Moves fd up to FDCACHE_BASE or above, out of the way of redirections */
+static int
+move_up(int fd)
+{
+  int const high = fcntl(fd, F_DUPFD_CLOEXEC, FDCACHE_BASE);
+  int const saved_errno = errno;
+  close(fd);
+  errno = saved_errno;
+  return high;
+}
+
+int
+fdcache_init(void)
+{
+  char const *s = getenv("BIGSHELL_FDCACHE");
+  if (s && *s) {
+    char *end;
+    long const n = strtol(s, &end, 10);
+    if (*end || n < 0) {
+      errno = EINVAL;
+      return -1;
+    }
+    log_max = n < FDCACHE_LOGS_MAX ? n : FDCACHE_LOGS_MAX;
+  }
+  int const fd = open("/dev/null", O_RDWR | O_CLOEXEC);
+  if (fd < 0) return -1;
+  struct stat st;
+  if (fstat(fd, &st) < 0 || !S_ISCHR(st.st_mode)) {
+    close(fd);
+    errno = ENODEV;
+    return -1;
+  }
+  null_fd = move_up(fd);
+  return null_fd < 0 ? -1 : 0;
+}
+
+static struct log *
+find(char const *path)
+{
+  for (size_t i = 0; i < log_max; ++i) {
+    if (logs[i].path && strcmp(logs[i].path, path) == 0) return &logs[i];
+  }
+  return 0;
+}
+
+static void
+drop(struct log *l)
+{
+  close(l->fd);
+  free(l->path);
+  *l = (struct log){.fd = -1};
+}
+
+/* Makes sure the cached descriptor for path, if any, is still the file path
+ * names, opening it if it is not. Only existing regular files are opened
+ * here: a FIFO would block the shell, and a missing file is left for the
+ * child to create (and to report the error for). */
+static void
+refresh(char const *path)
+{
+  struct log *l = find(path);
+  struct stat st;
+  if (stat(path, &st) < 0 || !S_ISREG(st.st_mode)) {
+    if (l) drop(l);
+    return;
+  }
+  if (l && l->dev == st.st_dev && l->ino == st.st_ino) {
+    l->used = ++tick;
+    return;
+  }
+  if (l) drop(l);
+
+  char *copy = strdup(path);
+  if (!copy) return;
+  /* O_NONBLOCK in case it has become a FIFO since the stat() */
+  int fd = open(path, LOG_FLAGS | O_NONBLOCK | O_CLOEXEC, 0777);
+  if (fd < 0 || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) goto err;
+  fcntl(fd, F_SETFL, O_APPEND);
+  fd = move_up(fd);
+  if (fd < 0) goto err;
+
+  /* A free slot, or the one least recently used */
+  l = &logs[0];
+  for (size_t i = 0; i < log_max && l->path; ++i) {
+    if (!logs[i].path || logs[i].used < l->used) l = &logs[i];
+  }
+  if (l->path) drop(l);
+  *l = (struct log){
+      .path = copy, .fd = fd, .dev = st.st_dev, .ino = st.st_ino, .used = ++tick};
+  trace(TRACE_SPAWN, "caching descriptor %d for %s", fd, path);
+  return;
+err:
+  if (fd >= 0) close(fd);
+  free(copy);
+}
+
+int
+fdcache_prepare(struct command const *cmd)
+{
+  if (log_max) {
+    for (size_t i = 0; i < cmd->io_redir_count; ++i) {
+      struct io_redir const *r = cmd->io_redirs[i];
+      if (r->io_op == OP_DGREAT) refresh(r->filename);
+    }
+  }
+  for (size_t i = 0; i < cmd->io_redir_count; ++i) {
+    int const n = cmd->io_redirs[i]->io_number;
+    if (n < FDCACHE_BASE) continue;
+    if (n == null_fd) return 0;
+    for (size_t j = 0; j < log_max; ++j) {
+      if (logs[j].path && n == logs[j].fd) return 0;
+    }
+  }
+  return 1;
+}
+
+int
+fdcache_get(char const *path, int flags)
+{
+  /* Opened for reading and writing, it serves every redirection; a
+   * character device is exempt from the `>` no-clobber rule */
+  if (null_fd >= 0 && strcmp(path, "/dev/null") == 0) return null_fd;
+  if (flags != LOG_FLAGS) return -1;
+  struct log const *l = find(path);
+  return l ? l->fd : -1;
+}
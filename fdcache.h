@@ -0,0 +1,40 @@
+#pragma once
+/** @file Cached descriptors for redirection targets
+ *
+ * `cmd >/dev/null 2>&1` in a loop would otherwise look up and open
+ * /dev/null for every command. The shell keeps /dev/null open instead, and,
+ * when BIGSHELL_FDCACHE=n, up to n files that commands append to with `>>`.
+ * The descriptors are O_CLOEXEC and numbered from FDCACHE_BASE, so they
+ * never reach an exec'd program except through a redirection, which is a
+ * single dup2() in the child.
+ *
+ * Before each fork, fdcache_prepare() stat()s the command's `>>` targets and
+ * (re)opens those whose (dev, ino) no longer match, so a log file that has
+ * been rotated or removed is opened afresh rather than written to where it
+ * was.
+ */
+#include "parser.h"
+
+#define FDCACHE_BASE 64 /* lowest descriptor used */
+#define FDCACHE_LOGS_MAX 8
+
+/** Opens /dev/null, and reads BIGSHELL_FDCACHE
+ *
+ * @returns 0 on success, -1 on failure
+ */
+extern int fdcache_init(void);
+
+/** Validates or opens the cached descriptors for cmd's redirections
+ *
+ * @returns 1 if fdcache_get() may be used for cmd's redirections, 0 if one
+ *          of them replaces a descriptor the cache holds
+ */
+extern int fdcache_prepare(struct command const *cmd);
+
+/** The cached descriptor for path opened with flags (see open(2)); makes no
+ * system calls
+ *
+ * @returns the descriptor, which the caller must not close, or -1 if path
+ *          must be opened
+ */
+extern int fdcache_get(char const *path, int flags);
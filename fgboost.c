@@ -0,0 +1,219 @@
+#define _POSIX_C_SOURCE 200809L
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include "cgroup.h"
+#include "fgboost.h"
+#include "jobs.h"
+#include "util/trace.h"
+
+/* A job whose cgroup's cpu.weight was lowered, or a process in a job whose
+ * nice value was raised */
+struct lowered {
+  pid_t pgid;
+  pid_t pid; /* 0 for the job's cgroup */
+  int old;   /* its cpu.weight or nice value */
+  int nice;  /* the nice value it was given */
+};
+
+int fgboost_enabled = 0;
+
+static struct lowered *lowered;
+static size_t lowered_count = 0;
+
+/* Whether the nice value of a process may be set back to old after raising
+ * it */
+static int
+can_restore(int old)
+{
+  if (geteuid() == 0) return 1;
+  struct rlimit rl;
+  /* RLIMIT_NICE allows nice values down to 20 - rlim_cur */
+  return getrlimit(RLIMIT_NICE, &rl) == 0 &&
+         (rl.rlim_cur == RLIM_INFINITY || 20 - (long)rl.rlim_cur <= old);
+}
+
+/* A process of a job whose nice values are being changed */
+struct proc {
+  pid_t pid;
+  pid_t ppid;
+  pid_t pgrp;
+};
+
+/* The processes of those jobs, by pid, from the last scan() */
+static struct proc *procs;
+static size_t proc_count = 0;
+
+/* Reads the parent and process group of process pid from /proc
+ *
+ * @returns 0 on success, -1 if pid is gone
+ */
+static int
+proc_stat(pid_t pid, pid_t *ppid, pid_t *pgrp)
+{
+  char path[32], buf[512];
+  snprintf(path, sizeof path, "/proc/%jd/stat", (intmax_t)pid);
+  int const fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return -1;
+  ssize_t const n = read(fd, buf, sizeof buf - 1);
+  close(fd);
+  if (n <= 0) return -1;
+  buf[n] = '\0';
+  /* The command name in parentheses may contain anything */
+  char const *p = strrchr(buf, ')');
+  intmax_t parent, group;
+  if (!p || sscanf(p + 1, " %*c %jd %jd", &parent, &group) != 2) return -1;
+  *ppid = parent;
+  *pgrp = group;
+  return 0;
+}
+
+static int
+by_pid(void const *a, void const *b)
+{
+  pid_t const x = ((struct proc const *)a)->pid;
+  pid_t const y = ((struct proc const *)b)->pid;
+  return (x > y) - (x < y);
+}
+
+/* Finds the processes of the jobs in pgids[0..n), in a single pass over
+ * /proc, however many jobs there are */
+static void
+scan(pid_t const *pgids, size_t n)
+{
+  proc_count = 0;
+  if (!n) return;
+  DIR *d = opendir("/proc");
+  if (!d) return;
+  struct dirent *e;
+  while ((e = readdir(d))) {
+    char *end;
+    long const pid = strtol(e->d_name, &end, 10);
+    struct proc p = {.pid = pid};
+    if (*end || pid <= 0 || proc_stat(pid, &p.ppid, &p.pgrp) < 0) continue;
+    size_t i = 0;
+    while (i < n && pgids[i] != p.pgrp) ++i;
+    if (i == n) continue;
+    void *tmp = realloc(procs, sizeof *procs * (proc_count + 1));
+    if (!tmp) break;
+    procs = tmp;
+    procs[proc_count++] = p;
+  }
+  closedir(d);
+  qsort(procs, proc_count, sizeof *procs, by_pid);
+}
+
+/* The process pid among those found by scan(), if it is */
+static struct proc const *
+lookup(pid_t pid)
+{
+  struct proc const key = {.pid = pid};
+  return bsearch(&key, procs, proc_count, sizeof *procs, by_pid);
+}
+
+static int
+add(struct lowered l)
+{
+  void *tmp = realloc(lowered, sizeof *lowered * (lowered_count + 1));
+  if (!tmp) return -1;
+  lowered = tmp;
+  lowered[lowered_count++] = l;
+  return 0;
+}
+
+static void
+lower_process(struct proc const *p)
+{
+  errno = 0;
+  int const old = getpriority(PRIO_PROCESS, p->pid);
+  if (old == -1 && errno) return;
+  int const nice = old + FGBOOST_NICE < 19 ? old + FGBOOST_NICE : 19;
+  if (nice == old || !can_restore(old)) return;
+  if (setpriority(PRIO_PROCESS, p->pid, nice) < 0) {
+    trace(TRACE_WAIT, "setpriority(%jd): %s", (intmax_t)p->pid, strerror(errno));
+    return;
+  }
+  struct lowered const l = {
+      .pgid = p->pgrp, .pid = p->pid, .old = old, .nice = nice};
+  if (add(l) < 0) setpriority(PRIO_PROCESS, p->pid, old);
+}
+
+/* The process of its job whose nice value was raised that is p, or else
+ * the nearest ancestor of p in the job that is: a child started meanwhile
+ * inherited its raised nice value */
+static struct lowered const *
+find(struct proc const *p)
+{
+  for (int depth = 0; p && depth < 64; ++depth) {
+    for (size_t i = 0; i < lowered_count; ++i) {
+      struct lowered const *l = &lowered[i];
+      if (l->pid == p->pid && l->pgid == p->pgrp) return l;
+    }
+    struct proc const *parent = lookup(p->ppid);
+    p = parent && parent->pgrp == p->pgrp ? parent : 0;
+  }
+  return 0;
+}
+
+static void
+restore_process(struct proc const *p)
+{
+  struct lowered const *l = find(p);
+  if (!l) return;
+  /* A nice value changed meanwhile is left alone */
+  errno = 0;
+  int const nice = getpriority(PRIO_PROCESS, p->pid);
+  if (nice == l->nice && !errno) setpriority(PRIO_PROCESS, p->pid, l->old);
+}
+
+void
+fgboost_begin(pid_t pgid)
+{
+  if (!fgboost_enabled) return;
+  size_t const job_count = jobs_get_joblist_size();
+  struct job const *jobs = jobs_get_joblist();
+  pid_t *niced = malloc(sizeof *niced * (job_count + 1));
+  if (!niced) return;
+  size_t n = 0;
+  for (size_t i = 0; i < job_count; ++i) {
+    if (jobs[i].pgid == pgid) continue;
+    unsigned weight;
+    if (cgroup_set_weight(jobs[i].pgid, FGBOOST_WEIGHT, &weight) == 0) {
+      struct lowered const l = {.pgid = jobs[i].pgid, .old = weight};
+      if (add(l) < 0) cgroup_set_weight(jobs[i].pgid, weight, &weight);
+    } else {
+      niced[n++] = jobs[i].pgid;
+    }
+  }
+  scan(niced, n);
+  for (size_t i = 0; i < proc_count; ++i) lower_process(&procs[i]);
+  free(niced);
+}
+
+void
+fgboost_end(void)
+{
+  pid_t *niced = malloc(sizeof *niced * (lowered_count + 1));
+  size_t n = 0;
+  /* Jobs that have finished since are simply not found */
+  for (size_t i = 0; i < lowered_count; ++i) {
+    struct lowered const *l = &lowered[i];
+    unsigned ignored;
+    if (!l->pid) cgroup_set_weight(l->pgid, l->old, &ignored);
+    /* A job's processes are next to each other */
+    else if (niced && (i == 0 || lowered[i - 1].pgid != l->pgid)) {
+      niced[n++] = l->pgid;
+    }
+  }
+  scan(niced, n);
+  for (size_t i = 0; i < proc_count; ++i) restore_process(&procs[i]);
+  free(niced);
+  lowered_count = 0;
+}
@@ -0,0 +1,26 @@
+#pragma once
+/** @file Priority for the foreground job
+ *
+ * With `set -o fgboost`, background jobs yield the CPU to the job in the
+ * foreground while it runs, and get their priority back once the shell
+ * regains the terminal. A job in its own cgroup (see cgroup.h) has its
+ * cpu.weight cut to FGBOOST_WEIGHT. In any other job, each process has its
+ * own nice value raised by FGBOOST_NICE, if the shell is allowed to lower it
+ * back afterwards (RLIMIT_NICE, or root), and gets that value back; so do
+ * the processes it started meanwhile, which inherited the raised value. A
+ * nice value that was changed meanwhile is left as it is.
+ */
+#include <sys/types.h>
+
+#define FGBOOST_WEIGHT 10 /* of the default 100 */
+#define FGBOOST_NICE 10
+
+/** nonzero if background jobs yield to the foreground */
+extern int fgboost_enabled;
+
+/** Lowers the priority of the jobs other than pgid, which is about to run
+ * in the foreground */
+extern void fgboost_begin(pid_t pgid);
+
+/** Restores the priorities lowered by fgboost_begin() */
+extern void fgboost_end(void);
@@ -0,0 +1,454 @@
+#define _GNU_SOURCE /* memrchr(), memmem(), mremap() */
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "history.h"
+#include "region.h"
+
+#define BLOCK_ENTRIES 64
+#define SIGNATURE_BITS 4096 /* a power of two */
+#define SIGNATURE_WORDS (SIGNATURE_BITS / 64)
+#define PAIR_BITS 1024 /* a power of two */
+#define PAIR_WORDS (PAIR_BITS / 64)
+
+/* Files smaller than this are indexed at startup, without a thread */
+#define THREAD_THRESHOLD (256 * 1024)
+
+/* BLOCK_ENTRIES consecutive entries and the trigrams that occur in them;
+ * the bytes and byte pairs serve queries too short to have trigrams */
+struct block {
+  size_t start;
+  uint64_t signature[SIGNATURE_WORDS];
+  uint64_t pairs[PAIR_WORDS];
+  uint64_t bytes[256 / 64];
+};
+
+struct index {
+  struct block *blocks; /* a region (see region.h) */
+  size_t count;
+  size_t cap;
+  size_t end; /* offset where the last block ends */
+};
+
+enum { INDEX_BUILDING, INDEX_BUILT, INDEX_OWNED };
+
+static int fd = -1;
+static char *map = 0;
+static size_t map_len = 0;
+static size_t size = 0; /* bytes of complete entries at the start of map */
+static unsigned unsynced = 0;
+static int stale = 0; /* the file was truncated since the index was built */
+
+/* Where entries are copied for the caller */
+static char *entry;
+static size_t entry_cap = 0;
+
+/* Reads of a mapping fault with SIGBUS where the file was truncated under
+ * it, by hand or by another shell; a thread's guarded reads jump back to
+ * bus_env instead */
+static _Thread_local sigjmp_buf bus_env;
+static _Thread_local volatile sig_atomic_t guarded = 0;
+
+/* Until index_state is INDEX_OWNED, idx belongs to the builder thread */
+static struct index idx;
+static pthread_t builder;
+static atomic_int index_state = INDEX_OWNED;
+
+static unsigned
+trigram(unsigned char a, unsigned char b, unsigned char c)
+{
+  uint32_t const t = (uint32_t)a << 16 | (uint32_t)b << 8 | c;
+  return (t * 2654435761u) >> (32 - 12) & (SIGNATURE_BITS - 1);
+}
+
+static unsigned
+pair(unsigned char a, unsigned char b)
+{
+  return ((uint32_t)a << 8 | b) * 2654435761u >> (32 - 10) & (PAIR_BITS - 1);
+}
+
+#define SET_BIT(set, n) ((set)[(n) / 64] |= (uint64_t)1 << ((n) % 64))
+
+/* Records the trigrams, pairs and bytes of s[0..len) in b, which may be a
+ * query's */
+static void
+sign(struct block *b, unsigned char const *s, size_t len)
+{
+  for (size_t i = 0; i < len; ++i) {
+    SET_BIT(b->bytes, s[i]);
+    if (i + 1 < len) SET_BIT(b->pairs, pair(s[i], s[i + 1]));
+    if (i + 2 < len) SET_BIT(b->signature, trigram(s[i], s[i + 1], s[i + 2]));
+  }
+}
+
+/* Whether block b may hold everything q has */
+static int
+may_contain(struct block const *b, struct block const *q)
+{
+  uint64_t missing = 0;
+  for (size_t w = 0; w < SIGNATURE_WORDS; ++w) {
+    missing |= q->signature[w] & ~b->signature[w];
+  }
+  for (size_t w = 0; w < PAIR_WORDS; ++w) missing |= q->pairs[w] & ~b->pairs[w];
+  for (size_t w = 0; w < 256 / 64; ++w) missing |= q->bytes[w] & ~b->bytes[w];
+  return !missing;
+}
+
+/* Indexes the complete blocks of entries in base[ix->end..to) */
+static void
+index_extend(struct index *ix, char const *base, size_t to)
+{
+  for (;;) {
+    size_t const start = ix->end;
+    size_t end = start;
+    for (unsigned n = 0; n < BLOCK_ENTRIES; ++n) {
+      char const *nl = memchr(base + end, '\n', to - end);
+      if (!nl) return; /* the rest is searched linearly */
+      end = nl - base + 1;
+    }
+    if (ix->count == ix->cap) {
+      size_t const cap = ix->cap ? ix->cap * 2 : 64;
+      void *tmp = region_resize(
+          ix->blocks, sizeof *ix->blocks * ix->cap, sizeof *ix->blocks * cap);
+      if (!tmp) return;
+      ix->blocks = tmp;
+      ix->cap = cap;
+    }
+    struct block *b = &ix->blocks[ix->count++];
+    memset(b, 0, sizeof *b);
+    b->start = start;
+    sign(b, (unsigned char const *)base + start, end - start);
+    ix->end = end;
+  }
+}
+
+static void
+on_sigbus(int sig)
+{
+  if (guarded) siglongjmp(bus_env, 1);
+  /* Any other fault happens again, and is fatal as it would have been */
+  signal(sig, SIG_DFL);
+}
+
+static void *
+build_index(void *arg)
+{
+  size_t const len = *(size_t const *)arg;
+  free(arg);
+  sigset_t bus;
+  sigemptyset(&bus);
+  sigaddset(&bus, SIGBUS);
+  pthread_sigmask(SIG_UNBLOCK, &bus, 0);
+  void *base = mmap(0, len, PROT_READ, MAP_SHARED, fd, 0);
+  if (base != MAP_FAILED) {
+    if (sigsetjmp(bus_env, 1) == 0) {
+      guarded = 1;
+      region_dontfork(base, len);
+      madvise(base, len, MADV_SEQUENTIAL);
+      index_extend(&idx, base, len);
+    } else {
+      idx.count = idx.end = 0;
+    }
+    guarded = 0;
+    munmap(base, len);
+  }
+  atomic_store_explicit(&index_state, INDEX_BUILT, memory_order_release);
+  return 0;
+}
+
+/* Whether the index belongs to the shell's thread, collecting it from the
+ * builder if that has finished */
+static int
+index_owned(void)
+{
+  switch (atomic_load_explicit(&index_state, memory_order_acquire)) {
+    case INDEX_BUILDING:
+      return 0;
+    case INDEX_BUILT:
+      pthread_join(builder, 0);
+      atomic_store_explicit(&index_state, INDEX_OWNED, memory_order_relaxed);
+      /* fallthrough */
+    default:
+      return 1;
+  }
+}
+
+/* Maps whatever the file holds now and updates size and the index */
+static int
+refresh(void)
+{
+  struct stat st;
+  if (fstat(fd, &st) < 0) return -1;
+  size_t const len = st.st_size;
+  if (len < size) stale = 1;
+  if (len != map_len) {
+    void *p;
+    if (!len) p = 0;
+    else if (map) p = mremap(map, map_len, len, MREMAP_MAYMOVE);
+    else p = mmap(0, len, PROT_READ, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+      if (!map) map_len = size = 0;
+      return -1;
+    }
+    if (!len && map) munmap(map, map_len);
+    region_dontfork(p, len);
+    map = p;
+    map_len = len;
+  }
+  /* A partly written entry at the end does not count yet */
+  char const *nl = map_len ? memrchr(map, '\n', map_len) : 0;
+  size = nl ? (size_t)(nl - map) + 1 : 0;
+  if (index_owned()) {
+    if (stale || idx.end > size) idx.count = idx.end = 0;
+    stale = 0;
+    index_extend(&idx, map, size);
+  }
+  return 0;
+}
+
+/* Gives up on what was read of a file that was truncated under the mapping;
+ * the next refresh() reads it afresh */
+static ssize_t
+faulted(void)
+{
+  guarded = 0;
+  size = 0;
+  stale = 1;
+  return -1;
+}
+
+/* Copies the entry at map[start..start + len) for the caller, who may read
+ * it after the file is truncated */
+static ssize_t
+copy_out(size_t start, size_t len, char const **text)
+{
+  if (len >= entry_cap) {
+    void *tmp = realloc(entry, len + 1);
+    if (!tmp) return -1;
+    entry = tmp;
+    entry_cap = len + 1;
+  }
+  memcpy(entry, map + start, len);
+  *text = entry;
+  return start;
+}
+
+int
+history_init(void)
+{
+  char path[PATH_MAX];
+  char const *s = getenv("BIGSHELL_HISTFILE");
+  if (s) {
+    if (!*s) return 0;
+    snprintf(path, sizeof path, "%s", s);
+  } else {
+    char const *home = getenv("HOME");
+    if (!home) return 0;
+    snprintf(path, sizeof path, "%s/.bigshell_history", home);
+  }
+  fd = open(path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+  if (fd < 0) return -1;
+  struct sigaction sa = {.sa_handler = on_sigbus};
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGBUS, &sa, 0);
+
+  atomic_store(&index_state, INDEX_BUILDING);
+  if (refresh() < 0) {
+    close(fd);
+    fd = -1;
+    return -1;
+  }
+  size_t *len = size >= THREAD_THRESHOLD ? malloc(sizeof *len) : 0;
+  if (len) {
+    *len = size;
+    /* The thread must not take the shell's signals */
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    int const err = pthread_create(&builder, 0, build_index, len);
+    pthread_sigmask(SIG_SETMASK, &old, 0);
+    if (err == 0) return 0;
+    free(len);
+  }
+  atomic_store(&index_state, INDEX_OWNED);
+  index_extend(&idx, map, size);
+  return 0;
+}
+
+void
+history_add(char const *entry, size_t len)
+{
+  if (fd < 0 || len <= 1) return;
+  if (write(fd, entry, len) < 0) return;
+  if (++unsynced == HISTORY_SYNC_EVERY) {
+    fdatasync(fd);
+    unsynced = 0;
+  }
+}
+
+size_t
+history_end(void)
+{
+  if (fd < 0) return 0;
+  if (sigsetjmp(bus_env, 1)) {
+    faulted();
+    return 0;
+  }
+  guarded = 1;
+  refresh();
+  guarded = 0;
+  return size;
+}
+
+static ssize_t
+prev(size_t at, char const **text, size_t *len)
+{
+  refresh();
+  if (at > size) at = size;
+  if (at == 0) return -1;
+  size_t const end = at - 1; /* its newline */
+  char const *nl = end ? memrchr(map, '\n', end) : 0;
+  size_t const start = nl ? (size_t)(nl - map) + 1 : 0;
+  *len = end - start;
+  return copy_out(start, *len, text);
+}
+
+ssize_t
+history_prev(size_t at, char const **text, size_t *len)
+{
+  if (fd < 0) return -1;
+  if (sigsetjmp(bus_env, 1)) return faulted();
+  guarded = 1;
+  ssize_t const found = prev(at, text, len);
+  guarded = 0;
+  return found;
+}
+
+static ssize_t
+next(size_t at, char const **text, size_t *len)
+{
+  refresh();
+  if (at >= size) return -1;
+  char const *nl = memchr(map + at, '\n', size - at);
+  size_t const start = nl - map + 1;
+  if (start >= size) return -1;
+  char const *end = memchr(map + start, '\n', size - start);
+  *len = end - (map + start);
+  return copy_out(start, *len, text);
+}
+
+ssize_t
+history_next(size_t at, char const **text, size_t *len)
+{
+  if (fd < 0) return -1;
+  if (sigsetjmp(bus_env, 1)) return faulted();
+  guarded = 1;
+  ssize_t const found = next(at, text, len);
+  guarded = 0;
+  return found;
+}
+
+/* Searches the entries in [from, to), newest first; to is an entry's
+ * offset or the end */
+static ssize_t
+scan(char const *query,
+     size_t query_len,
+     size_t from,
+     size_t to,
+     char const **text,
+     size_t *len)
+{
+  while (to > from) {
+    size_t const end = to - 1;
+    /* map is null only while there are no entries; the test is for the
+     * compiler, which cannot tell */
+    char const *const first = map + from;
+    char const *nl =
+        first && end > from ? memrchr(first, '\n', end - from) : 0;
+    size_t const start = nl ? (size_t)(nl - map) + 1 : from;
+    if (memmem(map + start, end - start, query, query_len)) {
+      *len = end - start;
+      return copy_out(start, *len, text);
+    }
+    to = start;
+  }
+  return -1;
+}
+
+static ssize_t
+search(char const *query,
+       size_t query_len,
+       size_t before,
+       char const **text,
+       size_t *len)
+{
+  refresh();
+  if (before > size) before = size;
+  /* Round up to the end of the entry that holds before - 1 */
+  if (before) {
+    char const *nl = memchr(map + before - 1, '\n', size - before + 1);
+    before = nl - map + 1;
+  }
+
+  /* Newest first: what the index does not cover yet, then the blocks */
+  int const owned = index_owned();
+  size_t const indexed = owned ? idx.end : 0;
+  if (before > indexed) {
+    ssize_t const found = scan(query, query_len, indexed, before, text, len);
+    if (found >= 0 || !owned) return found;
+    before = indexed;
+  }
+
+  struct block want = {0};
+  sign(&want, (unsigned char const *)query, query_len);
+  /* The last block that starts before before */
+  size_t lo = 0, hi = idx.count;
+  while (lo < hi) {
+    size_t const mid = lo + (hi - lo) / 2;
+    if (idx.blocks[mid].start < before) lo = mid + 1;
+    else hi = mid;
+  }
+  for (size_t b = lo; b-- > 0;) {
+    struct block const *blk = &idx.blocks[b];
+    if (!may_contain(blk, &want)) continue;
+    size_t end = b + 1 < idx.count ? idx.blocks[b + 1].start : idx.end;
+    if (end > before) end = before;
+    ssize_t const found = scan(query, query_len, blk->start, end, text, len);
+    if (found >= 0) return found;
+  }
+  return -1;
+}
+
+ssize_t
+history_search(char const *query,
+               size_t query_len,
+               size_t before,
+               char const **text,
+               size_t *len)
+{
+  if (fd < 0) return -1;
+  if (sigsetjmp(bus_env, 1)) return faulted();
+  guarded = 1;
+  ssize_t const found = search(query, query_len, before, text, len);
+  guarded = 0;
+  return found;
+}
+
+void
+history_close(void)
+{
+  if (fd < 0) return;
+  if (unsynced) fdatasync(fd);
+  unsynced = 0;
+}
@@ -0,0 +1,76 @@
+#pragma once
+/** @file Command history
+ *
+ * History is kept in an append-only file, $BIGSHELL_HISTFILE or
+ * ~/.bigshell_history, one entry per line, shared by every shell that uses
+ * it. The file is memory-mapped rather than read: entries are found by
+ * scanning for newlines in the mapping when they are needed, so a shell
+ * starts just as fast with a million entries as with none. Each new entry is
+ * appended with one write(2) to an O_APPEND descriptor, so concurrent shells
+ * never interleave, and fdatasync(2) runs once per HISTORY_SYNC_EVERY
+ * entries and at exit.
+ *
+ * Searches use an index of blocks of consecutive entries, each with a
+ * bitmap of the trigrams that occur in it; a block whose bitmap lacks one
+ * of the query's trigrams is skipped without being read. A large file is
+ * indexed by a background thread at startup, and until it finishes the
+ * file is searched linearly. Entries added later, by this shell or others,
+ * are indexed as they fill blocks.
+ *
+ * Entries are identified by their offset in the file. Text returned by
+ * these functions is a copy, valid until the next call to one of them. A
+ * file truncated from outside, which makes reads of the mapping fault with
+ * SIGBUS, is read afresh; what was found in it is forgotten.
+ */
+#include <stddef.h>
+#include <sys/types.h>
+
+#define HISTORY_SYNC_EVERY 16
+
+/** Opens and maps the history file; setting BIGSHELL_HISTFILE to the empty
+ * string disables history
+ *
+ * @returns 0 on success, -1 on failure
+ */
+extern int history_init(void);
+
+/** Appends an entry
+ *
+ * @param [in]entry the entry, ending with a newline
+ * @param [in]len its length, including the newline
+ */
+extern void history_add(char const *entry, size_t len);
+
+/** Picks up entries added since the last call, by any shell
+ *
+ * @returns the offset just past the newest entry
+ */
+extern size_t history_end(void);
+
+/** Finds the entry before the one at offset at (or before the end)
+ *
+ * @param [out]text the entry, without its newline
+ * @param [out]len its length
+ * @returns the entry's offset, or -1 if there is none
+ */
+extern ssize_t history_prev(size_t at, char const **text, size_t *len);
+
+/** Finds the entry after the one at offset at
+ *
+ * @returns the entry's offset, or -1 if at is the newest
+ */
+extern ssize_t history_next(size_t at, char const **text, size_t *len);
+
+/** Finds the newest entry that contains query and starts before offset
+ * before
+ *
+ * @returns the entry's offset, or -1 if there is none
+ */
+extern ssize_t history_search(char const *query,
+                              size_t query_len,
+                              size_t before,
+                              char const **text,
+                              size_t *len);
+
+/** Flushes appended entries to disk */
+extern void history_close(void);
@@ -2,7 +2,9 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "alloc.h"
 #include "jobs.h"
+#include "util/probe.h"
 
 struct job *jobs_joblist;
 size_t jobs_joblist_size = 0;
@@ -24,8 +26,9 @@ jobs_add(pid_t pgid)
 {
   /* Allocate space for a new job record */
   if (jobs_get_jid(pgid) >= 0) return -1;
-  void *tmp =
-      realloc(jobs_joblist, sizeof *jobs_joblist * (jobs_joblist_size + 1));
+  void *tmp = alloc_realloc(ALLOC_JOBS,
+                            jobs_joblist,
+                            sizeof *jobs_joblist * (jobs_joblist_size + 1));
   if (!tmp) return -1;
   jobs_joblist = tmp;
 
@@ -46,6 +49,7 @@ jobs_add(pid_t pgid)
   jobs_joblist[insert_at] =
       (struct job){.jid = jid, .pgid = pgid, .status = -1};
   ++jobs_joblist_size;
+  PROBE2(job__add, jid, pgid);
   return jid;
 }
 
@@ -72,18 +76,20 @@ jobs_remove_pgid(pid_t pgid)
 {
   for (size_t i = 0; i < jobs_joblist_size;) {
     if (jobs_joblist[i].pgid == pgid) {
+      PROBE2(job__remove, jobs_joblist[i].jid, pgid);
       memmove(&jobs_joblist[i],
               &jobs_joblist[i + 1],
               sizeof *jobs_joblist * (jobs_joblist_size - i - 1));
       --jobs_joblist_size;
 
       if (jobs_joblist_size) {
-        void *tmp =
-            realloc(jobs_joblist, sizeof *jobs_joblist * (jobs_joblist_size));
+        void *tmp = alloc_realloc(ALLOC_JOBS,
+                                  jobs_joblist,
+                                  sizeof *jobs_joblist * (jobs_joblist_size));
         if (!tmp) return -1;
         jobs_joblist = tmp;
       } else {
-        free(jobs_joblist);
+        alloc_free(jobs_joblist);
         jobs_joblist = 0;
       }
     }
@@ -125,7 +131,7 @@ jobs_get_status(jid_t jid, int *status)
 void
 jobs_cleanup(void)
 {
-  free(jobs_joblist);
+  alloc_free(jobs_joblist);
   jobs_joblist = 0;
   jobs_joblist_size = 0;
 }
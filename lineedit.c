@@ -0,0 +1,880 @@
+#define _GNU_SOURCE /* fopencookie(), ppoll() */
+#include <err.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "complete.h"
+#include "history.h"
+#include "lineedit.h"
+#include "segment.h"
+
+#define CONTROL(c) ((c) & 0x1f)
+#define MAX_IOV 16
+
+/* Keys that arrive as escape sequences */
+enum {
+  KEY_NONE = 256, /* a sequence with no binding */
+  KEY_LEFT,
+  KEY_RIGHT,
+  KEY_HOME,
+  KEY_END,
+  KEY_DELETE,
+  KEY_UP,
+  KEY_DOWN,
+};
+
+struct text {
+  char *s;
+  size_t len;
+  size_t cap;
+};
+
+static int enabled = 0;
+static int const tty = STDIN_FILENO;
+static struct termios cooked, raw;
+static int in_raw = 0;
+static volatile sig_atomic_t resized = 1;
+static size_t cols = 80;
+
+static struct text prompt;
+static size_t prompt_tail;  /* offset of the prompt's last line */
+static size_t prompt_width; /* columns taken by its last line */
+static int prompt_pending = 0;
+static void (*make_prompt)(void); /* sets the prompt again */
+static int (*idle_ready)(void);   /* see lineedit_idle_source() */
+static void (*idle_run)(void);
+
+/* Positions on screen are columns from the start of the prompt's last line;
+ * a position p is on row p / cols below it */
+static struct text line;  /* the line being edited */
+static size_t pos;        /* cursor, as an offset into line */
+static struct text shown; /* the line as it is on screen */
+static size_t cursor;     /* the terminal's cursor */
+static int last_key = 0;  /* the key before the one being handled */
+
+static unsigned char in[64]; /* a key whose sequence is incomplete */
+static size_t in_len = 0, in_off = 0;
+static int queued = 0; /* bytes known to be waiting in the terminal */
+
+static struct text done; /* an accepted line that stdio has not read yet */
+static size_t done_off = 0;
+
+/* History browsing, and the ^R search in progress */
+static ssize_t hist_at = -1; /* the entry shown, or -1 for a new line */
+static struct text saved;    /* the new line, while an entry is shown */
+static int searching = 0;
+static struct text query;
+static struct text match; /* a copy of the entry found */
+static ssize_t match_at = -1;
+static size_t match_pos; /* where the query is in match */
+static int search_failed = 0;
+static struct text view; /* what is drawn while searching */
+
+/* The output of one frame: pieces of the line and escape sequences */
+static struct {
+  struct iovec iov[MAX_IOV];
+  int count;
+  char seq[256];
+  size_t seq_len;
+} frame;
+
+static void
+on_winch(int sig)
+{
+  resized = 1;
+}
+
+static int
+text_reserve(struct text *t, size_t len)
+{
+  if (len <= t->cap) return 0;
+  size_t cap = t->cap ? t->cap : 128;
+  while (cap < len) cap *= 2;
+  void *tmp = realloc(t->s, cap);
+  if (!tmp) return -1;
+  t->s = tmp;
+  t->cap = cap;
+  return 0;
+}
+
+static void
+frame_flush(void)
+{
+  struct iovec *iov = frame.iov;
+  int count = frame.count;
+  while (count) {
+    ssize_t n = writev(tty, iov, count);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      break;
+    }
+    for (; count && (size_t)n >= iov->iov_len; ++iov, --count) {
+      n -= iov->iov_len;
+    }
+    if (count) {
+      iov->iov_base = (char *)iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+  frame.count = 0;
+  frame.seq_len = 0;
+}
+
+static void
+frame_add(void const *p, size_t len)
+{
+  if (!len) return;
+  if (frame.count) {
+    struct iovec *last = &frame.iov[frame.count - 1];
+    if ((char *)last->iov_base + last->iov_len == p) {
+      last->iov_len += len;
+      return;
+    }
+  }
+  if (frame.count == MAX_IOV) frame_flush();
+  frame.iov[frame.count++] =
+      (struct iovec){.iov_base = (void *)p, .iov_len = len};
+}
+
+static void
+frame_seq(char const *fmt, ...)
+{
+  size_t const room = sizeof frame.seq - frame.seq_len;
+  va_list ap;
+  va_start(ap, fmt);
+  int n = vsnprintf(frame.seq + frame.seq_len, room, fmt, ap);
+  va_end(ap);
+  if (n < 0) return;
+  if ((size_t)n >= room) {
+    frame_flush();
+    va_start(ap, fmt);
+    n = vsnprintf(frame.seq, sizeof frame.seq, fmt, ap);
+    va_end(ap);
+    if (n < 0 || (size_t)n >= sizeof frame.seq) return;
+  }
+  frame_add(frame.seq + frame.seq_len, n);
+  frame.seq_len += n;
+}
+
+/* Columns taken by s[0..len): one per character, none for CSI sequences */
+static size_t
+width(char const *s, size_t len)
+{
+  size_t w = 0;
+  for (size_t i = 0; i < len; ++i) {
+    unsigned char const c = s[i];
+    if (c == '\x1b' && i + 1 < len && s[i + 1] == '[') {
+      for (i += 2; i < len && !(s[i] >= 0x40 && s[i] <= 0x7e); ++i);
+    } else if (c >= 0x20 && (c & 0xc0) != 0x80) {
+      ++w;
+    }
+  }
+  return w;
+}
+
+static int
+text_set(struct text *t, char const *s, size_t len)
+{
+  if (text_reserve(t, len) < 0) return -1;
+  memcpy(t->s, s, len);
+  t->len = len;
+  return 0;
+}
+
+static int
+text_append(struct text *t, char const *s, size_t len)
+{
+  if (text_reserve(t, t->len + len) < 0) return -1;
+  memcpy(t->s + t->len, s, len);
+  t->len += len;
+  return 0;
+}
+
+/* Screen position of offset off into t */
+static size_t
+column(struct text const *t, size_t off)
+{
+  return prompt_width + width(t->s, off);
+}
+
+/* Lays out the search in view; returns the cursor's offset into it */
+static size_t
+search_view(void)
+{
+  view.len = 0;
+  if (search_failed) text_append(&view, "(failed ", 8);
+  else text_append(&view, "(", 1);
+  text_append(&view, "reverse-i-search)`", 18);
+  text_append(&view, query.s, query.len);
+  text_append(&view, "': ", 3);
+  size_t const at = view.len;
+  if (match_at >= 0) text_append(&view, match.s, match.len);
+  return at + (match_at >= 0 ? match_pos : 0);
+}
+
+/* Moves the terminal's cursor to position to */
+static void
+move_to(size_t to)
+{
+  size_t const from_row = cursor / cols, to_row = to / cols;
+  size_t const from_col = cursor % cols, to_col = to % cols;
+  if (to_row < from_row) frame_seq("\x1b[%zuA", from_row - to_row);
+  else if (to_row > from_row) frame_seq("\x1b[%zuB", to_row - from_row);
+  if (to_col < from_col) {
+    /* Whichever is shortest */
+    if (to_col == 0) frame_seq("\r");
+    else if (from_col - to_col < 4) {
+      frame_seq("%.*s", (int)(from_col - to_col), "\b\b\b");
+    } else {
+      frame_seq("\x1b[%zuD", from_col - to_col);
+    }
+  } else if (to_col > from_col) {
+    frame_seq("\x1b[%zuC", to_col - from_col);
+  }
+  cursor = to;
+}
+
+/* Forgets what is on screen and starts over from the prompt's last line,
+ * which the caller has cleared */
+static void
+redraw_from_prompt(void)
+{
+  frame_add(prompt.s + prompt_tail, prompt.len - prompt_tail);
+  cursor = prompt_width;
+  shown.len = 0;
+}
+
+/* Adds what brings the screen up to date with line and pos, or with the
+ * search, to the frame */
+static void
+render(void)
+{
+  struct text const *v = &line;
+  size_t at = pos;
+  if (searching) {
+    at = search_view();
+    v = &view;
+  }
+
+  if (resized) {
+    resized = 0;
+    size_t const old = cols;
+    struct winsize ws;
+    if (ioctl(tty, TIOCGWINSZ, &ws) == 0 && ws.ws_col) cols = ws.ws_col;
+    if (!prompt_pending && cols != old) {
+      /* Rows are now cols wide; go back to the prompt and draw it all */
+      if (cursor / cols) frame_seq("\x1b[%zuA", cursor / cols);
+      frame_seq("\r\x1b[J");
+      redraw_from_prompt();
+    }
+  }
+  if (prompt_pending) {
+    frame_add(prompt.s, prompt.len);
+    prompt_pending = 0;
+    cursor = prompt_width;
+  }
+
+  /* Only the characters from the first difference on are written */
+  size_t same = 0;
+  while (same < v->len && same < shown.len && v->s[same] == shown.s[same]) {
+    ++same;
+  }
+  while (same && same < v->len && (v->s[same] & 0xc0) == 0x80) --same;
+  if (same < v->len || same < shown.len) {
+    move_to(column(v, same));
+    frame_add(v->s + same, v->len - same);
+    cursor = column(v, v->len);
+    /* A line that fills its last row leaves the terminal's cursor on it;
+     * put it on the next row, where our arithmetic expects it */
+    if (v->len > same && cursor % cols == 0) frame_seq("\n");
+    if (width(shown.s, shown.len) > width(v->s, v->len)) frame_seq("\x1b[J");
+  }
+  move_to(column(v, at));
+
+  if (text_set(&shown, v->s, v->len) < 0) shown.len = 0;
+}
+
+/* Rows taken by the prompt's lines before its last, from the row the first
+ * one starts on; a prompt that starts with a newline starts on the row
+ * after the cursor was left on, and is counted from there */
+static size_t
+prompt_head_rows(void)
+{
+  size_t rows = 0;
+  char const *s = prompt.s, *end = prompt.s + prompt_tail;
+  if (s < end && *s == '\n') ++s;
+  while (s < end) {
+    char const *nl = memchr(s, '\n', end - s);
+    size_t const w = width(s, nl - s);
+    rows += w ? (w + cols - 1) / cols : 1;
+    s = nl + 1;
+  }
+  return rows;
+}
+
+/* Sets the prompt again and redraws it in place, with the line */
+static void
+reprompt(void)
+{
+  if (prompt_pending) { /* not drawn yet */
+    make_prompt();
+    return;
+  }
+  size_t const rows = cursor / cols + prompt_head_rows();
+  size_t const skip = prompt.len && prompt.s[0] == '\n';
+  make_prompt();
+  if (rows) frame_seq("\x1b[%zuA", rows);
+  frame_seq("\r\x1b[J");
+  frame_add(prompt.s + skip, prompt.len - skip);
+  prompt_pending = 0;
+  cursor = prompt_width;
+  shown.len = 0;
+  render();
+  frame_flush();
+}
+
+/* Does the idle work below the line, and starts the line over after what
+ * it printed */
+static void
+run_idle(void)
+{
+  render(); /* the line may not have been drawn yet */
+  move_to(column(&line, line.len));
+  if (!(line.len && cursor % cols == 0)) frame_seq("\n");
+  frame_flush();
+  lineedit_release();
+  idle_run();
+  if (tcsetattr(tty, TCSADRAIN, &raw) == 0) in_raw = 1;
+  prompt_pending = 1;
+  shown.len = 0;
+  render();
+  frame_flush();
+}
+
+/* Reads a byte of input into in, redrawing the prompt if a segment
+ * changes and doing idle work meanwhile; returns what read(2) would */
+static ssize_t
+read_byte(void)
+{
+  for (;;) {
+    struct pollfd fds[1 + SEGMENT_MAX] = {{.fd = tty, .events = POLLIN}};
+    int timeout;
+    int const n = segment_fds(fds + 1, &timeout);
+    /* The search is left alone; its work waits for the next key */
+    int const idle = idle_ready && !searching ? idle_ready() : -1;
+    if (idle == 0) {
+      run_idle();
+      continue;
+    }
+    if (!n && idle < 0) break;
+    if (idle > 0 && (timeout < 0 || idle < timeout)) timeout = idle;
+    /* Only ^C may cut the wait short, as ppoll() is never restarted; a
+     * resize, a stats request or a profiler tick is handled once it is
+     * over, as it is during read() */
+    sigset_t mask;
+    sigprocmask(SIG_SETMASK, 0, &mask);
+    sigaddset(&mask, SIGWINCH);
+    sigaddset(&mask, SIGIO);
+    sigaddset(&mask, SIGPROF);
+    struct timespec const ts = {timeout / 1000, timeout % 1000 * 1000000L};
+    if (ppoll(fds, 1 + n, timeout < 0 ? 0 : &ts, &mask) < 0) return -1;
+    if (segment_collect() && make_prompt) reprompt();
+    if (fds[0].revents) break;
+  }
+  return read(tty, in + in_len, 1);
+}
+
+/* Decodes the key at in[in_off..in_len); returns how many bytes it takes,
+ * or 0 if the rest of it has not arrived */
+static size_t
+next_key(int *key)
+{
+  unsigned char const *p = in + in_off;
+  size_t const n = in_len - in_off;
+  if (p[0] != '\x1b') {
+    *key = p[0];
+    return 1;
+  }
+  if (n < 2) return 0;
+  *key = KEY_NONE;
+  if (p[1] != '[' && p[1] != 'O') return 2; /* Meta-key */
+
+  /* ESC [ parameters final, or ESC O final */
+  size_t i = 2;
+  while (i < n && p[i] >= 0x20 && p[i] <= 0x3f) ++i;
+  if (i == n) return 0;
+  int const param = atoi((char const *)p + 2);
+  switch (p[i]) {
+    case 'A':
+      *key = KEY_UP;
+      break;
+    case 'B':
+      *key = KEY_DOWN;
+      break;
+    case 'C':
+      *key = KEY_RIGHT;
+      break;
+    case 'D':
+      *key = KEY_LEFT;
+      break;
+    case 'H':
+      *key = KEY_HOME;
+      break;
+    case 'F':
+      *key = KEY_END;
+      break;
+    case '~':
+      if (param == 1 || param == 7) *key = KEY_HOME;
+      else if (param == 4 || param == 8) *key = KEY_END;
+      else if (param == 3) *key = KEY_DELETE;
+      break;
+  }
+  return i + 1;
+}
+
+static void
+insert(char c)
+{
+  if (text_reserve(&line, line.len + 1) < 0) return;
+  memmove(line.s + pos + 1, line.s + pos, line.len - pos);
+  line.s[pos++] = c;
+  ++line.len;
+}
+
+/* Removes line[from..to) and leaves the cursor at from */
+static void
+erase(size_t from, size_t to)
+{
+  memmove(line.s + from, line.s + to, line.len - to);
+  line.len -= to - from;
+  pos = from;
+}
+
+static size_t
+char_before(size_t off)
+{
+  if (off) --off;
+  while (off && (line.s[off] & 0xc0) == 0x80) --off;
+  return off;
+}
+
+static size_t
+char_after(size_t off)
+{
+  if (off < line.len) ++off;
+  while (off < line.len && (line.s[off] & 0xc0) == 0x80) ++off;
+  return off;
+}
+
+/* Shows the entry at offset at, or the new line if at is -1 */
+static void
+show_entry(ssize_t at, char const *text, size_t len)
+{
+  if (hist_at < 0 && text_set(&saved, line.s, line.len) < 0) return;
+  if (at < 0) text_set(&line, saved.s, saved.len);
+  else text_set(&line, text, len);
+  hist_at = at;
+  pos = line.len;
+}
+
+/* Whether c ends the word to complete */
+static int
+word_break(char c)
+{
+  return c == ' ' || c == '\t' || (c && strchr("|;&<>", c));
+}
+
+/* Lists the candidates, less their first skip bytes, in columns below the
+ * line, and starts the line over after them */
+static void
+list_candidates(struct completion const *c, size_t skip)
+{
+  size_t longest = 0;
+  for (size_t i = 0; i < c->count; ++i) {
+    size_t const w = width(c->names[i] + skip, strlen(c->names[i] + skip));
+    if (w > longest) longest = w;
+  }
+  size_t const col_width = longest + 2;
+  size_t per_row = cols / col_width;
+  if (!per_row) per_row = 1;
+  size_t const rows = (c->count + per_row - 1) / per_row;
+
+  render(); /* the line may not have been drawn yet */
+  move_to(column(&line, line.len));
+  if (!(line.len && cursor % cols == 0)) frame_seq("\n");
+  for (size_t r = 0; r < rows; ++r) {
+    for (size_t i = r; i < c->count; i += rows) {
+      char const *name = c->names[i] + skip;
+      frame_add(name, strlen(name));
+      if (i + rows < c->count) {
+        frame_seq("%*s", (int)(col_width - width(name, strlen(name))), "");
+      }
+    }
+    frame_seq("\n");
+  }
+  frame_flush(); /* the names go with c */
+  prompt_pending = 1;
+  shown.len = 0;
+}
+
+/* Completes the word before the cursor as far as its candidates agree; a
+ * second Tab that completes nothing lists them */
+static void
+complete_word(int again)
+{
+  size_t start = pos;
+  while (start && !word_break(line.s[start - 1])) --start;
+  size_t before = start;
+  while (before && line.s[before - 1] == ' ') --before;
+  int const command = !before || strchr("|;&", line.s[before - 1]);
+
+  struct completion c;
+  if (complete(line.s + start, pos - start, command, &c) < 0) return;
+  if (!c.count) return;
+  size_t common = strlen(c.names[0]);
+  for (size_t i = 1; i < c.count; ++i) {
+    size_t n = 0;
+    while (n < common && c.names[i][n] == c.names[0][n]) ++n;
+    common = n;
+  }
+  size_t const have = pos - start;
+  for (size_t i = have; i < common; ++i) insert(c.names[0][i]);
+  if (c.count == 1) {
+    if (common && c.names[0][common - 1] != '/') insert(' ');
+  } else if (common == have && again) {
+    char const *slash = memrchr(line.s + start, '/', have);
+    list_candidates(&c, slash ? (size_t)(slash - (line.s + start)) + 1 : 0);
+  }
+  completion_free(&c);
+}
+
+/* Looks for the query in the entries that start before offset before */
+static void
+search(size_t before)
+{
+  char const *text;
+  size_t len;
+  if (text_reserve(&query, 1) < 0) return;
+  ssize_t const at = history_search(query.s, query.len, before, &text, &len);
+  search_failed = at < 0;
+  if (at < 0 || text_set(&match, text, len) < 0) return; /* keep the last */
+  match_at = at;
+  match_pos = (char *)memmem(match.s, match.len, query.s, query.len) - match.s;
+}
+
+/* Applies a key to the search; returns 1 if it ends the line, 0 if the
+ * search goes on, -1 if it ends the search and the key applies to the
+ * line */
+static int
+handle_search_key(int key)
+{
+  switch (key) {
+    case CONTROL('R'): /* the next older match */
+      search(match_at >= 0 ? (size_t)match_at : history_end());
+      return 0;
+    case 0x7f:
+    case CONTROL('H'):
+      if (query.len) {
+        do --query.len;
+        while (query.len && (query.s[query.len] & 0xc0) == 0x80);
+      }
+      match_at = -1;
+      search(history_end());
+      return 0;
+    case CONTROL('G'):
+      searching = 0;
+      return 0;
+    default:
+      if (key >= 0x20 && key < 0x100 && key != 0x7f) {
+        char const c = key;
+        if (text_append(&query, &c, 1) == 0) {
+          /* The current match is kept if it still matches */
+          search(match_at >= 0 ? (size_t)match_at + 1 : history_end());
+        }
+        return 0;
+      }
+      searching = 0;
+      if (match_at >= 0) {
+        show_entry(match_at, match.s, match.len);
+        pos = match_pos;
+      }
+      return key == '\r' || key == '\n' ? 1 : -1;
+  }
+}
+
+/* Applies one key; returns 1 if it ends the line, 0 otherwise */
+static int
+handle_key(int key)
+{
+  int const prev = last_key;
+  last_key = key;
+  switch (key) {
+    case '\r':
+    case '\n':
+      return 1;
+    case CONTROL('A'):
+    case KEY_HOME:
+      pos = 0;
+      break;
+    case CONTROL('E'):
+    case KEY_END:
+      pos = line.len;
+      break;
+    case CONTROL('B'):
+    case KEY_LEFT:
+      pos = char_before(pos);
+      break;
+    case CONTROL('F'):
+    case KEY_RIGHT:
+      pos = char_after(pos);
+      break;
+    case 0x7f:
+    case CONTROL('H'):
+      erase(char_before(pos), pos);
+      break;
+    case CONTROL('D'):
+    case KEY_DELETE:
+      erase(pos, char_after(pos));
+      break;
+    case CONTROL('K'):
+      erase(pos, line.len);
+      break;
+    case CONTROL('U'):
+      erase(0, pos);
+      break;
+    case CONTROL('W'): {
+      size_t from = pos;
+      while (from && line.s[from - 1] == ' ') --from;
+      while (from && line.s[from - 1] != ' ') --from;
+      erase(from, pos);
+      break;
+    }
+    case CONTROL('L'):
+      frame_seq("\x1b[H\x1b[2J");
+      redraw_from_prompt();
+      break;
+    case CONTROL('P'):
+    case KEY_UP: {
+      char const *text;
+      size_t len;
+      size_t const from = hist_at < 0 ? history_end() : (size_t)hist_at;
+      ssize_t const at = history_prev(from, &text, &len);
+      if (at >= 0) show_entry(at, text, len);
+      break;
+    }
+    case CONTROL('N'):
+    case KEY_DOWN: {
+      if (hist_at < 0) break;
+      char const *text = 0;
+      size_t len = 0;
+      ssize_t const at = history_next(hist_at, &text, &len);
+      show_entry(at, text, len);
+      break;
+    }
+    case CONTROL('R'):
+      searching = 1;
+      search_failed = 0;
+      query.len = 0;
+      match_at = -1;
+      break;
+    case '\t':
+      complete_word(prev == '\t');
+      break;
+    default:
+      if (key >= 0x20 && key < 0x100 && key != 0x7f) insert(key);
+      break;
+  }
+  return 0;
+}
+
+/* Reads a line without editing, for terminals that refuse raw mode */
+static int
+read_cooked(void)
+{
+  if (prompt_pending) {
+    frame_add(prompt.s, prompt.len);
+    frame_flush();
+    prompt_pending = 0;
+  }
+  if (text_reserve(&done, 4096) < 0) return -1;
+  ssize_t n = read(tty, done.s, done.cap);
+  if (n <= 0) return n;
+  done.len = n;
+  return 1;
+}
+
+/* Edits a line and leaves it in done; returns 1 if a line was entered, 0 at
+ * end of file, -1 on error (EINTR for ^C) */
+static int
+edit(void)
+{
+  if (!in_raw) {
+    if (tcsetattr(tty, TCSADRAIN, &raw) < 0) return read_cooked();
+    in_raw = 1;
+  }
+  line.len = pos = 0;
+  shown.len = 0;
+  queued = 0; /* typeahead may have gone to a job */
+  hist_at = -1;
+  searching = 0;
+  last_key = 0;
+
+  int res;
+  for (;;) {
+    while (in_off < in_len) {
+      int key;
+      size_t const n = next_key(&key);
+      if (!n) break;
+      in_off += n;
+      if (searching) {
+        int const r = handle_search_key(key);
+        if (r == 1) {
+          res = 1;
+          goto out;
+        }
+        if (r == 0) continue;
+      }
+      if (key == CONTROL('D') && !line.len) {
+        res = 0;
+        goto out;
+      }
+      if (handle_key(key)) {
+        res = 1;
+        goto out;
+      }
+    }
+    /* Keep a partial escape sequence for the next read */
+    memmove(in, in + in_off, in_len - in_off);
+    in_len -= in_off;
+    in_off = 0;
+    if (in_len == sizeof in) in_len = 0; /* not a sequence we know */
+
+    /* A paste is drawn once, when the last of it has been read */
+    if (!queued) {
+      render();
+      frame_flush();
+    }
+    /* One byte at a time: what follows an Enter is typeahead for the
+     * command it starts, and must stay in the terminal's queue */
+    ssize_t const n = read_byte();
+    if (n <= 0) {
+      queued = 0;
+      res = n;
+      goto out;
+    }
+    in_len += n;
+    if (queued) --queued;
+    else if (ioctl(tty, FIONREAD, &queued) < 0) queued = 0;
+  }
+
+out:;
+  int const saved_errno = errno;
+  searching = 0;
+  pos = line.len;
+  render();
+  if (res >= 0 && !(line.len && cursor % cols == 0)) frame_seq("\n");
+  frame_flush();
+  if (res == 1) {
+    if (text_reserve(&done, line.len + 1) < 0) {
+      res = -1;
+    } else {
+      memcpy(done.s, line.s, line.len);
+      done.s[line.len] = '\n';
+      done.len = line.len + 1;
+      history_add(done.s, done.len);
+    }
+  } else {
+    errno = saved_errno;
+  }
+  return res;
+}
+
+static ssize_t
+lineedit_read(void *cookie, char *p, size_t size)
+{
+  if (done_off == done.len) {
+    done.len = done_off = 0;
+    int const res = edit();
+    if (res <= 0) return res;
+  }
+  size_t n = done.len - done_off;
+  if (n > size) n = size;
+  memcpy(p, done.s + done_off, n);
+  done_off += n;
+  return n;
+}
+
+FILE *
+lineedit_open(FILE *input)
+{
+  char const *term = getenv("TERM");
+  if (fileno(input) != tty || (term && strcmp(term, "dumb") == 0)) {
+    return input;
+  }
+  if (tcgetattr(tty, &cooked) < 0) return input;
+  raw = cooked;
+  /* ISIG stays, for ^C, and ICRNL, so that typeahead left for a job has
+   * the line endings it would have had in cooked mode */
+  raw.c_lflag &= ~(ICANON | ECHO | IEXTEN);
+  raw.c_cc[VMIN] = 1;
+  raw.c_cc[VTIME] = 0;
+
+  FILE *f = fopencookie(0, "r", (cookie_io_functions_t){.read = lineedit_read});
+  if (!f) return input;
+  struct sigaction sa = {.sa_handler = on_winch, .sa_flags = SA_RESTART};
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGWINCH, &sa, 0);
+  if (history_init() < 0) warn("history");
+  if (complete_init() < 0) warn("completion");
+  enabled = 1;
+  return f;
+}
+
+void
+lineedit_release(void)
+{
+  if (!in_raw) return;
+  tcsetattr(tty, TCSADRAIN, &cooked);
+  in_raw = 0;
+}
+
+void
+lineedit_prompt_source(void (*make)(void))
+{
+  make_prompt = make;
+}
+
+void
+lineedit_idle_source(int (*ready)(void), void (*run)(void))
+{
+  idle_ready = ready;
+  idle_run = run;
+}
+
+void
+lineedit_prompt(struct iovec const *iov, int iovcnt)
+{
+  if (!enabled) {
+    writev(tty, iov, iovcnt);
+    return;
+  }
+  prompt.len = 0;
+  for (int i = 0; i < iovcnt; ++i) {
+    if (text_reserve(&prompt, prompt.len + iov[i].iov_len) < 0) break;
+    memcpy(prompt.s + prompt.len, iov[i].iov_base, iov[i].iov_len);
+    prompt.len += iov[i].iov_len;
+  }
+  char const *nl = prompt.len ? memrchr(prompt.s, '\n', prompt.len) : 0;
+  prompt_tail = nl ? (size_t)(nl - prompt.s) + 1 : 0;
+  prompt_width = width(prompt.s + prompt_tail, prompt.len - prompt_tail);
+  prompt_pending = 1;
+}
@@ -0,0 +1,54 @@
+#pragma once
+/** @file Line editor
+ *
+ * An interactive shell on a terminal reads its input through a line editor
+ * rather than the tty's cooked mode. The terminal is put in raw mode (with
+ * ISIG and OPOST left on, so ^C still interrupts and output is unchanged)
+ * to edit a line, and stays there until the terminal is handed to a
+ * foreground job, so builtins cost no termios round trip.
+ *
+ * Keys are read one byte at a time, so that input after an Enter is left
+ * for the command it starts. A frame is drawn only once no more input is
+ * queued, so a paste produces one frame, written with a single writev(2).
+ * A frame rewrites only the part of the line that changed, starting at the
+ * first differing character, and moves the cursor with the shortest
+ * sequence available, so typing at the end of a line costs one byte per
+ * key over a slow link. The width of the terminal is cached and refreshed
+ * when SIGWINCH arrives.
+ *
+ * Keys: ^A/Home ^E/End ^B/Left ^F/Right, Backspace, ^D/Delete (EOF on an
+ * empty line), ^K kill to end, ^U kill to start, ^W kill word, ^L redraw,
+ * Up/^P Down/^N history, ^R search history, Tab complete (twice to list).
+ * Characters are assumed to be one column wide.
+ */
+#include <stdio.h>
+#include <sys/uio.h>
+
+/** Starts editing the lines read from input, if it is a usable terminal
+ *
+ * @param [in]input stream the interactive shell would read from
+ * @returns a stream that returns edited lines, or input itself if the
+ *          terminal does not support editing
+ */
+extern FILE *lineedit_open(FILE *input);
+
+/** Returns the terminal to the modes it had before editing, if they were
+ * changed; called before a foreground job gets the terminal and at exit */
+extern void lineedit_release(void);
+
+/** Sets the function that sets the prompt, with lineedit_prompt(); it is
+ * called again to redraw the prompt when a prompt segment changes */
+extern void lineedit_prompt_source(void (*make)(void));
+
+/** Sets the work to do while waiting for a key: ready() returns 0 if it is
+ * due, the milliseconds until it is, or -1 if there is none, and run() does
+ * it, with the terminal as it is outside editing, below the line, which is
+ * then drawn again */
+extern void lineedit_idle_source(int (*ready)(void), void (*run)(void));
+
+/** Sets the prompt for the next line
+ *
+ * The prompt is the concatenation of iov[0..iovcnt). It is drawn as part of
+ * the next line's first frame, or written right away if editing is off.
+ */
+extern void lineedit_prompt(struct iovec const *iov, int iovcnt);
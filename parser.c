@@ -6,20 +6,63 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+#include "alloc.h"
 #include "expand.h"
+#include "lineedit.h"
 #include "parser.h"
-#include "util/gprintf.h"
+#include "segment.h"
+#include "stats.h"
+#include "util/probe.h"
+#include "util/trace.h"
 #include "vars.h"
 
 int is_interactive = 0;
+size_t parser_lineno = 0;
+
+static int prompt_continued = 0; /* whether the prompt is PS2 */
+
+/* Expands PS1 (or PS2) and hands it to the line editor, which calls this
+ * again when a prompt segment changes */
+static void
+show_prompt(void)
+{
+  uint64_t const prompt_start = stats_now();
+  char const *s = 0;
+  if (!prompt_continued) {
+    s = vars_get("PS1");
+    if (!s) {
+      if (getuid() == 0) s = "#";
+      else s = "$";
+    }
+  } else {
+    s = vars_get("PS2");
+    if (!s) s = ">";
+  }
+  assert(s);
+  char *s_copy = alloc_strdup(ALLOC_PARSER, s);
+  if (s_copy) {
+    if (expand_prompt(&s_copy)) {
+      char prefix[] = "\n=== [BIGSHELL] ===\n";
+      struct iovec iov[] = {
+          {prefix, sizeof prefix - (s_copy[0] != '\n' ? 1 : 2)},
+          {s_copy, strlen(s_copy)},
+      };
+      lineedit_prompt(iov, 2);
+    }
+  }
+  alloc_free(s_copy);
+  stats_record_since(STATS_PROMPT, prompt_start);
+}
 
 int
 parser_init()
 {
   if (isatty(STDIN_FILENO)) {
     is_interactive = 1;
+    lineedit_prompt_source(show_prompt);
   } else if (errno == ENOTTY) {
     errno = 0;
   } else {
@@ -33,22 +76,22 @@ command_free(struct command *cmd)
 {
   if (cmd) {
     for (size_t i = 0; i < cmd->assignment_count; ++i) {
-      free(cmd->assignments[i]->name);
-      free(cmd->assignments[i]->value);
-      free(cmd->assignments[i]);
+      alloc_free(cmd->assignments[i]->name);
+      alloc_free(cmd->assignments[i]->value);
+      alloc_free(cmd->assignments[i]);
     }
-    free(cmd->assignments);
+    alloc_free(cmd->assignments);
 
     for (size_t i = 0; i < cmd->word_count; ++i) {
-      free(cmd->words[i]);
+      alloc_free(cmd->words[i]);
     }
-    free(cmd->words);
+    alloc_free(cmd->words);
 
     for (size_t i = 0; i < cmd->io_redir_count; ++i) {
-      free(cmd->io_redirs[i]->filename);
-      free(cmd->io_redirs[i]);
+      alloc_free(cmd->io_redirs[i]->filename);
+      alloc_free(cmd->io_redirs[i]);
     }
-    free(cmd->io_redirs);
+    alloc_free(cmd->io_redirs);
   }
 }
 
@@ -57,9 +100,9 @@ command_list_free(struct command_list *cl)
 {
   for (size_t i = 0; i < cl->command_count; ++i) {
     command_free(cl->commands[i]);
-    free(cl->commands[i]);
+    alloc_free(cl->commands[i]);
   }
-  free(cl->commands);
+  alloc_free(cl->commands);
 }
 
 char const *
@@ -78,8 +121,8 @@ command_list_strerror(int e)
   }
 }
 
-static char const *
-redir_op_str(enum io_operator op)
+char const *
+io_operator_str(enum io_operator op)
 {
   switch (op) {
     case OP_GREAT:
@@ -105,8 +148,9 @@ command_print(struct command const *cmd, FILE *stream)
 {
   for (size_t i = 0; i < cmd->assignment_count; ++i) {
     fprintf(stream,
-            "%s=%s ",
+            "%s%s=%s ",
             cmd->assignments[i]->name,
+            cmd->assignments[i]->append ? "+" : "",
             cmd->assignments[i]->value);
   }
 
@@ -118,7 +162,7 @@ command_print(struct command const *cmd, FILE *stream)
     fprintf(stream,
             "%d%s",
             cmd->io_redirs[i]->io_number,
-            redir_op_str(cmd->io_redirs[i]->io_op));
+            io_operator_str(cmd->io_redirs[i]->io_op));
     fprintf(stream, " %s ", cmd->io_redirs[i]->filename);
   }
 
@@ -186,7 +230,7 @@ match_word(char const **s, char **out)
       ++c;
       for (; *c != '"'; ++c) {
         if (!*c) {
-          gprintf("unmatched double quote");
+          trace(TRACE_PARSE, "unmatched double quote");
           retval = -2;
           goto err; /* Syntax error */
         }
@@ -194,7 +238,7 @@ match_word(char const **s, char **out)
         if (*c == '\\') {
           ++c;
           if (!*c) {
-            gprintf("missing trailing character after \\");
+            trace(TRACE_PARSE, "missing trailing character after \\");
             retval = -4;
             goto err; /* Syntax error */
           }
@@ -206,7 +250,7 @@ match_word(char const **s, char **out)
       ++c;
       for (; *c != '\''; ++c) {
         if (!*c) {
-          gprintf("unmatched single quote");
+          trace(TRACE_PARSE, "unmatched single quote");
           retval = -3;
           goto err;
         }
@@ -215,7 +259,7 @@ match_word(char const **s, char **out)
       /* Escape */
       ++c;
       if (!*c) {
-        gprintf("missing trailing character after \\");
+        trace(TRACE_PARSE, "missing trailing character after \\");
         retval = -4;
         goto err;
       }
@@ -224,7 +268,7 @@ match_word(char const **s, char **out)
   if (c == word) goto match_fail;
 
   { /* Write output */
-    void *tmp = strndup(word, c - word);
+    void *tmp = alloc_strndup(ALLOC_PARSER, word, c - word);
     if (!tmp) {
       retval = -errno;
       goto err;
@@ -298,7 +342,7 @@ match_redirect(char const **s, struct io_redir **redir)
   r.filename = filename;
 
   { /* Write output */
-    void *tmp = malloc(sizeof **redir);
+    void *tmp = alloc_malloc(ALLOC_PARSER, sizeof **redir);
     if (!tmp) {
       retval = -1;
       goto err;
@@ -312,13 +356,41 @@ match_redirect(char const **s, struct io_redir **redir)
   match_fail:
     retval = 0;
   err:
-    free(filename);
+    alloc_free(filename);
   }
   return retval;
 }
 
+/* Length of a leading $name or ${name} in value, after an opening double
+ * quote if there is one; 0 if there is none */
+static size_t
+self_reference(char const *value, char const *name)
+{
+  size_t const len = strlen(name);
+  char const *p = value + (*value == '"');
+  if (*p++ != '$') return 0;
+  if (*p == '{') {
+    if (strncmp(p + 1, name, len) == 0 && p[1 + len] == '}') return len + 3;
+  } else if (strncmp(p, name, len) == 0) {
+    if (!isalnum((unsigned char)p[len]) && p[len] != '_') return len + 1;
+  }
+  return 0;
+}
+
+/* Whether one of cmd's assignments so far sets name */
+static int
+assigns(struct command const *cmd, char const *name)
+{
+  for (size_t i = 0; i < cmd->assignment_count; ++i) {
+    if (strcmp(cmd->assignments[i]->name, name) == 0) return 1;
+  }
+  return 0;
+}
+
 static int
-match_assignment(char const **s, struct assignment **assn)
+match_assignment(char const **s,
+                 struct command const *cmd,
+                 struct assignment **assn)
 {
   int retval = 0;
   struct assignment a = {0};
@@ -330,23 +402,43 @@ match_assignment(char const **s, struct assignment **assn)
   if (!isalpha(name[0]) && name[0] != '_') goto match_fail;
 
   for (; isalnum(*c) || *c == '_'; ++c);
-  a.name = strndup(name, c - name);
+  a.name = alloc_strndup(ALLOC_PARSER, name, c - name);
   if (!a.name) {
     retval = -1;
     goto err;
   }
 
-  /* match "=" */
+  /* match "=" or "+=" */
+  if (c[0] == '+' && c[1] == '=') {
+    a.append = 1;
+    ++c;
+  }
   if (*c != '=') goto match_fail;
   ++c;
 
   /* Get value */
   retval = match_word(&c, &a.value);
   if (retval < 0) goto err;
-  if (retval == 0) a.value = strdup("");
+  if (retval == 0) a.value = alloc_strdup(ALLOC_PARSER, "");
+  if (!a.value) {
+    retval = -1;
+    goto err;
+  }
+
+  /* name="$name..." appends the rest, rather than copying the whole value
+   * into a new one; not after another name=... on the command, as every
+   * value is expanded before any is assigned */
+  if (!a.append && !assigns(cmd, a.name)) {
+    size_t const ref = self_reference(a.value, a.name);
+    if (ref) {
+      char *rest = a.value + (*a.value == '"');
+      memmove(rest, rest + ref, strlen(rest + ref) + 1);
+      a.append = 1;
+    }
+  }
 
   { /* Write output */
-    void *tmp = malloc(sizeof **assn);
+    void *tmp = alloc_malloc(ALLOC_PARSER, sizeof **assn);
     if (!tmp) {
       retval = -1;
       goto err;
@@ -360,8 +452,8 @@ match_assignment(char const **s, struct assignment **assn)
   match_fail:
     retval = 0;
   err:
-    free(a.name);
-    free(a.value);
+    alloc_free(a.name);
+    alloc_free(a.value);
   }
   return retval;
 }
@@ -370,8 +462,10 @@ static int
 add_assignment(struct command *cmd, struct assignment *assn)
 {
   /* NOLINTBEGIN */
-  void *tmp = realloc(cmd->assignments,
-                      sizeof *cmd->assignments * (cmd->assignment_count + 1));
+  void *tmp =
+      alloc_realloc(ALLOC_PARSER,
+                    cmd->assignments,
+                    sizeof *cmd->assignments * (cmd->assignment_count + 1));
   /* NOLINTEND */
   if (!tmp) return -1;
   cmd->assignments = tmp;
@@ -382,7 +476,9 @@ add_assignment(struct command *cmd, struct assignment *assn)
 static int
 add_word(struct command *cmd, char *word)
 {
-  void *tmp = realloc(cmd->words, sizeof *cmd->words * (cmd->word_count + 1));
+  void *tmp = alloc_realloc(ALLOC_PARSER,
+                            cmd->words,
+                            sizeof *cmd->words * (cmd->word_count + 1));
   if (!tmp) return -1;
   cmd->words = tmp;
   cmd->words[cmd->word_count++] = word;
@@ -393,8 +489,10 @@ static int
 add_redirection(struct command *cmd, struct io_redir *redir)
 {
   /* NOLINTBEGIN */
-  void *tmp = realloc(cmd->io_redirs,
-                      sizeof *cmd->io_redirs * (cmd->io_redir_count + 1));
+  void *tmp =
+      alloc_realloc(ALLOC_PARSER,
+                    cmd->io_redirs,
+                    sizeof *cmd->io_redirs * (cmd->io_redir_count + 1));
   /* NOLINTEND */
   if (!tmp) return -1;
   cmd->io_redirs = tmp;
@@ -413,7 +511,7 @@ match_command(char const **s, struct command **command)
     discard_whitespace(&c);
     if (cmd.word_count == 0) {
       struct assignment *assn = 0;
-      retval = match_assignment(&c, &assn);
+      retval = match_assignment(&c, &cmd, &assn);
       if (retval < 0) goto err;
       if (retval > 0) {
         add_assignment(&cmd, assn);
@@ -476,7 +574,7 @@ match_command(char const **s, struct command **command)
     --cmd.word_count;
   }
   { /* Write output */
-    void *tmp = malloc(sizeof **command);
+    void *tmp = alloc_malloc(ALLOC_PARSER, sizeof **command);
     if (!tmp) {
       retval = -1;
       goto err;
@@ -499,8 +597,9 @@ static int
 add_command(struct command_list *cl, struct command *cmd)
 {
   /* NOLINTBEGIN */
-  void *tmp =
-      realloc(cl->commands, sizeof *cl->commands * (cl->command_count + 1));
+  void *tmp = alloc_realloc(ALLOC_PARSER,
+                            cl->commands,
+                            sizeof *cl->commands * (cl->command_count + 1));
   /* NOLINTEND */
   if (!tmp) return -1;
   cl->commands = tmp;
@@ -511,6 +610,7 @@ add_command(struct command_list *cl, struct command *cmd)
 int
 command_list_parse(struct command_list **cl, FILE *stream)
 {
+  PROBE0(parse__start);
   int count = 0;
   int retval = 0;
   char *line = 0;
@@ -518,7 +618,7 @@ command_list_parse(struct command_list **cl, FILE *stream)
   char const *c;
   ssize_t line_length;
   struct command *cmd = 0;
-  void *tmp = malloc(sizeof **cl);
+  void *tmp = alloc_malloc(ALLOC_PARSER, sizeof **cl);
   if (!tmp) {
     retval = -1;
     goto err;
@@ -526,31 +626,13 @@ command_list_parse(struct command_list **cl, FILE *stream)
   *cl = tmp;
   (*cl)->command_count = 0;
   (*cl)->commands = 0;
+  (*cl)->lineno = parser_lineno + 1;
+  uint64_t parse_ns = 0;
   do {
     if (is_interactive) {
-      char const *s = 0;
-      if (!line) {
-        s = vars_get("PS1");
-        if (!s) {
-          if (getuid() == 0) s = "#";
-          else s = "$";
-        }
-      } else {
-        s = vars_get("PS2");
-        if (!s) s = ">";
-      }
-      assert(s);
-      char *s_copy = strdup(s);
-      if (s_copy) {
-        if (expand_prompt(&s_copy)) {
-          char prefix[] = "\n=== [BIGSHELL] ===\n";
-          write(fileno(stream),
-                prefix,
-                sizeof prefix - (s_copy[0] != '\n' ? 1 : 2));
-          write(fileno(stream), s_copy, strlen(s_copy));
-        }
-      }
-      free(s_copy);
+      prompt_continued = line != 0;
+      if (!prompt_continued) segment_expire();
+      show_prompt();
     }
     line_length = getline(&line, &n, stream);
     if (line_length < 0) {
@@ -560,11 +642,13 @@ command_list_parse(struct command_list **cl, FILE *stream)
       retval = -1;
       goto err;
     }
+    ++parser_lineno;
+    uint64_t const parse_start = stats_now();
     c = line;
     while (*c) {
       discard_whitespace(&c);
       retval = match_command(&c, &cmd);
-      gprintf("match command returned %d", retval);
+      trace(TRACE_PARSE, "match command returned %d", retval);
       if (retval < 0) goto err;
       if (retval == 0) {
         if ((*cl)->command_count == 0) goto match_fail;
@@ -573,14 +657,17 @@ command_list_parse(struct command_list **cl, FILE *stream)
       count += retval;
       add_command(*cl, cmd);
     }
+    parse_ns += stats_now() - parse_start;
   } while (cmd->ctrl_op == '|');
+  stats_record(STATS_PARSE, parse_ns);
+  PROBE2(parse__done, (*cl)->command_count, parse_ns);
   retval = count;
   if (0) {
   err:
   match_fail:
   eof:
     command_list_free(*cl);
-    free(*cl);
+    alloc_free(*cl);
     *cl = 0;
   }
   free(line);
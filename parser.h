@@ -15,6 +15,7 @@ struct command_list {
     struct assignment { 
       char *name;
       char *value;
+      int append; /* name+=value, or name=$name... */
     } **assignments;
     size_t assignment_count;
 
@@ -53,10 +54,16 @@ struct command_list {
   } **commands;
 
   size_t command_count;
+
+  /* Input line number (from 1) on which the command list starts */
+  size_t lineno;
 };
 
 extern int is_interactive;
 
+/** Number of input lines read so far */
+extern size_t parser_lineno;
+
 int parser_init(void);
 
 /** Receives input and parses it into a command list */
@@ -74,3 +81,6 @@ void command_list_print(struct command_list const *cl, FILE *stream);
 
 /** Prints an individual parsed command */
 void command_print(struct command const *cmd, FILE *stream);
+
+/** Returns the source text of a redirection operator, e.g. ">>" */
+char const *io_operator_str(enum io_operator op);
@@ -0,0 +1,246 @@
+#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE /* pipe2(), syscall() */
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <linux/perf_event.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "perfctr.h"
+#include "util/trace.h"
+
+static struct {
+  char const *name;
+  uint32_t type;
+  uint64_t config;
+} const events[PERFCTR_EVENT_COUNT] = {
+    [PERFCTR_CYCLES] = {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    [PERFCTR_INSTRUCTIONS] = {"instructions",
+                              PERF_TYPE_HARDWARE,
+                              PERF_COUNT_HW_INSTRUCTIONS},
+    [PERFCTR_CACHE_MISSES] = {"cache-misses",
+                              PERF_TYPE_HARDWARE,
+                              PERF_COUNT_HW_CACHE_MISSES},
+    [PERFCTR_TASK_CLOCK] = {"task-clock(ns)",
+                            PERF_TYPE_SOFTWARE,
+                            PERF_COUNT_SW_TASK_CLOCK},
+    [PERFCTR_PAGE_FAULTS] = {"page-faults",
+                             PERF_TYPE_SOFTWARE,
+                             PERF_COUNT_SW_PAGE_FAULTS},
+    [PERFCTR_CONTEXT_SWITCHES] = {"context-switches",
+                                  PERF_TYPE_SOFTWARE,
+                                  PERF_COUNT_SW_CONTEXT_SWITCHES},
+};
+
+/* Counters of one running job; fds[p * PERFCTR_EVENT_COUNT + e] counts
+ * event e of the job's p-th process, or is -1 */
+struct job_counters {
+  pid_t pgid;
+  size_t proc_count;
+  int *fds;
+};
+
+int perfctr_enabled = 0;
+
+static unsigned active;        /* events attached to new processes */
+static int exclude_kernel = 0; /* required when perf_event_paranoid >= 2 */
+static struct job_counters *jobs;
+static size_t job_count = 0;
+static pid_t last_pgid = -1; /* most recently released job */
+static struct perfctr_counts last;
+
+static int
+open_event(enum perfctr_event e, pid_t pid, int on_exec)
+{
+  struct perf_event_attr attr = {
+      .size = sizeof attr,
+      .type = events[e].type,
+      .config = events[e].config,
+      .read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+                     PERF_FORMAT_TOTAL_TIME_RUNNING,
+      .disabled = 1,
+      .inherit = 1,
+      .enable_on_exec = on_exec,
+      .exclude_kernel = exclude_kernel,
+      .exclude_hv = exclude_kernel,
+  };
+  return syscall(
+      SYS_perf_event_open, &attr, pid, -1, -1, PERF_FLAG_FD_CLOEXEC);
+}
+
+int
+perfctr_init(void)
+{
+  char const *s = getenv("BIGSHELL_PERF");
+  if (!s || !*s) return 0;
+
+  /* Probe each event on the shell itself */
+  for (int e = 0; e < PERFCTR_EVENT_COUNT; ++e) {
+    int fd = open_event(e, 0, 0);
+    if (fd < 0 && (errno == EACCES || errno == EPERM) && !exclude_kernel) {
+      exclude_kernel = 1;
+      fd = open_event(e, 0, 0);
+    }
+    if (fd < 0) {
+      trace(TRACE_SPAWN,
+            "perf event %s unavailable: %s",
+            events[e].name,
+            strerror(errno));
+      continue;
+    }
+    close(fd);
+    active |= 1u << e;
+  }
+
+  /* Without hardware counters, fall back to the software ones; with them,
+   * the software stand-ins would only be noise */
+  unsigned const hw = (1u << PERFCTR_CYCLES) | (1u << PERFCTR_INSTRUCTIONS) |
+                      (1u << PERFCTR_CACHE_MISSES);
+  if (active & hw) {
+    active &= ~((1u << PERFCTR_TASK_CLOCK) | (1u << PERFCTR_PAGE_FAULTS));
+  }
+  if (!active) return -1;
+  perfctr_enabled = 1;
+  return 0;
+}
+
+int
+perfctr_sync_open(int sync[2])
+{
+  sync[0] = sync[1] = -1;
+  if (!perfctr_enabled) return 0;
+  return pipe2(sync, O_CLOEXEC);
+}
+
+void
+perfctr_sync_wait(int sync[2])
+{
+  if (sync[0] < 0) return;
+  close(sync[1]);
+  char c;
+  /* Returns at EOF, once the parent closes its end */
+  while (read(sync[0], &c, 1) < 0 && errno == EINTR);
+  close(sync[0]);
+}
+
+static struct job_counters *
+find_job(pid_t pgid)
+{
+  for (size_t i = 0; i < job_count; ++i) {
+    if (jobs[i].pgid == pgid) return &jobs[i];
+  }
+  return 0;
+}
+
+void
+perfctr_attach(pid_t pgid, pid_t pid, int sync[2])
+{
+  if (sync[0] < 0) return;
+  struct job_counters *j = find_job(pgid);
+  if (!j) {
+    void *tmp = realloc(jobs, sizeof *jobs * (job_count + 1));
+    if (!tmp) goto out;
+    jobs = tmp;
+    j = &jobs[job_count++];
+    *j = (struct job_counters){.pgid = pgid};
+  }
+  void *tmp = realloc(
+      j->fds, sizeof *j->fds * PERFCTR_EVENT_COUNT * (j->proc_count + 1));
+  if (!tmp) goto out;
+  j->fds = tmp;
+  int *fds = &j->fds[PERFCTR_EVENT_COUNT * j->proc_count++];
+  for (int e = 0; e < PERFCTR_EVENT_COUNT; ++e) {
+    fds[e] = active & (1u << e) ? open_event(e, pid, 1) : -1;
+  }
+out:
+  close(sync[0]);
+  close(sync[1]);
+}
+
+/* Reads a counter, scaled up if it was multiplexed with others */
+static int
+read_counter(int fd, uint64_t *value)
+{
+  uint64_t buf[3]; /* value, time enabled, time running */
+  if (read(fd, buf, sizeof buf) != sizeof buf) return -1;
+  if (buf[2] && buf[2] < buf[1]) {
+    buf[0] = (uint64_t)((double)buf[0] * buf[1] / buf[2]);
+  }
+  *value = buf[0];
+  return 0;
+}
+
+static void
+sum_job(struct job_counters const *j, struct perfctr_counts *counts)
+{
+  *counts = (struct perfctr_counts){0};
+  for (size_t p = 0; p < j->proc_count; ++p) {
+    for (int e = 0; e < PERFCTR_EVENT_COUNT; ++e) {
+      uint64_t v;
+      int fd = j->fds[p * PERFCTR_EVENT_COUNT + e];
+      if (fd < 0 || read_counter(fd, &v) < 0) continue;
+      counts->value[e] += v;
+      counts->valid |= 1u << e;
+    }
+  }
+}
+
+int
+perfctr_read(pid_t pgid, struct perfctr_counts *counts)
+{
+  struct job_counters const *j = find_job(pgid);
+  if (j) {
+    sum_job(j, counts);
+    return 0;
+  }
+  if (pgid == last_pgid) {
+    *counts = last;
+    return 0;
+  }
+  return -1;
+}
+
+void
+perfctr_release(pid_t pgid)
+{
+  struct job_counters *j = find_job(pgid);
+  if (!j) return;
+  sum_job(j, &last);
+  last_pgid = pgid;
+  for (size_t i = 0; i < j->proc_count * PERFCTR_EVENT_COUNT; ++i) {
+    if (j->fds[i] >= 0) close(j->fds[i]);
+  }
+  free(j->fds);
+  *j = jobs[--job_count];
+}
+
+void
+perfctr_print(int fd, struct perfctr_counts const *counts, char const *indent)
+{
+  for (int e = 0; e < PERFCTR_EVENT_COUNT; ++e) {
+    if (!(counts->valid & (1u << e))) continue;
+    dprintf(fd,
+            "%s%16" PRIu64 "  %s",
+            indent,
+            counts->value[e],
+            events[e].name);
+    if (e == PERFCTR_INSTRUCTIONS && counts->valid & (1u << PERFCTR_CYCLES) &&
+        counts->value[PERFCTR_CYCLES]) {
+      dprintf(fd,
+              "  (%.2f per cycle)",
+              (double)counts->value[e] / counts->value[PERFCTR_CYCLES]);
+    }
+    if (e == PERFCTR_CACHE_MISSES &&
+        counts->valid & (1u << PERFCTR_INSTRUCTIONS) &&
+        counts->value[PERFCTR_INSTRUCTIONS]) {
+      dprintf(fd,
+              "  (%.2f per 1k instructions)",
+              1000.0 * counts->value[e] / counts->value[PERFCTR_INSTRUCTIONS]);
+    }
+    dprintf(fd, "\n");
+  }
+}
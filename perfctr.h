@@ -0,0 +1,71 @@
+#pragma once
+/** @file Performance counters per job
+ *
+ * When BIGSHELL_PERF is set, every external command is started with
+ * perf_event_open(2) counters attached: cycles, instructions and cache
+ * misses where the hardware and perf_event_paranoid allow it, task-clock and
+ * page faults otherwise, and context switches in either case. Counters
+ * inherit into the command's own children and are summed over each job's
+ * processes; `jobs -l` shows them for running jobs and `time` for the
+ * pipeline it ran.
+ *
+ * So that nothing the command does is missed, the child blocks on a pipe
+ * until the shell has attached its counters, and the counters start at
+ * exec(), not counting the shell's own setup in the child.
+ */
+#include <stdint.h>
+#include <sys/types.h>
+
+enum perfctr_event {
+  PERFCTR_CYCLES,
+  PERFCTR_INSTRUCTIONS,
+  PERFCTR_CACHE_MISSES,
+  PERFCTR_TASK_CLOCK, /* ns */
+  PERFCTR_PAGE_FAULTS,
+  PERFCTR_CONTEXT_SWITCHES,
+  PERFCTR_EVENT_COUNT
+};
+
+struct perfctr_counts {
+  unsigned valid; /* bit i is set if value[i] was counted */
+  uint64_t value[PERFCTR_EVENT_COUNT];
+};
+
+/** nonzero if counters are attached to new jobs */
+extern int perfctr_enabled;
+
+/** Enables counters if BIGSHELL_PERF is set, and probes which events are
+ * available
+ *
+ * @returns 0 on success, -1 on failure
+ */
+extern int perfctr_init(void);
+
+/** Creates the pipe a child waits on before exec, if counters are enabled
+ *
+ * @param [out]sync set to the pipe, or to -1s when counters are disabled
+ * @returns 0 on success, -1 on failure
+ */
+extern int perfctr_sync_open(int sync[2]);
+
+/** In the child: blocks until the parent has attached counters */
+extern void perfctr_sync_wait(int sync[2]);
+
+/** In the parent: attaches counters to pid, a member of job pgid, then
+ * releases the child */
+extern void perfctr_attach(pid_t pgid, pid_t pid, int sync[2]);
+
+/** Sums the counters of job pgid, or of the most recently released job
+ *
+ * @returns 0 on success, -1 if there are no counters for pgid
+ */
+extern int perfctr_read(pid_t pgid, struct perfctr_counts *counts);
+
+/** Closes the counters of job pgid, which has finished, keeping its totals
+ * for perfctr_read() */
+extern void perfctr_release(pid_t pgid);
+
+/** Prints counts, one event per line, each line starting with indent */
+extern void perfctr_print(int fd,
+                          struct perfctr_counts const *counts,
+                          char const *indent);
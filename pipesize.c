@@ -0,0 +1,185 @@
+#define _GNU_SOURCE /* F_SETPIPE_SZ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pipesize.h"
+#include "stats.h"
+#include "util/trace.h"
+#include "vars.h"
+
+/* The size learned for pipes next to a command */
+struct learned {
+  char *name; /* null if the slot is free */
+  long size;
+  unsigned long used; /* when it was last looked up, for eviction */
+};
+
+/* A stage being watched until it is reaped */
+struct watched {
+  pid_t pid;
+  uint64_t start_ns;
+  char *name;
+};
+
+static struct learned learned[PIPESIZE_LEARNED_MAX];
+static unsigned long tick = 0;
+static struct watched *watched;
+static size_t watched_count = 0;
+
+/* Parses a PIPESIZE value; returns -2 if it is not valid */
+static long
+parse(char const *s)
+{
+  if (!*s) return 0;
+  if (strcmp(s, "auto") == 0) return PIPESIZE_AUTO;
+  char *end;
+  errno = 0;
+  long n = strtol(s, &end, 10);
+  if (errno || n < 0 || end == s) return -2;
+  long scale = 1;
+  if (*end == 'K' || *end == 'k') scale = 1024, ++end;
+  else if (*end == 'M' || *end == 'm') scale = 1024 * 1024, ++end;
+  if (*end || n > INT32_MAX / scale) return -2;
+  return n * scale;
+}
+
+long
+pipesize_setting(struct command const *cmd)
+{
+  char const *s = 0;
+  for (size_t i = 0; i < cmd->assignment_count; ++i) {
+    if (strcmp(cmd->assignments[i]->name, "PIPESIZE") == 0) {
+      s = cmd->assignments[i]->value;
+    }
+  }
+  if (!s) s = vars_get("PIPESIZE");
+  if (!s) return 0;
+  long const setting = parse(s);
+  if (setting == -2) {
+    fprintf(stderr, "PIPESIZE: `%s' is not a size or `auto'\n", s);
+    return 0;
+  }
+  return setting;
+}
+
+/* The most a pipe may hold without privileges */
+static long
+max_size(void)
+{
+  static long max = 0;
+  if (max) return max;
+  max = 1024 * 1024;
+  FILE *f = fopen("/proc/sys/fs/pipe-max-size", "re");
+  if (f) {
+    if (fscanf(f, "%ld", &max) != 1 || max < PIPESIZE_DEFAULT) {
+      max = 1024 * 1024;
+    }
+    fclose(f);
+  }
+  return max;
+}
+
+static struct learned *
+find(char const *name)
+{
+  for (size_t i = 0; i < PIPESIZE_LEARNED_MAX; ++i) {
+    if (learned[i].name && strcmp(learned[i].name, name) == 0) {
+      return &learned[i];
+    }
+  }
+  return 0;
+}
+
+static long
+size_for(char const *name)
+{
+  struct learned *l = name ? find(name) : 0;
+  if (!l) return 0;
+  l->used = ++tick;
+  return l->size;
+}
+
+void
+pipesize_apply(int fd, long setting, char const *writer, char const *reader)
+{
+  long size = setting;
+  if (setting == PIPESIZE_AUTO) {
+    long const w = size_for(writer), r = size_for(reader);
+    size = w > r ? w : r;
+  }
+  if (size <= 0) return;
+  if (fcntl(fd, F_SETPIPE_SZ, (int)size) < 0) {
+    trace(TRACE_SPAWN, "F_SETPIPE_SZ %ld: %s", size, strerror(errno));
+    return;
+  }
+  trace(TRACE_SPAWN,
+        "pipe from %s to %s holds %ld bytes",
+        writer ? writer : "<null>",
+        reader ? reader : "<null>",
+        size);
+}
+
+void
+pipesize_spawn(pid_t pid, char const *name, unsigned long long start_ns)
+{
+  if (!name) return;
+  char *copy = strdup(name);
+  if (!copy) return;
+  void *tmp = realloc(watched, sizeof *watched * (watched_count + 1));
+  if (!tmp) {
+    free(copy);
+    return;
+  }
+  watched = tmp;
+  watched[watched_count++] =
+      (struct watched){.pid = pid, .start_ns = start_ns, .name = copy};
+}
+
+/* Grows the size learned for name */
+static void
+grow(char const *name)
+{
+  struct learned *l = find(name);
+  if (!l) {
+    char *copy = strdup(name);
+    if (!copy) return;
+    /* A free slot, or the one least recently used */
+    l = &learned[0];
+    for (size_t i = 0; i < PIPESIZE_LEARNED_MAX && l->name; ++i) {
+      if (!learned[i].name || learned[i].used < l->used) l = &learned[i];
+    }
+    free(l->name);
+    *l = (struct learned){.name = copy, .size = PIPESIZE_DEFAULT};
+  }
+  long const max = max_size();
+  l->used = ++tick;
+  if (l->size >= max) return;
+  l->size = l->size < max / 4 ? l->size * 4 : max;
+  trace(TRACE_WAIT, "pipes next to %s now hold %ld bytes", name, l->size);
+}
+
+void
+pipesize_reap(pid_t pid, struct rusage const *ru)
+{
+  for (size_t i = 0; i < watched_count; ++i) {
+    struct watched w = watched[i];
+    if (w.pid != pid) continue;
+    watched[i] = watched[--watched_count];
+
+    double const life = (stats_now() - w.start_ns) / 1e9;
+    double const cpu = ru->ru_utime.tv_sec + ru->ru_utime.tv_usec / 1e6 +
+                       ru->ru_stime.tv_sec + ru->ru_stime.tv_usec / 1e6;
+    /* Blocked most of the time, and often rather than for long: waiting on
+     * its pipes, not sleeping or on a slow device */
+    if (life * 1000 >= PIPESIZE_MIN_LIFE_MS && cpu < life / 2 &&
+        ru->ru_nvcsw >= life * PIPESIZE_BLOCKED_RATE) {
+      grow(w.name);
+    }
+    free(w.name);
+    return;
+  }
+}
@@ -0,0 +1,51 @@
+#pragma once
+/** @file Pipe buffer sizes
+ *
+ * A pipe holds 64 KiB by default, so stages that move a lot of data through
+ * it, such as `zstd -d | parse`, switch back and forth every 64 KiB. The
+ * shell variable PIPESIZE sets the size of the pipes the shell creates,
+ * with F_SETPIPE_SZ: a byte count, optionally suffixed with K or M, or
+ * `auto`. An assignment on the first command of a pipeline,
+ * `PIPESIZE=1M zstd -d big.zst | parse`, applies to that pipeline's pipes.
+ *
+ * With `auto`, pipes start at the default size, and a pipeline stage that
+ * is reaped having spent most of its life blocked, switching out more than
+ * PIPESIZE_BLOCKED_RATE times a second, has the pipes of its later runs
+ * (next to a command of the same name) grown fourfold, up to
+ * /proc/sys/fs/pipe-max-size.
+ */
+#include <sys/resource.h>
+#include <sys/types.h>
+
+#include "parser.h"
+
+#define PIPESIZE_AUTO (-1)
+#define PIPESIZE_DEFAULT (64 * 1024)
+#define PIPESIZE_LEARNED_MAX 32 /* commands whose sizes are remembered */
+#define PIPESIZE_MIN_LIFE_MS 100 /* shorter stages teach nothing */
+#define PIPESIZE_BLOCKED_RATE 100 /* voluntary switches per second */
+
+/** The pipe size setting for the pipeline that starts with cmd, from an
+ * assignment to PIPESIZE on cmd, or else from $PIPESIZE
+ *
+ * @returns a size in bytes, 0 for the default, or PIPESIZE_AUTO
+ */
+extern long pipesize_setting(struct command const *cmd);
+
+/** Sizes the pipe fd between commands writer and reader
+ *
+ * @param [in]setting the pipeline's pipesize_setting()
+ */
+extern void pipesize_apply(int fd,
+                           long setting,
+                           char const *writer,
+                           char const *reader);
+
+/** Watches process pid, a stage of a pipeline with the auto setting, which
+ * runs command name and was started at start_ns (see stats_now()) */
+extern void pipesize_spawn(pid_t pid,
+                           char const *name,
+                           unsigned long long start_ns);
+
+/** Learns from process pid, if it is watched, once it has terminated */
+extern void pipesize_reap(pid_t pid, struct rusage const *ru);
@@ -0,0 +1,180 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+
+#include "profile.h"
+#include "runner.h"
+#include "stats.h"
+
+struct line_profile {
+  size_t lineno;
+  unsigned long calls;
+  unsigned long forks;
+  uint64_t wall_ns;
+  uint64_t child_cpu_us;
+  char *text;
+};
+
+static struct {
+  int enabled;
+  char *path;
+  char *script;
+  struct line_profile *lines; /* indexed by line number */
+  size_t line_count;
+
+  /* State of the command list currently running */
+  struct command_list const *current; /* null between lists */
+  uint64_t start_ns;
+  uint64_t start_cpu_us;
+  unsigned long start_forks;
+} prof;
+
+static uint64_t
+children_cpu_us(void)
+{
+  struct rusage ru;
+  if (getrusage(RUSAGE_CHILDREN, &ru) < 0) return 0;
+  return (uint64_t)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000 +
+         ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+/* Folded stack frames are separated by ';' and end at the last space */
+static void
+sanitize_frame(char *s)
+{
+  for (; *s; ++s) {
+    if (*s == ';') *s = ',';
+    else if (*s == '\n' || *s == '\t') *s = ' ';
+  }
+}
+
+int
+profile_start(char const *path, char const *script)
+{
+  prof.path = strdup(path);
+  prof.script = strdup(script);
+  if (!prof.path || !prof.script) return -1;
+  sanitize_frame(prof.script);
+  prof.enabled = 1;
+  return 0;
+}
+
+void
+profile_begin(struct command_list const *cl)
+{
+  if (!prof.enabled) return;
+  prof.current = cl;
+  prof.start_forks = runner_forks;
+  prof.start_cpu_us = children_cpu_us();
+  prof.start_ns = stats_now();
+}
+
+void
+profile_end(struct command_list const *cl)
+{
+  if (!prof.enabled) return;
+  prof.current = 0;
+  uint64_t const wall = stats_now() - prof.start_ns;
+  uint64_t const cpu = children_cpu_us() - prof.start_cpu_us;
+
+  if (cl->lineno >= prof.line_count) {
+    size_t count = prof.line_count ? prof.line_count : 64;
+    while (count <= cl->lineno) count *= 2;
+    void *tmp = realloc(prof.lines, sizeof *prof.lines * count);
+    if (!tmp) return;
+    prof.lines = tmp;
+    memset(prof.lines + prof.line_count,
+           0,
+           sizeof *prof.lines * (count - prof.line_count));
+    prof.line_count = count;
+  }
+
+  struct line_profile *lp = &prof.lines[cl->lineno];
+  if (!lp->text) {
+    size_t len = 0;
+    FILE *f = open_memstream(&lp->text, &len);
+    if (f) {
+      command_list_print(cl, f);
+      fclose(f);
+      /* Drop the implicit trailing ';' */
+      if (len && lp->text[len - 1] == ';') lp->text[--len] = '\0';
+      while (len && lp->text[len - 1] == ' ') lp->text[--len] = '\0';
+      sanitize_frame(lp->text);
+    }
+  }
+  lp->lineno = cl->lineno;
+  ++lp->calls;
+  lp->wall_ns += wall;
+  lp->child_cpu_us += cpu;
+  lp->forks += runner_forks - prof.start_forks;
+}
+
+static int
+by_wall_desc(void const *a, void const *b)
+{
+  struct line_profile const *x = a, *y = b;
+  return (x->wall_ns < y->wall_ns) - (x->wall_ns > y->wall_ns);
+}
+
+void
+profile_finish(void)
+{
+  if (!prof.enabled) return;
+  /* A list that ends the shell, as `make; exit` does, never gets to
+   * profile_end() */
+  if (prof.current) profile_end(prof.current);
+  prof.enabled = 0;
+
+  /* Compact to the lines that ran */
+  size_t n = 0;
+  for (size_t i = 0; i < prof.line_count; ++i) {
+    if (prof.lines[i].calls) prof.lines[n++] = prof.lines[i];
+  }
+
+  FILE *out = fopen(prof.path, "w");
+  if (out) {
+    for (size_t i = 0; i < n; ++i) {
+      struct line_profile const *lp = &prof.lines[i];
+      fprintf(out,
+              "%s;line %zu: %s %llu\n",
+              prof.script,
+              lp->lineno,
+              lp->text ? lp->text : "",
+              (unsigned long long)(lp->wall_ns / 1000));
+    }
+    fclose(out);
+  } else {
+    perror(prof.path);
+  }
+
+  qsort(prof.lines, n, sizeof *prof.lines, by_wall_desc);
+  fprintf(stderr,
+          "%8s %8s %12s %12s %8s  %s\n",
+          "line",
+          "calls",
+          "wall(ms)",
+          "childcpu(ms)",
+          "forks",
+          "command");
+  for (size_t i = 0; i < n; ++i) {
+    struct line_profile const *lp = &prof.lines[i];
+    fprintf(stderr,
+            "%8zu %8lu %12.3f %12.3f %8lu  %s\n",
+            lp->lineno,
+            lp->calls,
+            lp->wall_ns / 1e6,
+            lp->child_cpu_us / 1e3,
+            lp->forks,
+            lp->text ? lp->text : "");
+  }
+
+  for (size_t i = 0; i < n; ++i) free(prof.lines[i].text);
+  free(prof.lines);
+  free(prof.path);
+  free(prof.script);
+  prof.lines = 0;
+  prof.line_count = 0;
+}
@@ -0,0 +1,27 @@
+#pragma once
+/** @file Script profiler
+ *
+ * Records, for every source line that starts a command list, how often it
+ * ran, the wall time it took, the CPU time of the children reaped while it
+ * ran, and the number of processes it forked. The results are written when
+ * the shell exits: as folded stacks ("script;line N: text value") for
+ * flamegraph tools, and as a table sorted by wall time on stderr.
+ */
+#include "parser.h"
+
+/** Starts profiling
+ *
+ * @param [in]path file that receives the folded stacks at exit
+ * @param [in]script name of the script, used as the root frame
+ * @returns 0 on success, -1 on failure
+ */
+extern int profile_start(char const *path, char const *script);
+
+/** Marks the start of a command list's execution */
+extern void profile_begin(struct command_list const *cl);
+
+/** Marks the end of a command list's execution */
+extern void profile_end(struct command_list const *cl);
+
+/** Writes out the results; does nothing if profiling was never started */
+extern void profile_finish(void);
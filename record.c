@@ -0,0 +1,454 @@
+#define _GNU_SOURCE /* fopencookie() */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "params.h"
+#include "record.h"
+#include "stats.h"
+
+#define MAGIC "bigshell-rec1\n"
+#define BUF_SIZE (64 * 1024)
+
+/* A decoded log record; ts_us is the time since the start of the session */
+struct record {
+  char type;
+  uint64_t ts_us;
+  union {
+    struct {
+      unsigned char const *bytes;
+      size_t len;
+    } input;
+    struct {
+      uint64_t duration_us;
+      uint64_t status;
+      uint64_t cpu_us;
+    } command;
+  };
+};
+
+/* One row of the replay report */
+struct result {
+  char *text;
+  uint64_t duration_us;
+  int status;
+  uint64_t cpu_us;
+  struct record const *recorded; /* 0 if the session ran more commands */
+};
+
+static enum { OFF, RECORDING, REPLAYING } mode = OFF;
+
+/* Timing of the command list that is running */
+static uint64_t begin_ns;
+static uint64_t begin_cpu_us;
+
+/* Recording */
+static FILE *source;
+static int log_fd = -1;
+static pid_t owner; /* forked children must not write the shell's buffer */
+static unsigned char buf[BUF_SIZE];
+static size_t buf_len = 0;
+static uint64_t last_ns; /* time of the previous record */
+
+/* Replay */
+static unsigned char *log_data;
+static struct record *records;
+static size_t record_count = 0;
+static size_t next_input = 0;   /* cursor over the 'I' records */
+static size_t next_command = 0; /* cursor over the 'C' records */
+static size_t input_off = 0;    /* bytes of records[next_input] consumed */
+static int fast;
+static struct {
+  uint64_t rec_us;  /* recorded time of the last event replayed */
+  uint64_t real_ns; /* stats_now() when it was replayed */
+} anchor;
+static struct result *results;
+static size_t result_count = 0;
+
+static uint64_t
+self_cpu_us(void)
+{
+  struct rusage ru;
+  if (getrusage(RUSAGE_SELF, &ru) < 0) return 0;
+  return (uint64_t)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000 +
+         ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+static void
+flush(void)
+{
+  if (!buf_len || getpid() != owner) return;
+  for (size_t off = 0; off < buf_len;) {
+    ssize_t n = write(log_fd, buf + off, buf_len - off);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      break; /* drop the records rather than stall the shell */
+    }
+    off += n;
+  }
+  buf_len = 0;
+}
+
+static void
+put_bytes(void const *p, size_t len)
+{
+  if (buf_len + len > BUF_SIZE) flush();
+  if (len > BUF_SIZE) {
+    write(log_fd, p, len);
+    return;
+  }
+  memcpy(buf + buf_len, p, len);
+  buf_len += len;
+}
+
+static void
+put_varint(uint64_t v)
+{
+  unsigned char b[10];
+  size_t n = 0;
+  do {
+    b[n] = v & 0x7f;
+    v >>= 7;
+    if (v) b[n] |= 0x80;
+    ++n;
+  } while (v);
+  put_bytes(b, n);
+}
+
+/* Starts a record of the given type, stamped with the current time */
+static void
+put_header(char type)
+{
+  uint64_t const now = stats_now();
+  put_bytes(&type, 1);
+  put_varint((now - last_ns) / 1000);
+  last_ns = now;
+}
+
+static ssize_t
+record_read(void *cookie, char *p, size_t size)
+{
+  /* Nobody is waiting on the shell while it waits on its input */
+  flush();
+  ssize_t n;
+  if (fileno(source) < 0) { /* -c, or the line editor */
+    if (fgets(p, size, source)) {
+      n = strlen(p);
+    } else {
+      n = ferror(source) ? -1 : 0;
+      clearerr(source);
+    }
+  } else {
+    do {
+      n = read(fileno(source), p, size);
+    } while (n < 0 && errno == EINTR && !is_interactive);
+  }
+  if (n > 0) {
+    put_header('I');
+    put_varint(n);
+    put_bytes(p, n);
+  }
+  return n;
+}
+
+FILE *
+record_open(char const *path, FILE *input)
+{
+  log_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+  if (log_fd < 0) return 0;
+  FILE *f = fopencookie(0, "r", (cookie_io_functions_t){.read = record_read});
+  if (!f) {
+    close(log_fd);
+    log_fd = -1;
+    return 0;
+  }
+  source = input;
+  owner = getpid();
+  last_ns = stats_now();
+  put_bytes(MAGIC, sizeof MAGIC - 1);
+  mode = RECORDING;
+  return f;
+}
+
+/* Decodes a varint at *pos, which is advanced; returns -1 if truncated */
+static int
+get_varint(unsigned char const *data, size_t len, size_t *pos, uint64_t *v)
+{
+  *v = 0;
+  for (unsigned shift = 0; *pos < len && shift < 64; shift += 7) {
+    unsigned char const b = data[(*pos)++];
+    *v |= (uint64_t)(b & 0x7f) << shift;
+    if (!(b & 0x80)) return 0;
+  }
+  return -1;
+}
+
+/* Splits the log into records */
+static int
+decode(unsigned char const *data, size_t len)
+{
+  size_t pos = sizeof MAGIC - 1;
+  size_t cap = 0;
+  uint64_t ts_us = 0;
+  while (pos < len) {
+    if (record_count == cap) {
+      cap = cap ? cap * 2 : 256;
+      void *tmp = realloc(records, sizeof *records * cap);
+      if (!tmp) return -1;
+      records = tmp;
+    }
+    struct record *r = &records[record_count];
+    uint64_t delta, n;
+    r->type = data[pos++];
+    if (get_varint(data, len, &pos, &delta) < 0) goto bad;
+    r->ts_us = ts_us += delta;
+    switch (r->type) {
+      case 'I':
+        if (get_varint(data, len, &pos, &n) < 0 || n > len - pos) goto bad;
+        r->input.bytes = data + pos;
+        r->input.len = n;
+        pos += n;
+        break;
+      case 'C':
+        if (get_varint(data, len, &pos, &r->command.duration_us) < 0 ||
+            get_varint(data, len, &pos, &r->command.status) < 0 ||
+            get_varint(data, len, &pos, &r->command.cpu_us) < 0) {
+          goto bad;
+        }
+        break;
+      default:
+        goto bad;
+    }
+    ++record_count;
+  }
+  return 0;
+bad:
+  errno = EINVAL;
+  return -1;
+}
+
+/* Moves the replay's reference point to a recorded event that just
+ * happened again */
+static void
+set_anchor(uint64_t rec_us)
+{
+  if (rec_us < anchor.rec_us) return;
+  anchor.rec_us = rec_us;
+  anchor.real_ns = stats_now();
+}
+
+static ssize_t
+replay_read(void *cookie, char *p, size_t size)
+{
+  while (next_input < record_count && records[next_input].type != 'I') {
+    ++next_input;
+  }
+  if (next_input == record_count) return 0;
+  struct record const *r = &records[next_input];
+
+  if (input_off == 0 && !fast && r->ts_us > anchor.rec_us) {
+    /* Wait as long after the last replayed event as was recorded */
+    uint64_t const due = anchor.real_ns + (r->ts_us - anchor.rec_us) * 1000;
+    struct timespec ts = {.tv_sec = due / 1000000000,
+                          .tv_nsec = due % 1000000000};
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, 0) == EINTR);
+  }
+  if (input_off == 0) set_anchor(r->ts_us);
+
+  size_t n = r->input.len - input_off;
+  if (n > size) n = size;
+  memcpy(p, r->input.bytes + input_off, n);
+  input_off += n;
+  if (input_off == r->input.len) {
+    ++next_input;
+    input_off = 0;
+  }
+  return n;
+}
+
+FILE *
+record_replay(char const *path, int fast_)
+{
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return 0;
+  struct stat st;
+  if (fstat(fd, &st) < 0) goto err;
+  size_t const len = st.st_size;
+  log_data = malloc(len ? len : 1);
+  if (!log_data) goto err;
+  for (size_t off = 0; off < len;) {
+    ssize_t n = read(fd, log_data + off, len - off);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) {
+      if (n == 0) errno = EINVAL;
+      goto err;
+    }
+    off += n;
+  }
+  close(fd);
+  fd = -1;
+  if (len < sizeof MAGIC - 1 || memcmp(log_data, MAGIC, sizeof MAGIC - 1)) {
+    errno = EINVAL;
+    goto err;
+  }
+  if (decode(log_data, len) < 0) goto err;
+
+  FILE *f = fopencookie(0, "r", (cookie_io_functions_t){.read = replay_read});
+  if (!f) goto err;
+  fast = fast_;
+  anchor.real_ns = stats_now();
+  mode = REPLAYING;
+  return f;
+
+err:;
+  int const saved = errno;
+  if (fd >= 0) close(fd);
+  free(log_data);
+  free(records);
+  log_data = 0;
+  records = 0;
+  record_count = 0;
+  errno = saved;
+  return 0;
+}
+
+void
+record_begin(struct command_list const *cl)
+{
+  if (mode == OFF) return;
+  begin_cpu_us = self_cpu_us();
+  begin_ns = stats_now();
+}
+
+/* Adds the replayed figures of cl to the report */
+static void
+add_result(struct command_list const *cl,
+           uint64_t duration_us,
+           uint64_t cpu_us)
+{
+  void *tmp = realloc(results, sizeof *results * (result_count + 1));
+  if (!tmp) return;
+  results = tmp;
+  struct result *res = &results[result_count++];
+  *res = (struct result){.duration_us = duration_us,
+                         .status = params.status,
+                         .cpu_us = cpu_us};
+
+  while (next_command < record_count && records[next_command].type != 'C') {
+    ++next_command;
+  }
+  if (next_command < record_count) {
+    res->recorded = &records[next_command++];
+    set_anchor(res->recorded->ts_us);
+  }
+
+  size_t len = 0;
+  FILE *f = open_memstream(&res->text, &len);
+  if (f) {
+    command_list_print(cl, f);
+    fclose(f);
+    /* Drop the implicit trailing ';' */
+    if (len && res->text[len - 1] == ';') res->text[--len] = '\0';
+    while (len && res->text[len - 1] == ' ') res->text[--len] = '\0';
+  }
+}
+
+void
+record_end(struct command_list const *cl)
+{
+  if (mode == OFF) return;
+  uint64_t const duration_us = (stats_now() - begin_ns) / 1000;
+  uint64_t const cpu_us = self_cpu_us() - begin_cpu_us;
+  if (mode == RECORDING) {
+    put_header('C');
+    put_varint(duration_us);
+    put_varint(params.status);
+    put_varint(cpu_us);
+  } else {
+    add_result(cl, duration_us, cpu_us);
+  }
+}
+
+static void
+print_report(void)
+{
+  uint64_t rec_wall = 0, rec_cpu = 0, wall = 0, cpu = 0;
+  unsigned mismatches = 0;
+  fprintf(stderr,
+          "%6s %12s %12s %10s %10s %7s  %s\n",
+          "#",
+          "rec(ms)",
+          "replay(ms)",
+          "rec-sh(us)",
+          "shell(us)",
+          "status",
+          "command");
+  for (size_t i = 0; i < result_count; ++i) {
+    struct result const *res = &results[i];
+    struct record const *r = res->recorded;
+    char rec_ms[32] = "-", rec_sh[32] = "-";
+    if (r) {
+      snprintf(rec_ms, sizeof rec_ms, "%.3f", r->command.duration_us / 1e3);
+      snprintf(rec_sh,
+               sizeof rec_sh,
+               "%llu",
+               (unsigned long long)r->command.cpu_us);
+      rec_wall += r->command.duration_us;
+      rec_cpu += r->command.cpu_us;
+    }
+    /* A different status means the replay did not do the same work */
+    int const differs = !r || r->command.status != (uint64_t)res->status;
+    mismatches += differs;
+    wall += res->duration_us;
+    cpu += res->cpu_us;
+    fprintf(stderr,
+            "%6zu %12s %12.3f %10s %10llu %6d%c  %s\n",
+            i + 1,
+            rec_ms,
+            res->duration_us / 1e3,
+            rec_sh,
+            (unsigned long long)res->cpu_us,
+            res->status,
+            differs ? '*' : ' ',
+            res->text ? res->text : "");
+  }
+  fprintf(stderr,
+          "%6s %12.3f %12.3f %10llu %10llu\n",
+          "total",
+          rec_wall / 1e3,
+          wall / 1e3,
+          (unsigned long long)rec_cpu,
+          (unsigned long long)cpu);
+  if (mismatches) {
+    fprintf(stderr,
+            "%u command lists (*) did not end as recorded\n",
+            mismatches);
+  }
+}
+
+void
+record_finish(void)
+{
+  if (mode == RECORDING) {
+    flush();
+    if (getpid() == owner) close(log_fd);
+    log_fd = -1;
+  } else if (mode == REPLAYING) {
+    print_report();
+    for (size_t i = 0; i < result_count; ++i) free(results[i].text);
+    free(results);
+    free(records);
+    free(log_data);
+    results = 0;
+    records = 0;
+    log_data = 0;
+  }
+  mode = OFF;
+}
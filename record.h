@@ -0,0 +1,52 @@
+#pragma once
+/** @file Session record and replay
+ *
+ * `bigshell --record log` copies everything the shell reads into a binary
+ * log, timestamped, together with the duration, exit status and shell CPU
+ * time of every command list it runs. `bigshell --replay log` feeds the
+ * recorded input back to a fresh shell, with the recorded pauses between
+ * inputs or, with --fast, as fast as it is read, and prints a table of the
+ * recorded and replayed figures for each command list on stderr at exit.
+ *
+ * The shell CPU time (RUSAGE_SELF, excluding children) is the cost of the
+ * parser, expander and runner themselves, so a replay of a production
+ * session is a benchmark of them.
+ *
+ * The log is a magic string followed by records, all integers unsigned
+ * LEB128 varints:
+ *
+ *   'I' delta_us len bytes               input that was read
+ *   'C' delta_us duration_us status cpu_us  a command list that finished
+ *
+ * where delta_us is the time since the previous record, or since the shell
+ * started for the first one. A replaying shell is never interactive.
+ */
+#include <stdio.h>
+
+#include "parser.h"
+
+/** Starts recording to path
+ *
+ * @param [in]path file that receives the log
+ * @param [in]input stream the shell would read from
+ * @returns a stream that reads input and records it, or 0 on failure
+ */
+extern FILE *record_open(char const *path, FILE *input);
+
+/** Loads the log at path for replay
+ *
+ * @param [in]path log written by a recording shell
+ * @param [in]fast nonzero to ignore the recorded pauses
+ * @returns a stream that reads the recorded input, or 0 on failure
+ */
+extern FILE *record_replay(char const *path, int fast);
+
+/** Marks the start of a command list's execution */
+extern void record_begin(struct command_list const *cl);
+
+/** Marks the end of a command list's execution */
+extern void record_end(struct command_list const *cl);
+
+/** Writes out the log, or the replay report; does nothing if neither was
+ * started */
+extern void record_finish(void);
@@ -0,0 +1,59 @@
+#define _GNU_SOURCE /* mremap(), mallinfo2(), malloc_trim() */
+#include <malloc.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "region.h"
+
+static size_t
+round_up(size_t size)
+{
+  static size_t page = 0;
+  if (!page) page = sysconf(_SC_PAGESIZE);
+  return (size + page - 1) & ~(page - 1);
+}
+
+void *
+region_alloc(size_t size)
+{
+  if (!size) return 0;
+  size = round_up(size);
+  void *p =
+      mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) return 0;
+  /* Kernels before 4.14 lack it; the region is then copied like the heap */
+  madvise(p, size, MADV_WIPEONFORK);
+  return p;
+}
+
+void *
+region_resize(void *p, size_t old_size, size_t size)
+{
+  if (!p) return region_alloc(size);
+  old_size = round_up(old_size);
+  size = round_up(size);
+  if (size == old_size) return p;
+  /* The mapping keeps its advice when it grows or moves */
+  void *q = mremap(p, old_size, size, MREMAP_MAYMOVE);
+  return q == MAP_FAILED ? 0 : q;
+}
+
+void
+region_free(void *p, size_t size)
+{
+  if (p) munmap(p, round_up(size));
+}
+
+void
+region_dontfork(void *p, size_t size)
+{
+  if (p) madvise(p, round_up(size), MADV_DONTFORK);
+}
+
+void
+region_trim(void)
+{
+  struct mallinfo2 const mi = mallinfo2();
+  if (mi.fordblks >= REGION_TRIM_THRESHOLD) malloc_trim(0);
+}
@@ -0,0 +1,42 @@
+#pragma once
+/** @file Memory kept out of forked children
+ *
+ * fork() copies the page table entries of every page the shell has touched,
+ * so a cache that grows the shell also slows the start of every command.
+ * Caches that only the shell itself reads (the history index, the command
+ * trie and directory listings, the sampler's stack table) live instead in
+ * anonymous mappings of their own, marked MADV_WIPEONFORK: fork() copies
+ * nothing for them, and a child that looked would see zeros. The history
+ * file's mapping is shared, and is marked MADV_DONTFORK instead.
+ *
+ * A command that leaves much of the heap free, such as a large expansion,
+ * is followed by region_trim(), which gives the free pages back to the
+ * kernel so that the next fork() does not copy them either.
+ */
+#include <stddef.h>
+
+/* Free heap bytes that make region_trim() trim */
+#define REGION_TRIM_THRESHOLD (4 * 1024 * 1024)
+
+/** Maps a zero-filled region of size bytes
+ *
+ * @returns the region, or null on failure
+ */
+extern void *region_alloc(size_t size);
+
+/** Resizes a region of old_size bytes (or none, if p is null) to size
+ * bytes, moving it if need be; new bytes are zero
+ *
+ * @returns the region, or null on failure, leaving p as it was
+ */
+extern void *region_resize(void *p, size_t old_size, size_t size);
+
+/** Unmaps a region of size bytes; p may be null */
+extern void region_free(void *p, size_t size);
+
+/** Keeps a mapping made elsewhere out of forked children, which must never
+ * touch it */
+extern void region_dontfork(void *p, size_t size);
+
+/** Returns free heap memory to the kernel, if there is a lot of it */
+extern void region_trim(void);
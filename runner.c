@@ -5,24 +5,39 @@
 #include <fcntl.h>
 #include <limits.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
 #include <unistd.h>
 #include <wait.h>
 
+#include "admit.h"
+#include "alloc.h"
 #include "builtins.h"
+#include "cgroup.h"
+#include "execlog.h"
 #include "exit.h"
 #include "expand.h"
+#include "fdcache.h"
 #include "jobs.h"
+#include "lineedit.h"
 #include "params.h"
 #include "parser.h"
+#include "perfctr.h"
+#include "pipesize.h"
 #include "signal.h"
-#include "util/gprintf.h"
+#include "stats.h"
+#include "statsock.h"
+#include "util/probe.h"
+#include "util/trace.h"
 #include "vars.h"
 #include "wait.h"
 
 #include "runner.h"
 
+unsigned long runner_forks = 0;
+
 /* Expands all the command words in a command
  *
  * This is:
@@ -56,6 +71,77 @@ expand_command_words(struct command *cmd)
   return 0;
 }
 
+/* Reports errno and exits a forked child
+ *
+ * Children must use _exit(), not exit(): exit() flushes stdio streams
+ * shared with the shell, and for a script read through stdio that seeks the
+ * shell's input back to where it was at fork(), replaying commands.
+ */
+static _Noreturn void
+child_fail(int status)
+{
+  warn(0);
+  _exit(status);
+}
+
+/* Timer for a pipeline prefixed with the time keyword */
+struct pipeline_timer {
+  int active;
+  uint64_t start_ns;
+  struct rusage self, children;
+};
+
+/* Strips a leading time keyword from cmd and starts the timer
+ *
+ * Like a reserved word, time is only recognized unquoted, before expansion.
+ */
+static void
+time_start(struct pipeline_timer *t, struct command *cmd)
+{
+  if (!cmd->word_count || strcmp(cmd->words[0], "time") != 0) return;
+  alloc_free(cmd->words[0]);
+  /* Also moves the null pointer that terminates the words */
+  memmove(&cmd->words[0], &cmd->words[1], sizeof *cmd->words * cmd->word_count);
+  --cmd->word_count;
+  t->active = 1;
+  getrusage(RUSAGE_SELF, &t->self);
+  getrusage(RUSAGE_CHILDREN, &t->children);
+  t->start_ns = stats_now();
+}
+
+static double
+tv_diff(struct timeval const *end, struct timeval const *start)
+{
+  return (end->tv_sec - start->tv_sec) + (end->tv_usec - start->tv_usec) / 1e6;
+}
+
+/* Reports the time, and the counters if any, of the pipeline in pgid */
+static void
+time_report(struct pipeline_timer *t, pid_t pgid)
+{
+  double const real = (stats_now() - t->start_ns) / 1e9;
+  struct rusage self, children;
+  getrusage(RUSAGE_SELF, &self);
+  getrusage(RUSAGE_CHILDREN, &children);
+  double const user = tv_diff(&self.ru_utime, &t->self.ru_utime) +
+                      tv_diff(&children.ru_utime, &t->children.ru_utime);
+  double const sys = tv_diff(&self.ru_stime, &t->self.ru_stime) +
+                     tv_diff(&children.ru_stime, &t->children.ru_stime);
+  fprintf(stderr,
+          "\nreal\t%dm%.3fs\nuser\t%dm%.3fs\nsys\t%dm%.3fs\n",
+          (int)(real / 60),
+          real - 60 * (int)(real / 60),
+          (int)(user / 60),
+          user - 60 * (int)(user / 60),
+          (int)(sys / 60),
+          sys - 60 * (int)(sys / 60));
+  struct perfctr_counts counts;
+  if (pgid && perfctr_read(pgid, &counts) == 0) {
+    perfctr_print(STDERR_FILENO, &counts, "");
+  }
+  t->active = 0;
+}
+
 /** Performs variable assignments before running a command
  *
  * @param cmd        the command to be executed
@@ -70,8 +156,10 @@ do_variable_assignment(struct command const *cmd, int export_all)
     for (size_t i = 0; i < cmd->assignment_count; ++i) {
         struct assignment* a = cmd->assignments[i];
 
-        // Attempt to set the variable
-        if (vars_set(a->name, a->value) != 0) {
+        // Attempt to set (or append to) the variable
+        int const res = a->append ? vars_append(a->name, a->value)
+                                  : vars_set(a->name, a->value);
+        if (res != 0) {
             return -1; // Return immediately if assignment fails
         }
 
@@ -146,6 +234,7 @@ move_fd(int src, int dst)
  * @param [in]cmd the command we are performing redirections for.
  * @param [out]redir_list a virtual file descriptor table on top of the shell's
  * own file descriptors.
+ * @param [in]use_cache nonzero if cached descriptors may stand in for files
  *
  * This function performs all of the normal i/o redirection, but doesn't
  * overwrite any existing open files. Instead, it performs virtual redirections,
@@ -164,7 +253,9 @@ move_fd(int src, int dst)
  * XXX DO NOT MODIFY XXX
  */
 static int
-do_builtin_io_redirects(struct command *cmd, struct builtin_redir **redir_list)
+do_builtin_io_redirects(struct command *cmd,
+                        struct builtin_redir **redir_list,
+                        int use_cache)
 {
   int status = 0;
   for (size_t i = 0; i < cmd->io_redir_count; ++i) {
@@ -186,7 +277,7 @@ do_builtin_io_redirects(struct command *cmd, struct builtin_redir **redir_list)
           }
         }
         if (rec == 0) {
-          rec = malloc(sizeof *rec);
+          rec = alloc_malloc(ALLOC_RUNNER, sizeof *rec);
           if (!rec) goto err;
           rec->pseudofd = r->io_number;
           rec->realfd = -1;
@@ -216,7 +307,7 @@ do_builtin_io_redirects(struct command *cmd, struct builtin_redir **redir_list)
             }
           }
           if (rec == 0) {
-            rec = malloc(sizeof *rec);
+            rec = alloc_malloc(ALLOC_RUNNER, sizeof *rec);
             if (!rec) goto err;
             rec->pseudofd = r->io_number;
             rec->realfd = dup(src);
@@ -230,9 +321,10 @@ do_builtin_io_redirects(struct command *cmd, struct builtin_redir **redir_list)
     } else {
     file_open:;
       int flags = get_io_flags(r->io_op);
-      gprintf("attempting to open file %s with flags %d", r->filename, flags);
+      trace(TRACE_SPAWN, "attempting to open file %s with flags %d", r->filename, flags);
       /* TODO Open the specified file. */
-      int fd = open(r->filename, flags, 0777);
+      int const cached = use_cache ? fdcache_get(r->filename, flags) : -1;
+      int fd = cached >= 0 ? dup(cached) : open(r->filename, flags, 0777);
       if (fd < 0) goto err;
       struct builtin_redir *rec = *redir_list;
       for (; rec; rec = rec->next) {
@@ -242,7 +334,7 @@ do_builtin_io_redirects(struct command *cmd, struct builtin_redir **redir_list)
         }
       }
       if (rec == 0) {
-        rec = malloc(sizeof *rec);
+        rec = alloc_malloc(ALLOC_RUNNER, sizeof *rec);
         if (!rec) goto err;
         rec->pseudofd = r->io_number;
         rec->realfd = fd;
@@ -261,6 +353,7 @@ do_builtin_io_redirects(struct command *cmd, struct builtin_redir **redir_list)
 /** perform the main task of io redirection (for non-builtin commands)
  *
  * @param [in]cmd the command we are performing redirections for.
+ * @param [in]use_cache nonzero if cached descriptors may stand in for files
  * @returns 0 on success, -1 on failure
  *
  * Unlike the builtin redirections, this is straightforward, because it
@@ -270,7 +363,7 @@ do_builtin_io_redirects(struct command *cmd, struct builtin_redir **redir_list)
  * TODO
  */
 static int
-do_io_redirects(struct command* cmd)
+do_io_redirects(struct command* cmd, int use_cache)
 {
     int status = 0;
 
@@ -326,7 +419,15 @@ do_io_redirects(struct command* cmd)
         else {
         file_open:;
             int flags = get_io_flags(r->io_op);
-            gprintf("attempting to open file %s with flags %d", r->filename, flags);
+
+            /* A cached descriptor takes a single dup2(), which also clears
+             * its close-on-exec flag in the target */
+            int const cached = use_cache ? fdcache_get(r->filename, flags) : -1;
+            if (cached >= 0) {
+                if (dup2(cached, r->io_number) < 0) goto err;
+                continue;
+            }
+            trace(TRACE_SPAWN, "attempting to open file %s with flags %d", r->filename, flags);
 
             /* Open the specified file with the appropriate flags and mode
              *
@@ -355,8 +456,70 @@ err: /* Anything that can fail should jump here. No silent errors!!! */
 }
 
 
-int
-run_command_list(struct command_list *cl)
+/* Closes the pipe a child waits on for its counters, when they will never
+ * be attached; the child goes on at once */
+static void
+close_perf_sync(int sync[2])
+{
+  if (sync[0] < 0) return;
+  close(sync[0]);
+  close(sync[1]);
+}
+
+/* Queues the background pipeline that starts at cl->commands[*i], whose
+ * first command has been expanded, if it has to wait for the host to be
+ * less busy (see admit.h); returns 1 and moves *i to the pipeline's last
+ * command if so
+ *
+ * The queued commands are moved out of cl, which keeps their control
+ * operators only. */
+static int
+defer_pipeline(struct command_list *cl, size_t *i)
+{
+  size_t end = *i;
+  while (end + 1 < cl->command_count && cl->commands[end]->ctrl_op == '|') {
+    ++end;
+  }
+  if (cl->commands[end]->ctrl_op != '&') return 0;
+  if (!admit_should_defer(cl->commands[*i])) return 0;
+
+  size_t const count = end - *i + 1;
+  struct command_list *deferred = alloc_malloc(ALLOC_RUNNER, sizeof *deferred);
+  if (!deferred) return 0;
+  *deferred = (struct command_list){.lineno = cl->lineno};
+  deferred->commands =
+      alloc_malloc(ALLOC_RUNNER, sizeof *deferred->commands * count);
+  if (!deferred->commands) goto err;
+  for (; deferred->command_count < count; ++deferred->command_count) {
+    struct command *cmd = alloc_malloc(ALLOC_RUNNER, sizeof *cmd);
+    if (!cmd) goto err;
+    deferred->commands[deferred->command_count] = cmd;
+  }
+
+  for (size_t k = 0; k < count; ++k) {
+    struct command *cmd = cl->commands[*i + k];
+    /* Expanded now, with the values variables have now */
+    if (k) expand_command_words(cmd);
+    *deferred->commands[k] = *cmd;
+    *cmd = (struct command){.ctrl_op = cmd->ctrl_op};
+  }
+  admit_defer(deferred);
+  *i = end;
+  return 1;
+
+err: /* it is started now after all */
+  for (size_t k = 0; k < deferred->command_count; ++k) {
+    alloc_free(deferred->commands[k]);
+  }
+  alloc_free(deferred->commands);
+  alloc_free(deferred);
+  return 0;
+}
+
+/* Runs cl; if expanded, its words have been expanded already, as they are
+ * for a pipeline that admission control queued, and it runs as it is */
+static int
+run_list(struct command_list *cl, int expanded)
 {
   /* These are declared outside the main loop below, so that their values
    * persist between successive commands in a pipeline. */
@@ -364,13 +527,31 @@ run_command_list(struct command_list *cl)
     int pipe_fd; /* -1 means no upstream pipe */
     pid_t pgid;
     jid_t jid;
+    long pipesize; /* see pipesize_setting() */
   } pipeline_data = {.pipe_fd = -1, .pgid = 0, .jid = -1};
+  struct pipeline_timer timer = {0};
 
   /* Loop over every command in the command list */
   for (size_t i = 0; i < cl->command_count; ++i) {
     struct command *cmd = cl->commands[i];
-    /* First, handle expansions (tilde, parameter, quote removal) */
-    expand_command_words(cmd);
+    int const starts_pipeline = i == 0 || cl->commands[i - 1]->ctrl_op != '|';
+    if (!expanded) {
+      if (starts_pipeline) time_start(&timer, cmd);
+      /* First, handle expansions (tilde, parameter, quote removal) */
+      uint64_t const expand_start = stats_now();
+      PROBE1(expand__start, cmd->word_count ? cmd->words[0] : 0);
+      expand_command_words(cmd);
+      uint64_t const expand_ns =
+          stats_record_since(STATS_EXPAND, expand_start) - expand_start;
+      PROBE2(expand__done, cmd->word_count ? cmd->words[0] : 0, expand_ns);
+      if (starts_pipeline && defer_pipeline(cl, &i)) {
+        timer.active = 0;
+        continue;
+      }
+    }
+    if (starts_pipeline) {
+      pipeline_data.pipesize = cmd->ctrl_op == '|' ? pipesize_setting(cmd) : 0;
+    }
 
     // clang-format off
     // Next, figure out what kind of command are we running?
@@ -436,6 +617,15 @@ run_command_list(struct command_list *cl)
             return -1; /* Terminate early if we can't create the pipe */
         }
 
+        /* The next command's words are not expanded yet, but a command
+         * name rarely needs it */
+        struct command const *next =
+            i + 1 < cl->command_count ? cl->commands[i + 1] : 0;
+        pipesize_apply(pipe_fds[1],
+                       pipeline_data.pipesize,
+                       cmd->word_count ? cmd->words[0] : 0,
+                       next && next->word_count ? next->words[0] : 0);
+
         /* Save the READ end of the pipe for the next command */
         pipeline_data.pipe_fd = pipe_fds[0];
 
@@ -469,24 +659,46 @@ run_command_list(struct command_list *cl)
     int const should_fork = !is_builtin || !is_fg;
     int did_fork = 0;
 
+    /* External commands wait for their counters to be attached, if any */
+    int perf_sync[2] = {-1, -1};
+    if (should_fork && !is_builtin) perfctr_sync_open(perf_sync);
+
+    uint64_t const spawn_start = stats_now();
+    int const use_fdcache = fdcache_prepare(cmd);
     if (should_fork) {
-        child_pid = fork();
+        /* Before the child can look at the terminal's modes */
+        if (!is_bg) lineedit_release();
+        /* The child's environment gets values appended since the last one */
+        vars_sync_env();
+        child_pid = cgroup_fork(pipeline_data.pgid, cmd);
 
         if (child_pid < 0) {
             /* Handle fork failure */
             perror("fork");
+            close_perf_sync(perf_sync);
             goto err; /* Exit the loop or function with an error */
         }
 
         /* Set did_fork flag to indicate successful fork */
         did_fork = 1;
+        if (child_pid > 0) {
+          ++runner_forks;
+          trace(TRACE_SPAWN,
+                "forked %jd for %s (%c)",
+                (intmax_t)child_pid,
+                cmd->word_count ? cmd->words[0] : "<null>",
+                cmd->ctrl_op);
+        }
     }
 
     if (did_fork) {
         /* Assign process to a process group */
         if (setpgid(child_pid, pipeline_data.pgid) < 0) {
             if (errno == EACCES) errno = 0; /* Ignore race condition errors */
-            else goto err; /* Handle other errors */
+            else {
+              close_perf_sync(perf_sync);
+              goto err; /* Handle other errors */
+            }
         }
       /* All of the processes in a pipeline (or single command) belong to the
        * same process group. This is how the shell manages job control. We will
@@ -505,14 +717,42 @@ run_command_list(struct command_list *cl)
 
       if (setpgid(child_pid, pipeline_data.pgid) < 0) {
         if (errno == EACCES) errno = 0;
-        else goto err;
+        else {
+          close_perf_sync(perf_sync);
+          goto err;
+        }
       }
       if (child_pid && pipeline_data.pgid == 0) {
         /* Start of a new pipeline */
         assert(child_pid == getpgid(child_pid));
         pipeline_data.pgid = child_pid;
         pipeline_data.jid = jobs_add(child_pid);
-        if (pipeline_data.jid < 0) goto err;
+        if (pipeline_data.jid < 0) {
+          close_perf_sync(perf_sync);
+          goto err;
+        }
+        cgroup_attach(child_pid);
+      }
+      if (child_pid) {
+        uint64_t const spawn_ns =
+            stats_record_since(STATS_SPAWN, spawn_start) - spawn_start;
+        PROBE5(spawn,
+               pipeline_data.jid,
+               pipeline_data.pgid,
+               child_pid,
+               cmd->word_count ? cmd->words[0] : 0,
+               spawn_ns);
+        execlog_spawn(cmd,
+                      child_pid,
+                      pipeline_data.jid,
+                      pipeline_data.pgid,
+                      spawn_start);
+        perfctr_attach(pipeline_data.pgid, child_pid, perf_sync);
+        if (pipeline_data.pipesize == PIPESIZE_AUTO && cmd->word_count &&
+            (has_upstream_pipe || has_downstream_pipe)) {
+          pipesize_spawn(child_pid, cmd->words[0], spawn_start);
+        }
+        statsock_update();
       }
     }
 
@@ -524,7 +764,8 @@ run_command_list(struct command_list *cl)
         struct builtin_redir *redir_list = 0;
 
         if (upstream_pipefd >= 0) {
-          struct builtin_redir *rec = malloc(sizeof *rec);
+          struct builtin_redir *rec =
+              alloc_malloc(ALLOC_RUNNER, sizeof *rec);
           if (!rec) goto err;
           rec->pseudofd = STDIN_FILENO;
           rec->realfd = upstream_pipefd;
@@ -532,7 +773,8 @@ run_command_list(struct command_list *cl)
           redir_list = rec;
         }
         if (downstream_pipefd >= 0) {
-          struct builtin_redir *rec = malloc(sizeof *rec);
+          struct builtin_redir *rec =
+              alloc_malloc(ALLOC_RUNNER, sizeof *rec);
           if (!rec) goto err;
           rec->pseudofd = STDOUT_FILENO;
           rec->realfd = downstream_pipefd;
@@ -540,7 +782,7 @@ run_command_list(struct command_list *cl)
           redir_list = rec;
         }
 
-        do_builtin_io_redirects(cmd, &redir_list);
+        do_builtin_io_redirects(cmd, &redir_list, use_fdcache);
 
         do_variable_assignment(cmd, 0);
 
@@ -553,12 +795,13 @@ run_command_list(struct command_list *cl)
           close(redir_list->realfd);
           void *tmp = redir_list;
           redir_list = redir_list->next;
-          free(tmp);
+          alloc_free(tmp);
         }
 
         params.status = result ? 127 : 0;
         /* If we forked, exit now */
-        if (!is_fg) exit(params.status);
+        if (!is_fg) _exit(params.status);
+        execlog_builtin(cmd, params.status, spawn_start);
 
         /* Otherwise, we are running in the current shell and
          * need to clean up before falling through */
@@ -570,41 +813,48 @@ run_command_list(struct command_list *cl)
           /* Redirect the two standard streams overrides IF they are not set to -1 */
           if (upstream_pipefd >= 0) {
               if (move_fd(upstream_pipefd, STDIN_FILENO) < 0) {
-                  err(1, 0); // Fail if unable to redirect stdin
+                  child_fail(1); // Fail if unable to redirect stdin
               }
           }
 
           if (downstream_pipefd >= 0) {
               if (move_fd(downstream_pipefd, STDOUT_FILENO) < 0) {
-                  err(1, 0); // Fail if unable to redirect stdout
+                  child_fail(1); // Fail if unable to redirect stdout
               }
           }
 
           /* Handle the remaining redirect operators from the command */
-          if (do_io_redirects(cmd) < 0) {
-              err(1, 0); // Fail if I/O redirection fails
+          if (do_io_redirects(cmd, use_fdcache) < 0) {
+              child_fail(1); // Fail if I/O redirection fails
           }
 
           /* Perform variable assignment with export_all set to 1 */
           if (do_variable_assignment(cmd, 1) < 0) {
-              err(1, 0); // Fail if variable assignment or export fails
+              child_fail(1); // Fail if variable assignment or export fails
           }
 
           /* Restore signals to their original values */
           if (signal_restore() < 0) {
-              err(1, 0); // Fail if signal restoration fails
+              child_fail(1); // Fail if signal restoration fails
           }
 
+          perfctr_sync_wait(perf_sync);
+
           /* Execute the command described by cmd->words */
           execvp(cmd->words[0], cmd->words);
+          PROBE2(exec__fail, cmd->words[0], errno);
 
           /* If execvp fails */
-          err(127, 0); // Exit with failure code (127)
+          child_fail(127); // Exit with failure code (127)
           assert(0);   // Should not be reachable
       }
 
     }
-    if (child_pid == 0) continue;
+    if (child_pid == 0) {
+      /* A foreground builtin ran in the shell itself */
+      if (!did_fork && timer.active) time_report(&timer, 0);
+      continue;
+    }
 
     /* This code is reachable only by a parent shell process after spawning
      * a child process */
@@ -649,6 +899,9 @@ run_command_list(struct command_list *cl)
     /* Cleanup after non-pipeline cmds */
     if (!is_pl) {
       assert(pipeline_data.pipe_fd == -1);
+      /* Background jobs are not timed; they finish after we move on */
+      if (timer.active && is_fg) time_report(&timer, pipeline_data.pgid);
+      timer.active = 0;
       pipeline_data.pgid = 0;
       pipeline_data.jid = -1;
     }
@@ -658,3 +911,15 @@ run_command_list(struct command_list *cl)
 err:
   return -1;
 }
+
+int
+run_command_list(struct command_list *cl)
+{
+  return run_list(cl, 0);
+}
+
+int
+run_expanded_command_list(struct command_list *cl)
+{
+  return run_list(cl, 1);
+}
@@ -7,3 +7,12 @@
  * @returns 0 on success, -1 on error
  */
 extern int run_command_list(struct command_list *cl);
+
+/** Runs cl, whose words have been expanded already (see admit.h)
+ *
+ * @returns 0 on success, -1 on error
+ */
+extern int run_expanded_command_list(struct command_list *cl);
+
+/** Number of processes forked by run_command_list() so far */
+extern unsigned long runner_forks;
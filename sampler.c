@@ -0,0 +1,215 @@
+#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE /* dladdr() */
+#include <dlfcn.h>
+#include <errno.h>
+#include <execinfo.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "region.h"
+#include "sampler.h"
+
+#define MAX_DEPTH 32
+#define SKIP_FRAMES 2   /* the handler and the signal trampoline */
+#define TABLE_SIZE 4096 /* distinct stacks, must be a power of two */
+
+struct stack {
+  uint64_t hash; /* 0 marks an empty slot */
+  unsigned long count;
+  int depth;
+  void *pcs[MAX_DEPTH]; /* innermost first */
+};
+
+static struct {
+  struct stack *table;
+  timer_t timer;
+  int timer_created;
+  int running;
+  unsigned hz;
+  unsigned long samples;
+  unsigned long dropped; /* the table was full */
+  size_t distinct;
+  char *path; /* written at exit */
+} s;
+
+static uint64_t
+hash_stack(void *const *pcs, int depth)
+{
+  uint64_t h = 0xcbf29ce484222325; /* FNV-1a over the addresses */
+  for (int i = 0; i < depth; ++i) {
+    h ^= (uintptr_t)pcs[i];
+    h *= 0x100000001b3;
+  }
+  return h ? h : 1;
+}
+
+static void
+on_sigprof(int signo)
+{
+  int const saved_errno = errno;
+  void *pcs[MAX_DEPTH + SKIP_FRAMES];
+  int depth = backtrace(pcs, MAX_DEPTH + SKIP_FRAMES) - SKIP_FRAMES;
+  if (depth <= 0) goto out;
+
+  ++s.samples;
+  uint64_t const h = hash_stack(pcs + SKIP_FRAMES, depth);
+  for (size_t i = h & (TABLE_SIZE - 1), probes = 0; probes < TABLE_SIZE;
+       i = (i + 1) & (TABLE_SIZE - 1), ++probes) {
+    struct stack *st = &s.table[i];
+    if (st->hash == h && st->depth == depth &&
+        memcmp(st->pcs, pcs + SKIP_FRAMES, sizeof *pcs * depth) == 0) {
+      ++st->count;
+      goto out;
+    }
+    if (st->hash == 0) {
+      memcpy(st->pcs, pcs + SKIP_FRAMES, sizeof *pcs * depth);
+      st->depth = depth;
+      st->count = 1;
+      st->hash = h;
+      ++s.distinct;
+      goto out;
+    }
+  }
+  ++s.dropped;
+out:
+  errno = saved_errno;
+}
+
+int
+sampler_start(unsigned hz)
+{
+  if (s.running) sampler_stop();
+  if (!hz || hz > 100000) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (!s.table) {
+    s.table = region_alloc(TABLE_SIZE * sizeof *s.table);
+    if (!s.table) return -1;
+    /* The first call may load libgcc, which is not safe in a handler */
+    void *pc;
+    backtrace(&pc, 1);
+  }
+
+  struct sigaction sa = {.sa_handler = on_sigprof, .sa_flags = SA_RESTART};
+  sigemptyset(&sa.sa_mask);
+  if (sigaction(SIGPROF, &sa, 0) < 0) return -1;
+
+  if (!s.timer_created) {
+    struct sigevent sev = {.sigev_notify = SIGEV_SIGNAL,
+                           .sigev_signo = SIGPROF};
+    if (timer_create(CLOCK_PROCESS_CPUTIME_ID, &sev, &s.timer) < 0) return -1;
+    s.timer_created = 1;
+  }
+  long const ns = 1000000000L / hz;
+  struct itimerspec its = {
+      .it_interval = {ns / 1000000000L, ns % 1000000000L},
+      .it_value = {ns / 1000000000L, ns % 1000000000L},
+  };
+  if (timer_settime(s.timer, 0, &its, 0) < 0) return -1;
+  s.hz = hz;
+  s.running = 1;
+  return 0;
+}
+
+void
+sampler_stop(void)
+{
+  if (!s.running) return;
+  struct itimerspec its = {0};
+  timer_settime(s.timer, 0, &its, 0);
+  s.running = 0;
+}
+
+/* Writes one frame, without the ';' and ' ' that folded lines use */
+static void
+put_frame(FILE *f, void *pc)
+{
+  Dl_info info = {0};
+  int const found = dladdr(pc, &info);
+  if (found && info.dli_sname) {
+    fputs(info.dli_sname, f);
+  } else if (found && info.dli_fname) {
+    char const *base = strrchr(info.dli_fname, '/');
+    fprintf(f,
+            "%s+%#jx",
+            base ? base + 1 : info.dli_fname,
+            (uintmax_t)((char *)pc - (char *)info.dli_fbase));
+  } else {
+    fprintf(f, "%p", pc);
+  }
+}
+
+int
+sampler_write(char const *path)
+{
+  if (!s.table) {
+    errno = EINVAL;
+    return -1;
+  }
+  FILE *f = fopen(path, "w");
+  if (!f) return -1;
+
+  /* Keep the handler out of the table while we read it */
+  sigset_t set, old;
+  sigemptyset(&set);
+  sigaddset(&set, SIGPROF);
+  sigprocmask(SIG_BLOCK, &set, &old);
+  for (size_t i = 0; i < TABLE_SIZE; ++i) {
+    struct stack const *st = &s.table[i];
+    if (!st->hash) continue;
+    for (int d = st->depth - 1; d >= 0; --d) {
+      /* Return addresses point after the call; step back into it */
+      put_frame(f, (char *)st->pcs[d] - (d != 0));
+      if (d) putc(';', f);
+    }
+    fprintf(f, " %lu\n", st->count);
+  }
+  sigprocmask(SIG_SETMASK, &old, 0);
+  return fclose(f) == 0 ? 0 : -1;
+}
+
+void
+sampler_print(int fd)
+{
+  dprintf(fd,
+          "sampler: %s, %u Hz, %lu samples, %zu stacks, %lu dropped\n",
+          s.running ? "running" : "stopped",
+          s.hz,
+          s.samples,
+          s.distinct,
+          s.dropped);
+}
+
+int
+sampler_init(void)
+{
+  char const *path = getenv("BIGSHELL_SAMPLE");
+  if (!path || !*path) return 0;
+  s.path = strdup(path);
+  if (!s.path) return -1;
+  unsigned hz = 997; /* prime, so sampling doesn't lock step with anything */
+  char const *hz_str = getenv("BIGSHELL_SAMPLE_HZ");
+  if (hz_str && *hz_str) {
+    char *end;
+    unsigned long v = strtoul(hz_str, &end, 10);
+    if (*end || !v || v > 100000) {
+      errno = EINVAL;
+      return -1;
+    }
+    hz = v;
+  }
+  return sampler_start(hz);
+}
+
+void
+sampler_finish(void)
+{
+  sampler_stop();
+  if (s.path && sampler_write(s.path) < 0) perror(s.path);
+}
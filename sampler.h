@@ -0,0 +1,42 @@
+#pragma once
+/** @file Sampling profiler for the shell itself
+ *
+ * A CPU-time timer delivers SIGPROF while the shell (not its children) is
+ * running, and the handler records the interrupted call stack with
+ * backtrace(3). Identical stacks are counted in a table allocated up front,
+ * so the handler never allocates and a long-running shell needs no more
+ * memory the longer it is sampled.
+ *
+ * Stacks are written as folded lines ("main;run_command_list;expand 12")
+ * for flamegraph tools. Functions the dynamic linker cannot name, such as
+ * static ones, are written as module+offset for addr2line(1), unless the
+ * shell was linked with -rdynamic.
+ */
+
+/** Starts sampling at hz samples per second of shell CPU time
+ *
+ * @returns 0 on success, -1 on failure
+ */
+extern int sampler_start(unsigned hz);
+
+/** Stops sampling, keeping the samples taken so far */
+extern void sampler_stop(void);
+
+/** Writes the samples taken so far as folded stacks to path
+ *
+ * @returns 0 on success, -1 on failure
+ */
+extern int sampler_write(char const *path);
+
+/** Prints whether the sampler is running and how much it has recorded */
+extern void sampler_print(int fd);
+
+/** Starts sampling if BIGSHELL_SAMPLE names an output file; the rate is
+ * BIGSHELL_SAMPLE_HZ, or 997 by default
+ *
+ * @returns 0 on success, -1 on failure
+ */
+extern int sampler_init(void);
+
+/** Writes the samples to the BIGSHELL_SAMPLE file, if any (at exit) */
+extern void sampler_finish(void);
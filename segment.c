@@ -0,0 +1,327 @@
+#define _GNU_SOURCE /* pipe2() */
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fdcache.h"
+#include "segment.h"
+#include "signal.h"
+#include "vars.h"
+
+#define CACHED_DIRS 8 /* directories remembered per segment */
+
+/* A segment's output in one directory */
+struct cached {
+  char *pwd;
+  char *value;
+};
+
+struct segment {
+  char *name;
+  char *command;
+  struct cached cache[CACHED_DIRS];
+  size_t next_slot;
+  unsigned generation; /* of the prompt that last started a run */
+  int shown;           /* whether the prompt on screen uses the value */
+
+  /* The run in progress, if pid is nonzero */
+  pid_t pid;
+  int fd;
+  char *pwd;
+  uint64_t deadline_ms;
+  char out[SEGMENT_OUTPUT_MAX + 1];
+  size_t out_len;
+};
+
+static struct segment segments[SEGMENT_MAX];
+static size_t segment_count = 0;
+static unsigned generation = 1;
+
+static uint64_t
+now_ms(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static char const *
+current_dir(void)
+{
+  char const *s = vars_get("PWD");
+  return s ? s : "";
+}
+
+static struct cached *
+lookup(struct segment *s, char const *dir)
+{
+  for (size_t i = 0; i < CACHED_DIRS; ++i) {
+    if (s->cache[i].pwd && strcmp(s->cache[i].pwd, dir) == 0) {
+      return &s->cache[i];
+    }
+  }
+  return 0;
+}
+
+/* Records value as s's output in dir; returns 1 if that changed it */
+static int
+store(struct segment *s, char const *dir, char const *value)
+{
+  struct cached *c = lookup(s, dir);
+  if (c && strcmp(c->value, value) == 0) return 0;
+  char *v = strdup(value);
+  if (!v) return 0;
+  if (!c) {
+    char *p = strdup(dir);
+    if (!p) {
+      free(v);
+      return 0;
+    }
+    c = &s->cache[s->next_slot];
+    s->next_slot = (s->next_slot + 1) % CACHED_DIRS;
+    free(c->pwd);
+    c->pwd = p;
+  }
+  free(c->value);
+  c->value = v;
+  return 1;
+}
+
+static void
+start(struct segment *s)
+{
+  int p[2];
+  char *dir = strdup(current_dir());
+  if (!dir) return;
+  if (pipe2(p, O_CLOEXEC) < 0) goto err;
+  vars_sync_env();
+  pid_t const pid = fork();
+  if (pid == 0) {
+    /* Out of the terminal's way: ^C and job control never reach it */
+    setpgid(0, 0);
+    signal_restore();
+    int const null = fdcache_get("/dev/null", O_RDWR);
+    if (null >= 0) {
+      dup2(null, STDIN_FILENO);
+      dup2(null, STDERR_FILENO);
+    }
+    dup2(p[1], STDOUT_FILENO);
+    execl("/bin/sh", "sh", "-c", s->command, (char *)0);
+    _exit(127);
+  }
+  close(p[1]);
+  if (pid < 0) {
+    close(p[0]);
+    goto err;
+  }
+  setpgid(pid, pid);
+  fcntl(p[0], F_SETFL, O_NONBLOCK);
+  s->pid = pid;
+  s->fd = p[0];
+  s->pwd = dir;
+  s->out_len = 0;
+  s->deadline_ms = now_ms() + SEGMENT_TIMEOUT_MS;
+  return;
+err:
+  free(dir);
+}
+
+/* Ends s's run; its output becomes the value unless it timed out. Returns
+ * 1 if a value shown in the prompt changed */
+static int
+finish(struct segment *s, int timed_out)
+{
+  kill(-s->pid, SIGKILL); /* along with anything it left behind */
+  while (waitpid(s->pid, 0, 0) < 0 && errno == EINTR);
+  close(s->fd);
+  int changed = 0;
+  if (!timed_out) {
+    while (s->out_len && s->out[s->out_len - 1] == '\n') --s->out_len;
+    s->out[s->out_len] = '\0';
+    changed = store(s, s->pwd, s->out) && s->shown &&
+              strcmp(s->pwd, current_dir()) == 0;
+  }
+  free(s->pwd);
+  s->pwd = 0;
+  s->pid = 0;
+  s->fd = -1;
+  return changed;
+}
+
+static int
+collect(struct segment *s, uint64_t now)
+{
+  for (;;) {
+    char discard[512];
+    ssize_t n;
+    if (s->out_len < SEGMENT_OUTPUT_MAX) {
+      n = read(s->fd, s->out + s->out_len, SEGMENT_OUTPUT_MAX - s->out_len);
+      if (n > 0) s->out_len += n;
+    } else {
+      n = read(s->fd, discard, sizeof discard);
+    }
+    if (n == 0) return finish(s, 0);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      break; /* nothing more yet */
+    }
+  }
+  if (now >= s->deadline_ms) return finish(s, 1);
+  return 0;
+}
+
+static struct segment *
+find(char const *name, size_t len)
+{
+  for (size_t i = 0; i < segment_count; ++i) {
+    if (strncmp(segments[i].name, name, len) == 0 && !segments[i].name[len]) {
+      return &segments[i];
+    }
+  }
+  return 0;
+}
+
+static void
+forget(struct segment *s)
+{
+  if (s->pid) finish(s, 1);
+  for (size_t i = 0; i < CACHED_DIRS; ++i) {
+    free(s->cache[i].pwd);
+    free(s->cache[i].value);
+    s->cache[i] = (struct cached){0};
+  }
+  s->next_slot = 0;
+}
+
+int
+segment_define(char const *name, char const *command)
+{
+  size_t const len = strlen(name);
+  if (!len) goto inval;
+  for (size_t i = 0; i < len; ++i) {
+    if (!isalnum((unsigned char)name[i]) && name[i] != '_') goto inval;
+  }
+  struct segment *s = find(name, len);
+  if (!command) {
+    if (!s) goto inval;
+    forget(s);
+    free(s->name);
+    free(s->command);
+    *s = segments[--segment_count];
+    return 0;
+  }
+  char *copy = strdup(command);
+  if (!copy) return -1;
+  if (s) {
+    forget(s); /* the old command's values */
+    free(s->command);
+  } else {
+    if (segment_count == SEGMENT_MAX) {
+      free(copy);
+      errno = ENOSPC;
+      return -1;
+    }
+    s = &segments[segment_count];
+    *s = (struct segment){.fd = -1};
+    if (!(s->name = strdup(name))) {
+      free(copy);
+      return -1;
+    }
+    ++segment_count;
+  }
+  s->command = copy;
+  s->generation = 0;
+  return 0;
+inval:
+  errno = EINVAL;
+  return -1;
+}
+
+void
+segment_print(int fd)
+{
+  char const *dir = current_dir();
+  for (size_t i = 0; i < segment_count; ++i) {
+    struct segment *s = &segments[i];
+    struct cached const *c = lookup(s, dir);
+    dprintf(fd,
+            "%s\t%s\t%s%s\n",
+            s->name,
+            s->command,
+            c ? c->value : "",
+            s->pid ? "\t(running)" : "");
+  }
+}
+
+void
+segment_expire(void)
+{
+  if (!++generation) generation = 1;
+  for (size_t i = 0; i < segment_count; ++i) segments[i].shown = 0;
+}
+
+char const *
+segment_value(char const *name, size_t len)
+{
+  struct segment *s = find(name, len);
+  if (!s) return 0;
+  if (s->pid) collect(s, now_ms());
+  if (!s->pid && s->generation != generation) {
+    s->generation = generation;
+    start(s);
+  }
+  s->shown = 1;
+  struct cached const *c = lookup(s, current_dir());
+  return c ? c->value : "";
+}
+
+int
+segment_fds(struct pollfd *fds, int *timeout)
+{
+  uint64_t const now = now_ms();
+  int n = 0;
+  *timeout = -1;
+  for (size_t i = 0; i < segment_count; ++i) {
+    struct segment const *s = &segments[i];
+    if (!s->pid) continue;
+    fds[n++] = (struct pollfd){.fd = s->fd, .events = POLLIN};
+    int const left = s->deadline_ms > now ? s->deadline_ms - now : 0;
+    if (*timeout < 0 || left < *timeout) *timeout = left;
+  }
+  return n;
+}
+
+int
+segment_collect(void)
+{
+  uint64_t const now = now_ms();
+  int changed = 0;
+  for (size_t i = 0; i < segment_count; ++i) {
+    struct segment *s = &segments[i];
+    if (!s->pid) continue;
+    if (collect(s, now)) changed = 1;
+    /* A run that began before the prompt on screen is followed by one for
+     * it, which may be in another directory */
+    if (!s->pid && s->shown && s->generation != generation) {
+      s->generation = generation;
+      start(s);
+    }
+  }
+  return changed;
+}
+
+void
+segment_cleanup(void)
+{
+  for (size_t i = 0; i < segment_count; ++i) {
+    if (segments[i].pid) finish(&segments[i], 1);
+  }
+}
@@ -0,0 +1,55 @@
+#pragma once
+/** @file Asynchronous prompt segments
+ *
+ * A segment is a named command whose output can be shown in the prompt as
+ * \{name}: `segment branch 'git branch --show-current'`. The command is run
+ * by /bin/sh -c in the background, in its own process group, with its
+ * standard output on a pipe and its other streams on /dev/null. The prompt
+ * never waits for it: \{name} expands to the output of the last run in the
+ * same $PWD (or to nothing), and the line editor redraws the prompt in
+ * place when a run finishes with different output. A run is started for
+ * each new prompt, unless one is still going, and is killed after
+ * SEGMENT_TIMEOUT_MS.
+ */
+#include <poll.h>
+
+#define SEGMENT_MAX 16
+#define SEGMENT_TIMEOUT_MS 2000
+#define SEGMENT_OUTPUT_MAX 256 /* bytes of output kept */
+
+/** Defines segment name, or removes it if command is null
+ *
+ * @returns 0 on success, -1 on failure
+ */
+extern int segment_define(char const *name, char const *command);
+
+/** Prints the segments, their commands and the values for $PWD */
+extern void segment_print(int fd);
+
+/** Marks the values as stale, so that the next prompt runs them again */
+extern void segment_expire(void);
+
+/** The value of segment name[0..len) for $PWD; starts a run if the value
+ * is stale
+ *
+ * @returns the value, or null if there is no such segment
+ */
+extern char const *segment_value(char const *name, size_t len);
+
+/** The pipes of the runs in progress
+ *
+ * @param [out]fds filled with up to SEGMENT_MAX entries
+ * @param [out]timeout milliseconds until the next run times out, or -1
+ * @returns the number of entries filled
+ */
+extern int segment_fds(struct pollfd *fds, int *timeout);
+
+/** Reads what runs in progress have written, and finishes those that have
+ * exited or timed out
+ *
+ * @returns 1 if a value shown in the prompt has changed, 0 otherwise
+ */
+extern int segment_collect(void);
+
+/** Kills the runs in progress (at exit) */
+extern void segment_cleanup(void);
@@ -3,6 +3,7 @@
 #include <errno.h>
 #include <stddef.h>
 #include "signal.h"
+#include "util/trace.h"
 
 static void
 interrupting_signal_handler(int signo)
@@ -17,6 +18,9 @@ static struct sigaction ignore_action = {.sa_handler = SIG_IGN},
                                                 interrupting_signal_handler},
                         old_sigtstp, old_sigint, old_sigttou;
 
+/* Set once signal_init() has saved the dispositions we were started with */
+static int saved = 0;
+
 /* Ignore certain signals.
  * 
  * @returns 0 on succes, -1 on failure
@@ -27,7 +31,8 @@ static struct sigaction ignore_action = {.sa_handler = SIG_IGN},
  *   - SIGINT
  *   - SIGTTOU
  *
- * Should be called immediately on entry to main() 
+ * Should be called immediately on entry to main() by interactive shells.
+ * Non-interactive shells leave dispositions alone.
  *
  * Saves old signal dispositions for a later call to signal_restore()
  */
@@ -49,6 +54,8 @@ signal_init(void)
         return -1;
     }
 
+    saved = 1;
+    trace(TRACE_SIGNAL, "ignoring SIGTSTP, SIGTTOU, SIGINT");
     return 0;  // Return success
 }
 
@@ -67,6 +74,7 @@ signal_enable_interrupt(int sig)
         return -1;       // Return failure if unable to set signal action
     }
 
+    trace(TRACE_SIGNAL, "signal %d now interrupts syscalls", sig);
     return 0;  // Return success if signal action is set correctly
 }
 
@@ -85,6 +93,7 @@ signal_ignore(int sig)
         return -1;       // Return failure if unable to set signal action
     }
 
+    trace(TRACE_SIGNAL, "signal %d now ignored", sig);
     return 0;  // Return success if signal is set to be ignored correctly
 }
 
@@ -92,10 +101,13 @@ signal_ignore(int sig)
  *
  * @returns 0 on success, -1 on failure
  *
+ * Does nothing if signal_init() was never called.
  */
 int
 signal_restore(void)
 {
+    if (!saved) return 0;
+
     // Restore SIGTSTP
     if (sigaction(SIGTSTP, &old_sigtstp, NULL) < 0) {
         return -1;
@@ -111,5 +123,6 @@ signal_restore(void)
         return -1;
     }
 
+    trace(TRACE_SIGNAL, "restored original dispositions");
     return 0;  // Success
 }
@@ -0,0 +1,193 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "stats.h"
+
+/* Log-bucketed histogram, in the style of HdrHistogram: values below
+ * 2^SUB_BITS get a bucket each; above that, every power of two is split into
+ * 2^SUB_BITS linear sub-buckets, so any recorded value is off by at most
+ * 1/2^SUB_BITS (about 6%). Values at or above 2^MAX_EXP ns (~18 minutes)
+ * land in the last bucket. */
+#define SUB_BITS 4
+#define SUB_COUNT (1 << SUB_BITS)
+#define MAX_EXP 40
+#define BUCKET_COUNT ((MAX_EXP - SUB_BITS + 1) * SUB_COUNT)
+
+struct histogram {
+  uint64_t count;
+  uint64_t sum;
+  uint64_t max;
+  uint64_t buckets[BUCKET_COUNT];
+};
+
+static struct histogram histograms[STATS_STAGE_COUNT];
+
+static struct {
+  uint64_t lookups;
+  uint64_t hits;
+} caches[STATS_CACHE_COUNT];
+
+static char const *const cache_names[STATS_CACHE_COUNT] = {
+    [STATS_CACHE_USER] = "user",
+    [STATS_CACHE_HOST] = "host",
+};
+
+static char const *const stage_names[STATS_STAGE_COUNT] = {
+    [STATS_PARSE] = "parse",
+    [STATS_EXPAND] = "expand",
+    [STATS_SPAWN] = "spawn",
+    [STATS_WAIT] = "wait",
+    [STATS_PROMPT] = "prompt",
+};
+
+static size_t
+bucket_of(uint64_t v)
+{
+  if (v < SUB_COUNT) return v;
+  int e = 63 - __builtin_clzll(v);
+  if (e >= MAX_EXP) return BUCKET_COUNT - 1;
+  size_t sub = (v >> (e - SUB_BITS)) & (SUB_COUNT - 1);
+  return (size_t)(e - SUB_BITS + 1) * SUB_COUNT + sub;
+}
+
+/* Midpoint of the range of values that map to bucket b */
+static uint64_t
+value_of(size_t b)
+{
+  if (b < SUB_COUNT) return b;
+  int e = b / SUB_COUNT + SUB_BITS - 1;
+  uint64_t sub = b % SUB_COUNT;
+  uint64_t width = UINT64_C(1) << (e - SUB_BITS);
+  return (UINT64_C(1) << e) + sub * width + width / 2;
+}
+
+uint64_t
+stats_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void
+stats_record(enum stats_stage stage, uint64_t ns)
+{
+  struct histogram *h = &histograms[stage];
+  ++h->count;
+  h->sum += ns;
+  if (ns > h->max) h->max = ns;
+  ++h->buckets[bucket_of(ns)];
+}
+
+uint64_t
+stats_record_since(enum stats_stage stage, uint64_t start)
+{
+  uint64_t now = stats_now();
+  stats_record(stage, now - start);
+  return now;
+}
+
+uint64_t
+stats_count(enum stats_stage stage)
+{
+  return histograms[stage].count;
+}
+
+uint64_t
+stats_mean(enum stats_stage stage)
+{
+  struct histogram const *h = &histograms[stage];
+  return h->count ? h->sum / h->count : 0;
+}
+
+uint64_t
+stats_quantile(enum stats_stage stage, double q)
+{
+  struct histogram const *h = &histograms[stage];
+  if (!h->count) return 0;
+  uint64_t rank = q * h->count;
+  if (rank >= h->count) rank = h->count - 1;
+  uint64_t seen = 0;
+  for (size_t b = 0; b < BUCKET_COUNT; ++b) {
+    seen += h->buckets[b];
+    if (seen > rank) {
+      uint64_t v = value_of(b);
+      return v < h->max ? v : h->max;
+    }
+  }
+  return h->max;
+}
+
+char const *
+stats_stage_name(enum stats_stage stage)
+{
+  return stage_names[stage];
+}
+
+void
+stats_print(int fd)
+{
+  dprintf(fd,
+          "%-8s %10s %10s %10s %10s %10s %10s\n",
+          "stage",
+          "count",
+          "mean(us)",
+          "p50(us)",
+          "p90(us)",
+          "p99(us)",
+          "max(us)");
+  for (int s = 0; s < STATS_STAGE_COUNT; ++s) {
+    dprintf(fd,
+            "%-8s %10llu %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+            stage_names[s],
+            (unsigned long long)stats_count(s),
+            stats_mean(s) / 1e3,
+            stats_quantile(s, 0.50) / 1e3,
+            stats_quantile(s, 0.90) / 1e3,
+            stats_quantile(s, 0.99) / 1e3,
+            histograms[s].max / 1e3);
+  }
+  dprintf(fd, "\n%-8s %10s %10s %10s\n", "cache", "lookups", "hits", "hit(%)");
+  for (int c = 0; c < STATS_CACHE_COUNT; ++c) {
+    dprintf(fd,
+            "%-8s %10llu %10llu %10.1f\n",
+            cache_names[c],
+            (unsigned long long)caches[c].lookups,
+            (unsigned long long)caches[c].hits,
+            caches[c].lookups ? 100.0 * caches[c].hits / caches[c].lookups : 0);
+  }
+}
+
+void
+stats_cache_access(enum stats_cache cache, int hit)
+{
+  ++caches[cache].lookups;
+  if (hit) ++caches[cache].hits;
+}
+
+uint64_t
+stats_cache_lookups(enum stats_cache cache)
+{
+  return caches[cache].lookups;
+}
+
+uint64_t
+stats_cache_hits(enum stats_cache cache)
+{
+  return caches[cache].hits;
+}
+
+char const *
+stats_cache_name(enum stats_cache cache)
+{
+  return cache_names[cache];
+}
+
+void
+stats_reset(void)
+{
+  memset(histograms, 0, sizeof histograms);
+  memset(caches, 0, sizeof caches);
+}
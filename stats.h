@@ -0,0 +1,59 @@
+#pragma once
+/** @file Latency histograms for the stages of the REPL, and cache hit
+ * counters */
+#include <stdint.h>
+
+enum stats_stage {
+  STATS_PARSE,  /* command_list_parse(), excluding the blocking read */
+  STATS_EXPAND, /* expand_command_words() */
+  STATS_SPAWN,  /* fork() and process group setup, in the parent */
+  STATS_WAIT,   /* wait_on_fg_pgid() */
+  STATS_PROMPT, /* prompt expansion and output */
+  STATS_STAGE_COUNT
+};
+
+/** monotonic timestamp in nanoseconds */
+extern uint64_t stats_now(void);
+
+/** records one sample of ns nanoseconds for stage */
+extern void stats_record(enum stats_stage stage, uint64_t ns);
+
+/** records the time elapsed since start for stage
+ *
+ * @returns the current time, so consecutive stages can be chained
+ */
+extern uint64_t stats_record_since(enum stats_stage stage, uint64_t start);
+
+/** number of samples recorded for stage */
+extern uint64_t stats_count(enum stats_stage stage);
+
+/** approximate q-th quantile (0 <= q <= 1) of stage, in nanoseconds */
+extern uint64_t stats_quantile(enum stats_stage stage, double q);
+
+/** mean of stage, in nanoseconds */
+extern uint64_t stats_mean(enum stats_stage stage);
+
+/** name of stage, as printed by stats_print() */
+extern char const *stats_stage_name(enum stats_stage stage);
+
+/** prints a table of counts, means and percentiles to fd */
+extern void stats_print(int fd);
+
+enum stats_cache {
+  STATS_CACHE_USER, /* passwd entry of the invoking user (expand.c) */
+  STATS_CACHE_HOST, /* host name (expand.c) */
+  STATS_CACHE_COUNT
+};
+
+/** counts one lookup in cache, which hit if hit is nonzero */
+extern void stats_cache_access(enum stats_cache cache, int hit);
+
+/** number of lookups in cache, and how many of them hit */
+extern uint64_t stats_cache_lookups(enum stats_cache cache);
+extern uint64_t stats_cache_hits(enum stats_cache cache);
+
+/** name of cache, as printed by stats_print() */
+extern char const *stats_cache_name(enum stats_cache cache);
+
+/** discards all samples and cache counts */
+extern void stats_reset(void);
@@ -0,0 +1,345 @@
+#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE /* accept4(), mallinfo2(), O_ASYNC */
+#include <errno.h>
+#include <fcntl.h>
+#include <malloc.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "alloc.h"
+#include "jobs.h"
+#include "stats.h"
+#include "statsock.h"
+
+#define SNAPSHOT_SIZE (64 * 1024)
+
+/* Accumulated rusage of a job's reaped processes */
+struct job_usage {
+  pid_t pgid;
+  unsigned reaped;
+  uint64_t utime_us;
+  uint64_t stime_us;
+  long maxrss_kb;
+};
+
+static int listen_fd = -1;
+static pid_t owner;
+static char *path;
+static dev_t bound_dev; /* of the socket file bound at path */
+static ino_t bound_ino;
+
+/* The handler sends snapshots[current]; the next one is rendered into the
+ * other buffer and then published by flipping current */
+static char snapshots[2][SNAPSHOT_SIZE];
+static size_t lengths[2];
+static volatile sig_atomic_t current = 0;
+
+static char *command; /* text of the running command list, or null */
+static int64_t command_start_us;
+static size_t command_lineno;
+static struct job_usage *usage;
+static size_t usage_count = 0;
+
+static int64_t
+wall_us(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void
+on_sigio(int signo)
+{
+  int const saved_errno = errno;
+  int const i = current;
+  for (;;) {
+    int fd = accept4(listen_fd, 0, 0, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) break; /* EAGAIN: no more clients */
+    /* A client too slow to take it in one go gets a truncated object */
+    (void)!write(fd, snapshots[i], lengths[i]);
+    close(fd);
+  }
+  errno = saved_errno;
+}
+
+static void
+put_json_string(FILE *f, char const *s)
+{
+  putc('"', f);
+  for (unsigned char const *c = (unsigned char const *)s; *c; ++c) {
+    if (*c == '"' || *c == '\\') fprintf(f, "\\%c", *c);
+    else if (*c < 0x20) fprintf(f, "\\u%04x", *c);
+    else putc(*c, f);
+  }
+  putc('"', f);
+}
+
+static struct job_usage *
+find_usage(pid_t pgid)
+{
+  for (size_t i = 0; i < usage_count; ++i) {
+    if (usage[i].pgid == pgid) return &usage[i];
+  }
+  return 0;
+}
+
+/* Resident set size from /proc, in kB */
+static long
+rss_kb(void)
+{
+  long pages = -1, resident = -1;
+  FILE *f = fopen("/proc/self/statm", "re");
+  if (!f) return -1;
+  if (fscanf(f, "%ld %ld", &pages, &resident) != 2) resident = -1;
+  fclose(f);
+  return resident < 0 ? -1 : resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static void
+render(FILE *f)
+{
+  fprintf(f,
+          "{\"pid\":%jd,\"state\":\"%s\",\"lineno\":%zu,\"command\":",
+          (intmax_t)owner,
+          command ? "running" : "idle",
+          command_lineno);
+  if (command) put_json_string(f, command);
+  else fputs("null", f);
+  fprintf(f,
+          ",\"command_start_us\":%lld,\"rendered_us\":%lld",
+          (long long)(command ? command_start_us : 0),
+          (long long)wall_us());
+
+  /* Jobs, dropping the usage of those that are gone */
+  size_t const job_count = jobs_get_joblist_size();
+  struct job const *jobs = jobs_get_joblist();
+  for (size_t i = 0; i < usage_count;) {
+    if (jobs_get_jid(usage[i].pgid) < 0) usage[i] = usage[--usage_count];
+    else ++i;
+  }
+  fputs(",\"jobs\":[", f);
+  for (size_t i = 0; i < job_count; ++i) {
+    struct job_usage const *u = find_usage(jobs[i].pgid);
+    struct job_usage const none = {0};
+    if (!u) u = &none;
+    fprintf(f,
+            "%s{\"jid\":%jd,\"pgid\":%jd,\"reaped\":%u,\"utime_us\":%llu,"
+            "\"stime_us\":%llu,\"maxrss_kb\":%ld}",
+            i ? "," : "",
+            (intmax_t)jobs[i].jid,
+            (intmax_t)jobs[i].pgid,
+            u->reaped,
+            (unsigned long long)u->utime_us,
+            (unsigned long long)u->stime_us,
+            u->maxrss_kb);
+  }
+
+  fputs("],\"stages\":{", f);
+  for (int s = 0; s < STATS_STAGE_COUNT; ++s) {
+    fprintf(f,
+            "%s\"%s\":{\"count\":%llu,\"mean_us\":%.1f,\"p50_us\":%.1f,"
+            "\"p99_us\":%.1f}",
+            s ? "," : "",
+            stats_stage_name(s),
+            (unsigned long long)stats_count(s),
+            stats_mean(s) / 1e3,
+            stats_quantile(s, 0.50) / 1e3,
+            stats_quantile(s, 0.99) / 1e3);
+  }
+
+  fputs("},\"caches\":{", f);
+  for (int c = 0; c < STATS_CACHE_COUNT; ++c) {
+    fprintf(f,
+            "%s\"%s\":{\"lookups\":%llu,\"hits\":%llu}",
+            c ? "," : "",
+            stats_cache_name(c),
+            (unsigned long long)stats_cache_lookups(c),
+            (unsigned long long)stats_cache_hits(c));
+  }
+
+  struct rusage self;
+  getrusage(RUSAGE_SELF, &self);
+  fprintf(f,
+          "},\"memory\":{\"rss_kb\":%ld,\"maxrss_kb\":%ld",
+          rss_kb(),
+          self.ru_maxrss);
+#ifdef __GLIBC__
+  struct mallinfo2 mi = mallinfo2();
+  fprintf(f,
+          ",\"heap_in_use\":%zu,\"heap_free\":%zu,\"heap_mmapped\":%zu",
+          mi.uordblks,
+          mi.fordblks,
+          mi.hblkhd);
+#endif
+  if (alloc_accounting) {
+    fputs(",\"tags\":{", f);
+    for (int t = 0; t < ALLOC_TAG_COUNT; ++t) {
+      fprintf(f,
+              "%s\"%s\":{\"live_blocks\":%zu,\"live_bytes\":%zu}",
+              t ? "," : "",
+              alloc_tag_name(t),
+              alloc_outstanding(t),
+              alloc_live_bytes(t));
+    }
+    putc('}', f);
+  }
+  fputs("}}\n", f);
+}
+
+void
+statsock_update(void)
+{
+  if (listen_fd < 0 || getpid() != owner) return;
+  int const next = !current;
+  FILE *f = fmemopen(snapshots[next], SNAPSHOT_SIZE, "w");
+  if (!f) return;
+  setvbuf(f, 0, _IONBF, 0);
+  render(f);
+  long len = ftell(f);
+  int const failed = ferror(f);
+  fclose(f);
+  if (failed || len <= 0 || len >= SNAPSHOT_SIZE) return; /* keep the last */
+  lengths[next] = len;
+  current = next;
+}
+
+/* Makes way at addr for the shell's socket, removing a socket there only
+ * if nothing listens on it any more: another shell may be serving it
+ *
+ * @returns 0 if the path is free, -1 on failure (EADDRINUSE if it is taken)
+ */
+static int
+reclaim(struct sockaddr_un const *addr)
+{
+  struct stat st;
+  if (lstat(addr->sun_path, &st) < 0) return errno == ENOENT ? 0 : -1;
+  if (!S_ISSOCK(st.st_mode)) {
+    errno = EADDRINUSE;
+    return -1;
+  }
+  int const fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) return -1;
+  int const res = connect(fd, (struct sockaddr const *)addr, sizeof *addr);
+  int const e = errno;
+  close(fd);
+  if (res == 0 || e != ECONNREFUSED) {
+    errno = EADDRINUSE;
+    return -1;
+  }
+  return unlink(addr->sun_path); /* left behind by a shell that has gone */
+}
+
+int
+statsock_init(void)
+{
+  char const *p = getenv("BIGSHELL_STATSOCK");
+  if (!p || !*p) return 0;
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(p) >= sizeof addr.sun_path) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  strcpy(addr.sun_path, p);
+  path = strdup(p);
+  if (!path) return -1;
+
+  if (reclaim(&addr) < 0) return -1;
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) return -1;
+  int bound = 0;
+  if (bind(fd, (struct sockaddr *)&addr, sizeof addr) < 0) goto err;
+  bound = 1;
+  struct stat st;
+  if (stat(p, &st) < 0 || listen(fd, 8) < 0) goto err;
+  bound_dev = st.st_dev;
+  bound_ino = st.st_ino;
+
+  struct sigaction sa = {.sa_handler = on_sigio, .sa_flags = SA_RESTART};
+  sigemptyset(&sa.sa_mask);
+  if (sigaction(SIGIO, &sa, 0) < 0) goto err;
+  owner = getpid();
+  if (fcntl(fd, F_SETOWN, owner) < 0 ||
+      fcntl(fd, F_SETFL, O_NONBLOCK | O_ASYNC) < 0) {
+    goto err;
+  }
+  listen_fd = fd;
+  statsock_update();
+  return 0;
+err:;
+  int const saved_errno = errno;
+  close(fd);
+  if (bound) unlink(p);
+  errno = saved_errno;
+  return -1;
+}
+
+void
+statsock_begin(struct command_list const *cl)
+{
+  if (listen_fd < 0) return;
+  size_t len = 0;
+  FILE *f = open_memstream(&command, &len);
+  if (f) {
+    command_list_print(cl, f);
+    fclose(f);
+    /* Drop the implicit trailing ';' */
+    if (len && command[len - 1] == ';') command[--len] = '\0';
+    while (len && command[len - 1] == ' ') command[--len] = '\0';
+  }
+  command_start_us = wall_us();
+  command_lineno = cl->lineno;
+  statsock_update();
+}
+
+void
+statsock_end(void)
+{
+  if (listen_fd < 0) return;
+  free(command);
+  command = 0;
+  statsock_update();
+}
+
+void
+statsock_reap(pid_t pgid, struct rusage const *ru)
+{
+  if (listen_fd < 0) return;
+  struct job_usage *u = find_usage(pgid);
+  if (!u) {
+    void *tmp = realloc(usage, sizeof *usage * (usage_count + 1));
+    if (!tmp) return;
+    usage = tmp;
+    u = &usage[usage_count++];
+    *u = (struct job_usage){.pgid = pgid};
+  }
+  ++u->reaped;
+  u->utime_us +=
+      (uint64_t)ru->ru_utime.tv_sec * 1000000 + ru->ru_utime.tv_usec;
+  u->stime_us +=
+      (uint64_t)ru->ru_stime.tv_sec * 1000000 + ru->ru_stime.tv_usec;
+  if (ru->ru_maxrss > u->maxrss_kb) u->maxrss_kb = ru->ru_maxrss;
+  statsock_update();
+}
+
+void
+statsock_cleanup(void)
+{
+  if (listen_fd < 0 || getpid() != owner) return;
+  close(listen_fd);
+  listen_fd = -1;
+  /* Unless another shell has taken the path over since */
+  struct stat st;
+  if (stat(path, &st) == 0 && st.st_dev == bound_dev &&
+      st.st_ino == bound_ino) {
+    unlink(path);
+  }
+}
@@ -0,0 +1,49 @@
+#pragma once
+/** @file Live stats socket
+ *
+ * When BIGSHELL_STATSOCK names a path, the shell listens on a Unix stream
+ * socket there, unless another shell is serving one there already; a socket
+ * that nothing listens on any more is replaced. Every client that connects
+ * is sent one JSON object and the connection is closed:
+ *
+ *   {"pid":..,"state":"running","lineno":..,"command":"make -j8",
+ *    "command_start_us":..,"rendered_us":..,
+ *    "jobs":[{"jid":0,"pgid":..,"reaped":1,"utime_us":..,"stime_us":..,
+ *             "maxrss_kb":..}],
+ *    "stages":{"parse":{"count":..,"mean_us":..,"p50_us":..,"p99_us":..},..},
+ *    "caches":{"user":{"lookups":..,"hits":..},..},
+ *    "memory":{"rss_kb":..,"maxrss_kb":..,"heap_in_use":..,"tags":{..}}}
+ *
+ * The shell spends most of its time blocked in read() or wait4(), so the
+ * socket is served from a SIGIO handler rather than a loop: the listening
+ * socket is O_ASYNC, and the handler accepts and writes a snapshot that was
+ * rendered in advance, whenever the shell's state last changed. The handler
+ * only makes nonblocking system calls and never waits on a client.
+ * Times are wall-clock microseconds; jobs' rusage covers their processes
+ * that have been reaped.
+ */
+#include <sys/resource.h>
+#include <sys/types.h>
+
+#include "parser.h"
+
+/** Opens the socket named by BIGSHELL_STATSOCK, if any
+ *
+ * @returns 0 on success, -1 on failure
+ */
+extern int statsock_init(void);
+
+/** Marks the start of a command list's execution */
+extern void statsock_begin(struct command_list const *cl);
+
+/** Marks the end of a command list's execution */
+extern void statsock_end(void);
+
+/** Adds the rusage of a reaped process to its job's totals */
+extern void statsock_reap(pid_t pgid, struct rusage const *ru);
+
+/** Renders a new snapshot, after a change to the job table */
+extern void statsock_update(void);
+
+/** Removes the socket (at exit) */
+extern void statsock_cleanup(void);
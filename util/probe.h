@@ -0,0 +1,35 @@
+/** The macros PROBE0() through PROBE5() define USDT static tracepoints in
+ * the "bigshell" provider, for use with bpftrace, perf or systemtap:
+ *
+ *   bpftrace -e 'usdt:./bigshell:bigshell:spawn { printf("%s\n", str(arg3)); }'
+ *
+ * When <sys/sdt.h> is available each probe is a single nop plus an ELF
+ * note; nothing happens unless a tracer attaches. Without it, or when
+ * BIGSHELL_NO_PROBES is defined, probes compile to empty statements and
+ * their arguments are not evaluated. Arguments must be integers or
+ * pointers. */
+#pragma once
+
+#if !defined(BIGSHELL_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define PROBE0(name) DTRACE_PROBE(bigshell, name)
+#define PROBE1(name, a) DTRACE_PROBE1(bigshell, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(bigshell, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(bigshell, name, a, b, c)
+#define PROBE4(name, a, b, c, d) DTRACE_PROBE4(bigshell, name, a, b, c, d)
+#define PROBE5(name, a, b, c, d, e)                                            \
+  DTRACE_PROBE5(bigshell, name, a, b, c, d, e)
+#endif
+#endif
+
+#ifndef PROBE0
+/* sizeof keeps the arguments "used" without evaluating them */
+#define PROBE0(name) ((void)0)
+#define PROBE1(name, a) ((void)sizeof(a))
+#define PROBE2(name, a, b) ((void)sizeof(a), (void)sizeof(b))
+#define PROBE3(name, a, b, c) (PROBE2(name, a, b), (void)sizeof(c))
+#define PROBE4(name, a, b, c, d) (PROBE3(name, a, b, c), (void)sizeof(d))
+#define PROBE5(name, a, b, c, d, e)                                            \
+  (PROBE4(name, a, b, c, d), (void)sizeof(e))
+#endif
@@ -0,0 +1,208 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+#define TRACE_RING_SIZE 1024 /* records, must be a power of two */
+#define TRACE_MSG_SIZE 112
+
+struct trace_record {
+  /* Index of the record plus one, stored last; a mismatch on dump means the
+   * record was being overwritten */
+  atomic_uint_fast64_t seq;
+  uint64_t ns;
+  char const *where;
+  unsigned cat;
+  char msg[TRACE_MSG_SIZE];
+};
+
+static char const *const category_names[TRACE_CATEGORY_COUNT] = {
+    [TRACE_PARSE] = "parse",
+    [TRACE_EXPAND] = "expand",
+    [TRACE_VARS] = "vars",
+    [TRACE_SPAWN] = "spawn",
+    [TRACE_WAIT] = "wait",
+    [TRACE_SIGNAL] = "signal",
+};
+
+unsigned trace_mask = 0;
+
+static struct trace_record ring[TRACE_RING_SIZE];
+static atomic_uint_fast64_t head = 0;
+static int crash_handler_armed = 0;
+
+static void
+crash_handler(int signo)
+{
+  static char const banner[] = "bigshell: fatal signal, trace follows\n";
+  write(STDERR_FILENO, banner, sizeof banner - 1);
+  trace_dump(STDERR_FILENO);
+  /* SA_RESETHAND restored the default action */
+  raise(signo);
+}
+
+static void
+arm_crash_handler(void)
+{
+  if (crash_handler_armed) return;
+  struct sigaction sa = {.sa_handler = crash_handler,
+                         .sa_flags = SA_RESETHAND | SA_NODEFER};
+  int const fatal[] = {SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT};
+  for (size_t i = 0; i < sizeof fatal / sizeof *fatal; ++i) {
+    sigaction(fatal[i], &sa, 0);
+  }
+  crash_handler_armed = 1;
+}
+
+int
+trace_set(char const *spec)
+{
+  unsigned mask = 0;
+  for (char const *c = spec; *c;) {
+    size_t len = strcspn(c, ",");
+    if (len == 3 && strncmp(c, "all", len) == 0) {
+      mask = (1u << TRACE_CATEGORY_COUNT) - 1;
+    } else if (len == 4 && strncmp(c, "none", len) == 0) {
+      mask = 0;
+    } else if (len) {
+      size_t i = 0;
+      for (; i < TRACE_CATEGORY_COUNT; ++i) {
+        if (strlen(category_names[i]) == len &&
+            strncmp(c, category_names[i], len) == 0) {
+          break;
+        }
+      }
+      if (i == TRACE_CATEGORY_COUNT) {
+        errno = EINVAL;
+        return -1;
+      }
+      mask |= 1u << i;
+    }
+    c += len;
+    if (*c == ',') ++c;
+  }
+  if (mask) arm_crash_handler();
+  trace_mask = mask;
+  return 0;
+}
+
+char *
+trace_get(char *buf, unsigned long size)
+{
+  size_t len = 0;
+  if (size) buf[0] = '\0';
+  for (size_t i = 0; i < TRACE_CATEGORY_COUNT; ++i) {
+    if (!(trace_mask & (1u << i))) continue;
+    int n = snprintf(buf + len,
+                     size - len,
+                     "%s%s",
+                     len ? "," : "",
+                     category_names[i]);
+    if (n < 0 || (size_t)n >= size - len) break;
+    len += n;
+  }
+  return buf;
+}
+
+int
+trace_init(void)
+{
+  char const *spec = getenv("BIGSHELL_TRACE");
+  if (!spec) return 0;
+  return trace_set(spec);
+}
+
+void(trace)(enum trace_category cat, char const *where, char const *fmt, ...)
+{
+  int e = errno;
+  uint_fast64_t idx = atomic_fetch_add_explicit(&head, 1, memory_order_relaxed);
+  struct trace_record *r = &ring[idx & (TRACE_RING_SIZE - 1)];
+  atomic_store_explicit(&r->seq, 0, memory_order_relaxed);
+
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  r->ns = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+  r->where = where;
+  r->cat = cat;
+  va_list ap;
+  va_start(ap, fmt);
+  vsnprintf(r->msg, sizeof r->msg, fmt, ap);
+  va_end(ap);
+
+  atomic_store_explicit(&r->seq, idx + 1, memory_order_release);
+  errno = e;
+}
+
+/* Appends a decimal number to buf, zero padded to width */
+static size_t
+put_u64(char *buf, uint64_t v, int width)
+{
+  char tmp[24];
+  int n = 0;
+  do {
+    tmp[n++] = '0' + v % 10;
+    v /= 10;
+  } while (v || n < width);
+  for (int i = 0; i < n; ++i) buf[i] = tmp[n - 1 - i];
+  return n;
+}
+
+static size_t
+put_str(char *buf, size_t cap, char const *s)
+{
+  size_t n = 0;
+  for (; s[n] && n < cap; ++n) buf[n] = s[n];
+  return n;
+}
+
+void
+trace_dump(int fd)
+{
+  int e = errno;
+  uint_fast64_t end = atomic_load_explicit(&head, memory_order_acquire);
+  uint_fast64_t start = end > TRACE_RING_SIZE ? end - TRACE_RING_SIZE : 0;
+  for (uint_fast64_t idx = start; idx < end; ++idx) {
+    struct trace_record const *r = &ring[idx & (TRACE_RING_SIZE - 1)];
+    if (atomic_load_explicit(&r->seq, memory_order_acquire) != idx + 1) {
+      continue;
+    }
+    /* "<sec>.<usec> [<cat>] <file:line>: <msg>\n" */
+    char line[64 + 2 * TRACE_MSG_SIZE];
+    size_t len = put_u64(line, r->ns / 1000000000, 1);
+    line[len++] = '.';
+    len += put_u64(line + len, r->ns % 1000000000 / 1000, 6);
+    len += put_str(line + len, 2, " [");
+    len += put_str(line + len, 8, category_names[r->cat]);
+    len += put_str(line + len, 2, "] ");
+    len += put_str(line + len, TRACE_MSG_SIZE - 4, r->where);
+    len += put_str(line + len, 2, ": ");
+    len += put_str(line + len, TRACE_MSG_SIZE, r->msg);
+    line[len++] = '\n';
+    for (size_t off = 0; off < len;) {
+      ssize_t n = write(fd, line + off, len - off);
+      if (n < 0) {
+        if (errno == EINTR) continue;
+        goto out;
+      }
+      off += n;
+    }
+  }
+out:
+  errno = e;
+}
+
+void
+trace_clear(void)
+{
+  for (size_t i = 0; i < TRACE_RING_SIZE; ++i) {
+    atomic_store_explicit(&ring[i].seq, 0, memory_order_relaxed);
+  }
+}
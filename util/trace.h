@@ -0,0 +1,73 @@
+/** The macro trace() can be used like printf() to record diagnostic
+ * information under a category. Categories are switched on and off at run
+ * time, with the BIGSHELL_TRACE environment variable or `set -o trace=...`.
+ * A disabled category costs a single test of a global bit mask; the format
+ * string and its arguments are not evaluated.
+ *
+ * Records go to a fixed-size in-memory ring buffer, not to stderr. The ring
+ * is written out by the `trace` builtin, or to stderr if the shell crashes
+ * with tracing enabled. */
+#pragma once
+#include <stdarg.h>
+
+enum trace_category {
+  TRACE_PARSE,
+  TRACE_EXPAND,
+  TRACE_VARS,
+  TRACE_SPAWN,
+  TRACE_WAIT,
+  TRACE_SIGNAL,
+  TRACE_CATEGORY_COUNT
+};
+
+/** bit (1 << category) is set for every enabled category */
+extern unsigned trace_mask;
+
+/** Reads BIGSHELL_TRACE from the environment
+ *
+ * @returns 0 on success, -1 on failure
+ */
+int trace_init(void);
+
+/** Selects the enabled categories
+ *
+ * @param [in]spec comma separated category names, "all" or "none"
+ * @returns 0 on success
+ * @returns -1 on error and sets `errno` (see exceptions)
+ *
+ * @exception EINVAL spec names an unknown category
+ *
+ * Enabling any category also arms the crash handler that dumps the ring.
+ */
+int trace_set(char const *spec);
+
+/** Writes the enabled categories, comma separated, to buf
+ *
+ * @returns buf
+ */
+char *trace_get(char *buf, unsigned long size);
+
+/** Writes the contents of the ring buffer to fd, oldest first
+ *
+ * Async-signal-safe.
+ */
+void trace_dump(int fd);
+
+/** Discards the contents of the ring buffer */
+void trace_clear(void);
+
+/** record a formatted trace message */
+void trace(enum trace_category cat, char const *where, char const *fmt, ...);
+
+#define trace_enabled(cat) __builtin_expect(!!(trace_mask & (1u << (cat))), 0)
+
+#define TRACE_STRINGIFY_(x) #x
+#define TRACE_STRINGIFY(x) TRACE_STRINGIFY_(x)
+
+#define trace(cat, fmt, ...)                                                   \
+  (trace_enabled(cat)                                                          \
+       ? (trace)(cat,                                                          \
+                 __FILE__ ":" TRACE_STRINGIFY(__LINE__),                       \
+                 fmt,                                                          \
+                 ##__VA_ARGS__)                                                \
+       : (void)0)
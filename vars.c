@@ -7,13 +7,18 @@
 #include <string.h>
 #include <unistd.h>
 
-#include "util/gprintf.h"
+#include "alloc.h"
+#include "util/trace.h"
 #include "vars.h"
 
 struct var {
   struct var *next;
   bool export : 1;
+  bool current : 1; /* value is current though exported (it was appended) */
+  bool stale : 1;   /* the environment is behind value */
   char *value;
+  size_t len; /* of value */
+  size_t cap; /* bytes allocated for value */
   char name[];
 };
 
@@ -86,7 +91,7 @@ new_var(char const *name)
 {
   assert(is_valid_varname(name));
   assert(!find_var(name));
-  struct var *v = malloc(sizeof *v + strlen(name) + 1);
+  struct var *v = alloc_malloc(ALLOC_VARS, sizeof *v + strlen(name) + 1);
   if (!v) return 0;
   strcpy(v->name, name);
 
@@ -96,7 +101,9 @@ new_var(char const *name)
   } else {
     v->export = 0;
   }
+  v->current = v->stale = 0;
   v->value = 0;
+  v->len = v->cap = 0;
   v->next = var_list;
   var_list = v;
   return v;
@@ -114,8 +121,8 @@ remove_var(char const *name)
   for (; *link; link = &((*link)->next)) {
     if (strcmp((*link)->name, name) == 0) {
       void *tmp = (*link)->next;
-      free((*link)->value);
-      free(*link);
+      alloc_free((*link)->value);
+      alloc_free(*link);
       *link = tmp;
       break;
     }
@@ -142,19 +149,76 @@ vars_set(char const *name, char const *value)
     errno = EINVAL;
     return -1;
   }
-  gprintf("vars_set(%s, %s)", name, value);
+  trace(TRACE_VARS, "vars_set(%s, %s)", name, value);
 
   struct var *v = ensure_var(name);
   if (!v) return -1;
 
   if (v->export) {
-    gprintf("%s=%s is exported, updating env", name, value);
+    trace(TRACE_VARS, "%s=%s is exported, updating env", name, value);
+    v->current = v->stale = 0;
+    /* setenv() never frees the strings it replaces, so don't churn it */
+    char const *old = getenv(name);
+    if (old && strcmp(old, value) == 0) return 0;
     return setenv(name, value, 1);
   }
 
-  char *dupval = strdup(value);
+  char *dupval = alloc_strdup(ALLOC_VARS, value);
   if (!dupval) return -1;
+  alloc_free(v->value);
   v->value = dupval;
+  v->len = strlen(value);
+  v->cap = v->len + 1;
+  return 0;
+}
+
+int
+vars_append(char const *name, char const *value)
+{
+  if (!name || !value || !is_valid_varname(name)) {
+    errno = EINVAL;
+    return -1;
+  }
+  trace(TRACE_VARS, "vars_append(%s, %s)", name, value);
+
+  struct var *v = ensure_var(name);
+  if (!v) return -1;
+
+  char const *base = v->value ? v->value : "";
+  size_t base_len = v->len;
+  if (v->export && !v->current) {
+    /* The environment has the value */
+    base = getenv(name);
+    if (!base) base = "";
+    base_len = strlen(base);
+  }
+  size_t const len = strlen(value);
+  size_t cap = v->cap;
+  if (base != v->value || base_len + len + 1 > cap) {
+    if (!cap) cap = 64;
+    while (cap < base_len + len + 1) cap *= 2;
+    char *buf = alloc_malloc(ALLOC_VARS, cap);
+    if (!buf) return -1;
+    memcpy(buf, base, base_len);
+    alloc_free(v->value);
+    v->value = buf;
+    v->cap = cap;
+  }
+  memcpy(v->value + base_len, value, len + 1);
+  v->len = base_len + len;
+  if (v->export) v->current = v->stale = 1;
+  return 0;
+}
+
+int
+vars_sync_env(void)
+{
+  for (struct var *v = var_list; v; v = v->next) {
+    if (!v->stale) continue;
+    trace(TRACE_VARS, "syncing appended var %s to env", v->name);
+    if (setenv(v->name, v->value, 1) < 0) return -1;
+    v->stale = 0;
+  }
   return 0;
 }
 
@@ -167,24 +231,22 @@ vars_get(char const *name)
     return 0;
   }
 
-  gprintf("searching for %s in local var list", name);
+  trace(TRACE_VARS, "searching for %s in local var list", name);
   /* Look through our local var list */
   struct var *v = find_var(name);
-  if (v && !v->export) {
-    gprintf("found local var %s with value %s", name, v->value);
+  if (v && (!v->export || v->current)) {
+    trace(TRACE_VARS, "found local var %s with value %s", name, v->value);
     return v->value;
   }
 
-  gprintf("searching for %s in environment", name);
+  trace(TRACE_VARS, "searching for %s in environment", name);
   /* Fallback to searching environment */
   char const *value = getenv(name);
-#ifndef NDEBUG
   if (value) {
-    gprintf("found env var %s with value %s", name, value);
+    trace(TRACE_VARS, "found env var %s with value %s", name, value);
   } else {
-    gprintf("did not find var %s", name);
+    trace(TRACE_VARS, "did not find var %s", name);
   }
-#endif
   return value;
 }
 
@@ -196,7 +258,7 @@ vars_unset(char const *name)
     errno = EINVAL;
     return -1;
   }
-  gprintf("unsetting var %s", name);
+  trace(TRACE_VARS, "unsetting var %s", name);
   remove_var(name);
   return unsetenv(name);
 }
@@ -209,19 +271,24 @@ vars_export(char const *name)
     errno = EINVAL;
     return -1;
   }
-  gprintf("marking %s for export", name);
+  trace(TRACE_VARS, "marking %s for export", name);
   struct var *v = ensure_var(name);
   if (!v) return -1;
 
+  /* A value assigned since an earlier export is already in the env */
+  if (v->export && !v->current) return 0;
+
   /* Mark exported */
   v->export = 1;
 
   /* Only actually export to env if already set */
   if (v->value) {
-    gprintf("exporting value %s for var %s", v->value, name);
+    trace(TRACE_VARS, "exporting value %s for var %s", v->value, name);
     if (setenv(v->name, v->value, 1) < 0) {
       return -1;
     }
+    v->current = 1;
+    v->stale = 0;
   }
   return 0;
 }
@@ -233,7 +300,7 @@ vars_cleanup(void)
   while (var_list) {
     struct var *v = var_list;
     var_list = v->next;
-    free(v->value);
-    free(v);
+    alloc_free(v->value);
+    alloc_free(v);
   }
 }
@@ -14,6 +14,27 @@
  */
 int vars_set(char const *name, char const *value);
 
+/** appends value to a shell variable's value
+ *  @returns 0 on success
+ *  @returns -1 on error and sets `errno` (see exceptions)
+ *
+ *  @exception EINVAL name or value is a null pointer
+ *  @exception EINVAL name is not a valid variable name
+ *  @exception ENOMEM not enough memory to record variable
+ *
+ *  The value grows in place, in a buffer whose capacity doubles, so building
+ *  a value by appending takes time linear in its length. An exported
+ *  variable's environment entry is updated by vars_sync_env().
+ */
+int vars_append(char const *name, char const *value);
+
+/** brings the environment up to date with values appended to exported
+ *  variables; called before the environment is passed on, at fork()
+ *  @returns 0 on success
+ *  @returns -1 on error and sets `errno`
+ */
+int vars_sync_env(void);
+
 /** gets the value of a shell variable
  *  @returns 0 on success
  *  @returns -1 on error and sets `errno` (see exceptions)
@@ -1,15 +1,27 @@
 #define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE /* wait4() */
 #include <assert.h>
 #include <err.h>
 #include <errno.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <sys/resource.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
+#include "cgroup.h"
+#include "execlog.h"
+#include "fgboost.h"
 #include "jobs.h"
+#include "lineedit.h"
 #include "params.h"
 #include "parser.h"
+#include "perfctr.h"
+#include "pipesize.h"
+#include "stats.h"
+#include "statsock.h"
+#include "util/probe.h"
+#include "util/trace.h"
 #include "wait.h"
 
 int
@@ -20,6 +32,9 @@ wait_on_fg_pgid(pid_t const pgid)
     jid_t const jid = jobs_get_jid(pgid);
     if (jid < 0) return -1;
 
+    uint64_t const wait_start = stats_now();
+    lineedit_release();
+
     /* Make sure the foreground group is running */
     if (kill(-pgid, SIGCONT) < 0) {
         if (errno == ESRCH) {
@@ -61,6 +76,7 @@ wait_on_fg_pgid(pid_t const pgid)
 
   /* XXX From this point on, all exit paths must account for setting bigshell
    * back to the foreground process group--no naked return statements */
+    fgboost_begin(pgid);
     int retval = 0;  // Default return value
     int last_status = 0;  // Track the last valid status
 
@@ -75,7 +91,13 @@ wait_on_fg_pgid(pid_t const pgid)
     for (;;) {
         /* Wait on ALL processes in the process group 'pgid' */
         int status;
-        pid_t res = waitpid(-pgid, &status, 0);  // Wait for any process in the group
+        struct rusage ru;
+        pid_t res = wait4(-pgid, &status, WUNTRACED, &ru);  // Wait for any process in the group
+        trace(TRACE_WAIT,
+              "fg wait4(-%jd) = %jd, status %#x",
+              (intmax_t)pgid,
+              (intmax_t)res,
+              res > 0 ? status : 0);
         if (res < 0) {
             /* Error occurred (some errors are ok, see below)
              *
@@ -94,9 +116,12 @@ wait_on_fg_pgid(pid_t const pgid)
                     params.status = 128 + WTERMSIG(status);
                 }
 
+                perfctr_release(pgid);
+                cgroup_release(pgid);
                 if (jobs_remove_pgid(pgid) < 0) {
                     // DO NOT treat this as a fatal error; continue execution
                 }
+                statsock_update();
 
                 retval = 0;  // Indicate success even if job removal fails
                 goto out;
@@ -109,6 +134,12 @@ wait_on_fg_pgid(pid_t const pgid)
         }
 
         assert(res > 0);  // Ensure a valid child process was waited on
+        execlog_reap(res, status, &ru);
+        if (WIFEXITED(status) || WIFSIGNALED(status)) {
+          statsock_reap(pgid, &ru);
+          pipesize_reap(res, &ru);
+        }
+        PROBE4(wait__reap, jid, pgid, res, status);
 
         /* Record the status for reporting later when we see ECHILD */
         if (jobs_set_status(jid, status) < 0) goto err;
@@ -130,6 +161,7 @@ out:
         retval = -1;
     }
 
+    fgboost_end();
     if (is_interactive) {
         /* Make BigShell the foreground process group again
          *
@@ -144,6 +176,9 @@ out:
         }
     }
 
+    uint64_t const wait_ns =
+        stats_record_since(STATS_WAIT, wait_start) - wait_start;
+    PROBE3(wait__fg__done, jid, pgid, wait_ns);
     return retval;
 }
 
@@ -165,11 +200,17 @@ wait_on_bg_jobs()
     pid_t pgid = jobs[i].pgid;
     jid_t jid = jobs[i].jid;
     for (;;) {
-      /* TODO: Modify the following line to wait for process group
-       * XXX make sure to do a nonblocking wait!
-       */
+      /* Nonblocking wait on this job's process group only */
       int status;
-      pid_t pid = waitpid(0, &status, 0);
+      struct rusage ru;
+      pid_t pid = wait4(-pgid, &status, WNOHANG | WUNTRACED, &ru);
+      if (pid != 0) {
+        trace(TRACE_WAIT,
+              "bg wait4(-%jd) = %jd, status %#x",
+              (intmax_t)pgid,
+              (intmax_t)pid,
+              pid > 0 ? status : 0);
+      }
       if (pid == 0) {
         /* Unwaited children that haven't exited */
         break;
@@ -184,7 +225,10 @@ wait_on_bg_jobs()
           } else if (WIFSIGNALED(status)) {
             fprintf(stderr, "[%jd] Terminated\n", (intmax_t)jid);
           }
+          perfctr_release(pgid);
+          cgroup_release(pgid);
           jobs_remove_pgid(pgid);
+          statsock_update();
           job_count = jobs_get_joblist_size();
           jobs = jobs_get_joblist();
           break;
@@ -192,6 +236,13 @@ wait_on_bg_jobs()
         return -1; /* Other errors are not ok */
       }
 
+      execlog_reap(pid, status, &ru);
+      if (WIFEXITED(status) || WIFSIGNALED(status)) {
+        statsock_reap(pgid, &ru);
+        pipesize_reap(pid, &ru);
+      }
+      PROBE4(wait__reap, jid, pgid, pid, status);
+
       /* Record status for reporting later when we see ECHILD */
       if (jobs_set_status(jid, status) < 0) return -1;
 